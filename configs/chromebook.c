@@ -23,6 +23,8 @@ struct {
 	struct jailhouse_memory mem_regions[1];
 } __attribute__((packed)) config = {
 	.header = {
+		.signature = JAILHOUSE_SYSTEM_SIGNATURE,
+		.revision = JAILHOUSE_CONFIG_REVISION,
 		.hypervisor_memory = {
 			.phys_start = 0xbc000000,
 			.size = 0x4000000,
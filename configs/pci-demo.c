@@ -27,6 +27,8 @@ struct {
 	struct jailhouse_pci_capability pci_caps[1];
 } __attribute__((packed)) config = {
 	.cell = {
+		.signature = JAILHOUSE_CELL_DESC_SIGNATURE,
+		.revision = JAILHOUSE_CONFIG_REVISION,
 		.name = "pci-demo",
 		.flags = JAILHOUSE_CELL_PASSIVE_COMMREG,
 
@@ -31,6 +31,8 @@ struct {
 	struct jailhouse_pci_capability pci_caps[3];
 } __attribute__((packed)) config = {
 	.header = {
+		.signature = JAILHOUSE_SYSTEM_SIGNATURE,
+		.revision = JAILHOUSE_CONFIG_REVISION,
 		.hypervisor_memory = {
 			.phys_start = 0x3c000000,
 			.size = 0x4000000 - 0x4000,
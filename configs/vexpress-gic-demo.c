@@ -9,6 +9,8 @@ struct {
 	struct jailhouse_memory mem_regions[2];
 } __attribute__((packed)) config = {
 	.cell = {
+		.signature = JAILHOUSE_CELL_DESC_SIGNATURE,
+		.revision = JAILHOUSE_CONFIG_REVISION,
 		.name = "gic-demo",
 		.flags = JAILHOUSE_CELL_PASSIVE_COMMREG,
 
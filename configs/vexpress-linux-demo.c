@@ -10,6 +10,8 @@ struct {
 	struct jailhouse_irqchip irqchips[1];
 } __attribute__((packed)) config = {
 	.cell = {
+		.signature = JAILHOUSE_CELL_DESC_SIGNATURE,
+		.revision = JAILHOUSE_CONFIG_REVISION,
 		.name = "linux-demo",
 		.flags = JAILHOUSE_CELL_PASSIVE_COMMREG,
 
@@ -10,6 +10,8 @@ struct {
 	struct jailhouse_irqchip irqchips[1];
 } __attribute__((packed)) config = {
 	.header = {
+		.signature = JAILHOUSE_SYSTEM_SIGNATURE,
+		.revision = JAILHOUSE_CONFIG_REVISION,
 		.hypervisor_memory = {
 			.phys_start = 0xa0000000,
 			.size = 0x4000000 - 0x2000,
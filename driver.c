@@ -12,9 +12,11 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/acpi.h>
 #include <linux/cpu.h>
 #include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/interrupt.h>
 #include <linux/miscdevice.h>
 #include <linux/firmware.h>
 #include <linux/mm.h>
@@ -24,6 +26,7 @@
 #include <linux/reboot.h>
 #include <linux/vmalloc.h>
 #include <linux/io.h>
+#include <linux/workqueue.h>
 #include <asm/smp.h>
 #include <asm/cacheflush.h>
 
@@ -82,6 +85,7 @@ struct cell {
 	struct kobject kobj;
 	struct list_head entry;
 	unsigned int id;
+	int last_state;
 	cpumask_t cpus_assigned;
 	u32 num_memory_regions;
 	struct jailhouse_memory *memory_regions;
@@ -102,6 +106,12 @@ static int error_code;
 static LIST_HEAD(cells);
 static struct cell *root_cell;
 static struct kobject *cells_dir;
+static struct jailhouse_fault_log *fault_log;
+static int state_notify_gsi = -1;
+static int state_notify_irq = -1;
+
+static void state_change_work_fn(struct work_struct *work);
+static DECLARE_WORK(state_change_work, state_change_work_fn);
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 
@@ -333,11 +343,83 @@ static struct cell *find_cell(struct jailhouse_cell_id *cell_id)
 
 static void delete_cell(struct cell *cell)
 {
+	/* waiters on the state attribute will find it gone */
+	sysfs_notify(&cell->kobj, NULL, "state");
+
 	list_del(&cell->entry);
 	sysfs_remove_group(&cell->kobj, &stats_attr_group);
 	kobject_put(&cell->kobj);
 }
 
+/* caller holds the lock */
+static void update_cell_state(struct cell *cell)
+{
+	int state;
+
+	state = jailhouse_call_arg1(JAILHOUSE_HC_CELL_GET_STATE, cell->id);
+	if (state != cell->last_state) {
+		cell->last_state = state;
+		sysfs_notify(&cell->kobj, NULL, "state");
+	}
+}
+
+static void state_change_work_fn(struct work_struct *work)
+{
+	struct cell *cell;
+
+	mutex_lock(&lock);
+
+	if (enabled)
+		list_for_each_entry(cell, &cells, entry)
+			if (cell != root_cell)
+				update_cell_state(cell);
+
+	mutex_unlock(&lock);
+}
+
+static irqreturn_t state_notify_handler(int irq, void *dev_id)
+{
+	schedule_work(&state_change_work);
+	return IRQ_HANDLED;
+}
+
+static void free_state_notify_irq(void)
+{
+	if (state_notify_irq >= 0) {
+		free_irq(state_notify_irq, jailhouse_dev);
+		state_notify_irq = -1;
+	}
+#if defined(CONFIG_X86) && defined(CONFIG_ACPI)
+	if (state_notify_gsi >= 0)
+		acpi_unregister_gsi(state_notify_gsi);
+#endif
+	state_notify_gsi = -1;
+}
+
+static void request_state_notify_irq(unsigned int hw_irq)
+{
+	int irq = -ENOSYS;
+
+	if (hw_irq == 0)
+		return;
+
+#if defined(CONFIG_X86) && defined(CONFIG_ACPI)
+	irq = acpi_register_gsi(NULL, hw_irq, ACPI_EDGE_SENSITIVE,
+				ACPI_ACTIVE_HIGH);
+	if (irq >= 0)
+		state_notify_gsi = hw_irq;
+#endif
+	if (irq >= 0 && request_irq(irq, state_notify_handler, 0, "jailhouse",
+				    jailhouse_dev) == 0) {
+		state_notify_irq = irq;
+		return;
+	}
+
+	pr_warn("jailhouse: Unable to set up state change interrupt %u\n",
+		hw_irq);
+	free_state_notify_irq();
+}
+
 static void *jailhouse_ioremap(phys_addr_t phys, unsigned long virt,
 			       unsigned long size)
 {
@@ -391,6 +473,16 @@ static int jailhouse_enable(struct jailhouse_system __user *arg)
 		return -EFAULT;
 	config_header.root_cell.name[JAILHOUSE_CELL_NAME_MAXLEN] = 0;
 
+	if (memcmp(config_header.signature, JAILHOUSE_SYSTEM_SIGNATURE,
+		   sizeof(config_header.signature)) != 0) {
+		pr_err("jailhouse: Not a system configuration\n");
+		return -EINVAL;
+	}
+	if (config_header.revision != JAILHOUSE_CONFIG_REVISION) {
+		pr_err("jailhouse: Configuration revision mismatch\n");
+		return -EINVAL;
+	}
+
 	if (mutex_lock_interruptible(&lock) != 0)
 		return -EINTR;
 
@@ -473,6 +565,12 @@ static int jailhouse_enable(struct jailhouse_system __user *arg)
 	root_cell->id = 0;
 	register_cell(root_cell);
 
+	err = jailhouse_call_arg1(JAILHOUSE_HC_HYPERVISOR_GET_INFO,
+				  JAILHOUSE_INFO_FAULT_LOG);
+	fault_log = err < 0 ? NULL : hypervisor_mem + err;
+
+	request_state_notify_irq(config->state_notify_irq);
+
 	mutex_unlock(&lock);
 
 	pr_info("The Jailhouse is opening.\n");
@@ -546,7 +644,10 @@ static int jailhouse_disable(void)
 	if (err)
 		goto unlock_out;
 
+	free_state_notify_irq();
+
 	vunmap(hypervisor_mem);
+	fault_log = NULL;
 
 	for_each_cpu(cpu, &offlined_cpus) {
 		if (cpu_up(cpu) != 0)
@@ -592,6 +693,18 @@ static int jailhouse_cell_create(struct jailhouse_cell_create __user *arg)
 	}
 	config->name[JAILHOUSE_CELL_NAME_MAXLEN] = 0;
 
+	if (memcmp(config->signature, JAILHOUSE_CELL_DESC_SIGNATURE,
+		   sizeof(config->signature)) != 0) {
+		pr_err("jailhouse: Not a cell configuration\n");
+		err = -EINVAL;
+		goto kfree_config_out;
+	}
+	if (config->revision != JAILHOUSE_CONFIG_REVISION) {
+		pr_err("jailhouse: Configuration revision mismatch\n");
+		err = -EINVAL;
+		goto kfree_config_out;
+	}
+
 	if (mutex_lock_interruptible(&lock) != 0) {
 		err = -EINTR;
 		goto kfree_config_out;
@@ -638,6 +751,7 @@ static int jailhouse_cell_create(struct jailhouse_cell_create __user *arg)
 
 	cell->id = id;
 	register_cell(cell);
+	update_cell_state(cell);
 
 	pr_info("Created Jailhouse cell \"%s\"\n", config->name);
 
@@ -750,6 +864,8 @@ static int jailhouse_cell_load(struct jailhouse_cell_load __user *arg)
 	if (err)
 		goto unlock_out;
 
+	update_cell_state(cell);
+
 	for (n = cell_load.num_preload_images; n > 0; n--, image++) {
 		err = load_image(cell, image);
 		if (err)
@@ -776,6 +892,30 @@ static int jailhouse_cell_start(const char __user *arg)
 		return err;
 
 	err = jailhouse_call_arg1(JAILHOUSE_HC_CELL_START, cell->id);
+	if (!err)
+		update_cell_state(cell);
+
+	mutex_unlock(&lock);
+
+	return err;
+}
+
+static int jailhouse_cell_restart(const char __user *arg)
+{
+	struct jailhouse_cell_id cell_id;
+	struct cell *cell;
+	int err;
+
+	if (copy_from_user(&cell_id, arg, sizeof(cell_id)))
+		return -EFAULT;
+
+	err = cell_management_prologue(&cell_id, &cell);
+	if (err)
+		return err;
+
+	err = jailhouse_call_arg1(JAILHOUSE_HC_CELL_RESTART, cell->id);
+	if (!err)
+		update_cell_state(cell);
 
 	mutex_unlock(&lock);
 
@@ -848,6 +988,9 @@ static long jailhouse_ioctl(struct file *file, unsigned int ioctl,
 	case JAILHOUSE_CELL_DESTROY:
 		err = jailhouse_cell_destroy((const char __user *)arg);
 		break;
+	case JAILHOUSE_CELL_RESTART:
+		err = jailhouse_cell_restart((const char __user *)arg);
+		break;
 	default:
 		err = -EINVAL;
 		break;
@@ -937,11 +1080,94 @@ static ssize_t remap_pool_used_show(struct device *dev,
 	return info_show(dev, buffer, JAILHOUSE_INFO_REMAP_POOL_USED);
 }
 
+/* takes a consistent snapshot of the fault log, caller holds the lock */
+static void copy_fault_log(struct jailhouse_fault_log *log)
+{
+	u32 seq;
+
+	do {
+		while ((seq = fault_log->seq) & 1)
+			cpu_relax();
+		smp_rmb();
+		memcpy(log, (void *)fault_log, sizeof(*log));
+		smp_rmb();
+	} while (seq != fault_log->seq);
+}
+
+static ssize_t fault_log_show(struct device *dev,
+			      struct device_attribute *attr, char *buffer)
+{
+	struct jailhouse_fault_record *rec;
+	struct jailhouse_fault_log *log;
+	struct jailhouse_cell_id cell_id;
+	struct cell *cell;
+	ssize_t written = 0;
+	unsigned int n;
+
+	log = kmalloc(sizeof(*log), GFP_KERNEL);
+	if (!log)
+		return -ENOMEM;
+
+	if (mutex_lock_interruptible(&lock) != 0) {
+		kfree(log);
+		return -EINTR;
+	}
+
+	if (!enabled || !fault_log)
+		goto unlock_out;
+
+	copy_fault_log(log);
+
+	for (n = 0; n < JAILHOUSE_FAULT_LOG_SIZE; n++) {
+		rec = &log->records[(log->next + n) % JAILHOUSE_FAULT_LOG_SIZE];
+		if (rec->count == 0)
+			continue;
+
+		cell_id.id = rec->cell_id;
+		cell = rec->cell_id == JAILHOUSE_FAULT_NO_CELL ?
+			NULL : find_cell(&cell_id);
+
+		written += scnprintf(buffer + written, PAGE_SIZE - written,
+				     "%04x:%02x:%02x.%x %s 0x%02x %u 0x%016llx "
+				     "%u\n", rec->segment, rec->source_id >> 8,
+				     (rec->source_id >> 3) & 0x1f,
+				     rec->source_id & 7,
+				     cell ? kobject_name(&cell->kobj) : "-",
+				     rec->reason, rec->type,
+				     (unsigned long long)rec->address,
+				     rec->count);
+	}
+
+unlock_out:
+	mutex_unlock(&lock);
+	kfree(log);
+
+	return written;
+}
+
+static ssize_t faults_dropped_show(struct device *dev,
+				   struct device_attribute *attr, char *buffer)
+{
+	unsigned int dropped = 0;
+
+	if (mutex_lock_interruptible(&lock) != 0)
+		return -EINTR;
+
+	if (enabled && fault_log)
+		dropped = fault_log->dropped;
+
+	mutex_unlock(&lock);
+
+	return sprintf(buffer, "%u\n", dropped);
+}
+
 static DEVICE_ATTR_RO(enabled);
 static DEVICE_ATTR_RO(mem_pool_size);
 static DEVICE_ATTR_RO(mem_pool_used);
 static DEVICE_ATTR_RO(remap_pool_size);
 static DEVICE_ATTR_RO(remap_pool_used);
+static DEVICE_ATTR_RO(fault_log);
+static DEVICE_ATTR_RO(faults_dropped);
 
 static struct attribute *jailhouse_sysfs_entries[] = {
 	&dev_attr_enabled.attr,
@@ -949,6 +1175,8 @@ static struct attribute *jailhouse_sysfs_entries[] = {
 	&dev_attr_mem_pool_used.attr,
 	&dev_attr_remap_pool_size.attr,
 	&dev_attr_remap_pool_used.attr,
+	&dev_attr_fault_log.attr,
+	&dev_attr_faults_dropped.attr,
 	NULL
 };
 
@@ -999,6 +1227,7 @@ static void __exit jailhouse_exit(void)
 {
 	unregister_reboot_notifier(&jailhouse_shutdown_nb);
 	misc_deregister(&jailhouse_misc_dev);
+	cancel_work_sync(&state_change_work);
 	kobject_put(cells_dir);
 	sysfs_remove_group(&jailhouse_dev->kobj, &jailhouse_attribute_group);
 	root_device_unregister(jailhouse_dev);
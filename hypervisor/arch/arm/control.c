@@ -15,6 +15,7 @@
 #include <asm/platform.h>
 #include <asm/processor.h>
 #include <asm/sysregs.h>
+#include <asm/timer.h>
 #include <asm/traps.h>
 #include <jailhouse/control.h>
 #include <jailhouse/printk.h>
@@ -89,6 +90,26 @@ static void arch_reset_el1(struct registers *regs)
 	arm_write_sysreg(TPIDRPRW, 0);
 }
 
+/*
+ * Cells normally own their CPUs, so WFI and WFE execute natively: a physical
+ * interrupt, like the SGI of a management request, still wakes the CPU up and
+ * traps. Cells can ask for trapping in their config, e.g. to account for their
+ * idle time.
+ */
+void arch_cell_wait_traps_init(struct cell *cell)
+{
+	u32 flags = cell->config->flags;
+	unsigned long hcr;
+
+	arm_read_sysreg(HCR, hcr);
+	hcr &= ~(HCR_TWI_BIT | HCR_TWE_BIT);
+	if (flags & JAILHOUSE_CELL_TRAP_WFI)
+		hcr |= HCR_TWI_BIT;
+	if (flags & JAILHOUSE_CELL_TRAP_WFE)
+		hcr |= HCR_TWE_BIT;
+	arm_write_sysreg(HCR, hcr);
+}
+
 void arch_reset_self(struct per_cpu *cpu_data)
 {
 	int err = 0;
@@ -107,7 +128,7 @@ void arch_reset_self(struct per_cpu *cpu_data)
 	 * On all CPUs, invalidate the instruction caches to take into account
 	 * the potential new instructions.
 	 */
-	arch_cell_caches_flush(cell);
+	arch_cell_caches_flush(cpu_data, cell);
 
 	/*
 	 * We come from the IRQ handler, but we won't return there, so the IPI
@@ -122,6 +143,8 @@ void arch_reset_self(struct per_cpu *cpu_data)
 			printk("IRQ setup failed\n");
 	}
 
+	arch_cell_wait_traps_init(cell);
+
 	/* Wait for the driver to call cpu_up */
 	if (cell == &root_cell || is_shutdown)
 		reset_address = arch_smp_spin(cpu_data, root_cell.arch.smp);
@@ -179,6 +202,8 @@ struct registers* arch_handle_exit(struct per_cpu *cpu_data,
 {
 	cpu_data->stats[JAILHOUSE_CPU_STAT_VMEXITS_TOTAL]++;
 
+	irqchip_guest_exited(cpu_data);
+
 	switch (regs->exit_reason) {
 	case EXIT_REASON_IRQ:
 		irqchip_handle_irq(cpu_data);
@@ -213,6 +238,8 @@ struct registers* arch_handle_exit(struct per_cpu *cpu_data,
 		/* Won't return here. */
 		arch_shutdown_self(cpu_data);
 
+	irqchip_guest_resume(cpu_data);
+
 	return regs;
 }
 
@@ -251,6 +278,62 @@ void arch_reset_cpu(unsigned int cpu_id)
 		printk("ERROR: unable to reset CPU%d (was running)\n", cpu_id);
 }
 
+void arch_cell_monitor_kick(unsigned int cpu_id)
+{
+	struct sgi sgi;
+
+	sgi.routing_mode = 0;
+	sgi.aff1 = 0;
+	sgi.aff2 = 0;
+	sgi.aff3 = 0;
+	sgi.targets = 1 << cpu_id;
+	sgi.id = SGI_MONITOR;
+
+	irqchip_send_sgi(&sgi);
+}
+
+/*
+ * Both paths deassert a pending HYP_TIMER_IRQ: deadlines lie at least
+ * CELL_MONITOR_INTERVAL_US in the future.
+ */
+static void arch_check_cell_monitor(struct per_cpu *cpu_data)
+{
+	u64 deadline = cell_monitor_check(cpu_data);
+
+	if (deadline)
+		timer_set_deadline(deadline);
+	else
+		timer_cancel();
+}
+
+void arch_notify_root_cell(void)
+{
+	u32 irq = system_config->state_notify_irq;
+
+	if (irq < 32 || !spi_in_cell(&root_cell, irq - 32))
+		return;
+
+	irqchip_send_virtual_spi(per_cpu(next_cpu(-1, root_cell.cpu_set, -1)),
+				 irq);
+}
+
+void arch_monitor_address(const volatile void *addr)
+{
+	u32 tmp;
+
+	/*
+	 * Mark the granule for exclusive access. A write by another agent
+	 * clears the global monitor, which generates a WFE wake-up event.
+	 */
+	asm volatile("ldrex %0, [%1]" : "=&r" (tmp) : "r" (addr) : "memory");
+}
+
+void arch_wait_for_monitor(void)
+{
+	/* bounded by the event stream, see timer_wait_for_event */
+	timer_wait_for_event();
+}
+
 void arch_suspend_cpu(unsigned int cpu_id)
 {
 	struct sgi sgi;
@@ -266,10 +349,17 @@ void arch_suspend_cpu(unsigned int cpu_id)
 	sgi.id = SGI_CPU_OFF;
 
 	irqchip_send_sgi(&sgi);
+
+	/*
+	 * Like on x86, the CPU is stopped on return, so a subsequent resume
+	 * cannot overtake the stop request.
+	 */
+	psci_wait_cpu_stopped(cpu_id);
 }
 
 void arch_handle_sgi(struct per_cpu *cpu_data, u32 irqn)
 {
+	/* virtual SGIs are already counted by their sender */
 	cpu_data->stats[JAILHOUSE_CPU_STAT_VMEXITS_MANAGEMENT]++;
 
 	switch (irqn) {
@@ -279,13 +369,17 @@ void arch_handle_sgi(struct per_cpu *cpu_data, u32 irqn)
 	case SGI_CPU_OFF:
 		arch_suspend_self(cpu_data);
 		break;
+	case SGI_MONITOR:
+		arch_check_cell_monitor(cpu_data);
+		break;
 	default:
 		printk("WARN: unknown SGI received %d\n", irqn);
 	}
 }
 
 /*
- * Handle the maintenance interrupt, the rest is injected into the cell.
+ * Handle the maintenance interrupt and the hypervisor timer, the rest is
+ * injected into the cell.
  * Return true when the IRQ has been handled by the hyp.
  */
 bool arch_handle_phys_irq(struct per_cpu *cpu_data, u32 irqn)
@@ -297,6 +391,13 @@ bool arch_handle_phys_irq(struct per_cpu *cpu_data, u32 irqn)
 		return true;
 	}
 
+	if (irqn == HYP_TIMER_IRQ) {
+		cpu_data->stats[JAILHOUSE_CPU_STAT_VMEXITS_MANAGEMENT]++;
+
+		arch_check_cell_monitor(cpu_data);
+		return true;
+	}
+
 	cpu_data->stats[JAILHOUSE_CPU_STAT_VMEXITS_VIRQ]++;
 
 	irqchip_set_pending(cpu_data, irqn, true);
@@ -307,13 +408,22 @@ bool arch_handle_phys_irq(struct per_cpu *cpu_data, u32 irqn)
 int arch_cell_create(struct per_cpu *cpu_data, struct cell *cell)
 {
 	int err;
-	unsigned int cpu;
-	unsigned int virt_id = 0;
 
 	err = arch_mmu_cell_init(cell);
 	if (err)
 		return err;
 
+	register_smp_ops(cell);
+
+	return 0;
+}
+
+/* all root cell CPUs (except cpu_data) have to be stopped */
+int arch_cell_assign_resources(struct per_cpu *cpu_data, struct cell *cell)
+{
+	unsigned int cpu;
+	unsigned int virt_id = 0;
+
 	/*
 	 * Generate a virtual CPU id according to the position of each CPU in
 	 * the cell set
@@ -327,28 +437,40 @@ int arch_cell_create(struct per_cpu *cpu_data, struct cell *cell)
 	irqchip_cell_init(cell);
 	irqchip_root_cell_shrink(cell);
 
-	register_smp_ops(cell);
-
 	return 0;
 }
 
-void arch_cell_destroy(struct per_cpu *cpu_data, struct cell *cell)
+/* all root cell CPUs (except cpu_data) have to be stopped */
+void arch_cell_release_resources(struct per_cpu *cpu_data, struct cell *cell)
 {
 	unsigned int cpu;
 	struct per_cpu *percpu;
 
-	arch_mmu_cell_destroy(cell);
-
 	for_each_cpu(cpu, cell->cpu_set) {
 		percpu = per_cpu(cpu);
 		/* Re-assign the physical IDs for the root cell */
 		percpu->virt_id = percpu->cpu_id;
+		psci_guest_cpu_reset(percpu);
 		arch_reset_cpu(cpu);
 	}
 
 	irqchip_cell_exit(cell);
 }
 
+void arch_cell_reset_devices(struct cell *cell)
+{
+}
+
+void arch_cell_reset(struct cell *cell)
+{
+	psci_cell_reset(cell);
+}
+
+void arch_cell_destroy(struct per_cpu *cpu_data, struct cell *cell)
+{
+	arch_mmu_cell_destroy(cell);
+}
+
 void arch_config_commit(struct per_cpu *cpu_data,
 			struct cell *cell_added_removed)
 {
@@ -362,16 +484,21 @@ void arch_config_commit(struct per_cpu *cpu_data,
 	 * not yet been populated by register_root_cpu, so the only invalidated
 	 * TLBs are those of the master CPU.
 	 */
-	for_each_cpu_except(cpu, root_cell.cpu_set, cpu_data->cpu_id)
-		per_cpu(cpu)->cell_pages_dirty = true;
-
 	if (cell_added_removed) {
 		for_each_cpu_except(cpu, cell_added_removed->cpu_set,
 				    cpu_data->cpu_id)
 			per_cpu(cpu)->cell_pages_dirty = true;
 	}
 
-	arch_cpu_tlb_flush(cpu_data);
+	/*
+	 * This CPU belongs to the root cell and runs with its VMID, so a single
+	 * broadcast invalidates the root cell's entries on all CPUs, and the
+	 * other root CPUs don't have to flush when they resume. A TLBI by IPA
+	 * would not be enough: it leaves the combined stage 1 and 2 entries.
+	 */
+	arm_write_sysreg(TLBIALLIS, 1);
+	dsb(ish);
+	cpu_data->cell_pages_dirty = false;
 }
 
 void arch_panic_stop(struct per_cpu *cpu_data)
@@ -17,7 +17,6 @@
 #include <asm/irqchip.h>
 #include <asm/percpu.h>
 #include <asm/platform.h>
-#include <asm/spinlock.h>
 #include <asm/traps.h>
 #include <jailhouse/control.h>
 
@@ -27,26 +26,93 @@
 extern void *gicd_base;
 extern unsigned int gicd_size;
 
-static DEFINE_SPINLOCK(dist_lock);
-
 /* The GIC interface numbering does not necessarily match the logical map */
 u8 target_cpu_map[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 
+/*
+ * Copy of the distributor configuration registers. Each SPI belongs to exactly
+ * one cell, so a single copy serves all of them. Only the words of the SPIs are
+ * used, those of the banked SGIs and PPIs are accessed directly.
+ */
+static unsigned long dist_igroupr[32];
+static unsigned long dist_icfgr[64];
+static unsigned long dist_ipriorityr[256];
+static unsigned long dist_itargetsr[256];
+
+unsigned int gic_num_irqs(void)
+{
+	unsigned int num_irqs = readl_relaxed(gicd_base + GICD_TYPER);
+
+	num_irqs = ((num_irqs & GICD_TYPER_ITLINESNUMBER) + 1) * 32;
+	if (num_irqs > 1020)
+		num_irqs = 1020;
+
+	return num_irqs;
+}
+
+/*
+ * Load the SPI configuration found in the distributor, e.g. programmed by the
+ * root cell before the hypervisor was enabled.
+ */
+void gic_dist_shadow_init(void)
+{
+	unsigned int irq, num_irqs = gic_num_irqs();
+
+	for (irq = 32; irq < num_irqs; irq += 4) {
+		dist_ipriorityr[irq / 4] =
+			readl_relaxed(gicd_base + GICD_IPRIORITYR + irq);
+		dist_itargetsr[irq / 4] =
+			readl_relaxed(gicd_base + GICD_ITARGETSR + irq);
+		if (irq % 16 == 0)
+			dist_icfgr[irq / 16] = readl_relaxed(gicd_base +
+					GICD_ICFGR + irq / 4);
+		if (irq % 32 == 0)
+			dist_igroupr[irq / 32] = readl_relaxed(gicd_base +
+					GICD_IGROUPR + irq / 8);
+	}
+}
+
+/*
+ * Replace the bits of mask in a shadowed register word and write the word to
+ * the distributor if this changed it. Cells update their own bits of a shared
+ * word without locking, so the write of a concurrent update may reach the
+ * distributor before ours. Keep writing until it holds the latest copy.
+ */
+static void dist_shadow_update(unsigned long *shadow, void *reg,
+			       unsigned long mask, unsigned long val)
+{
+	unsigned long old, new;
+
+	old = replace_bits(mask, val, shadow);
+	new = (old & ~mask) | (val & mask);
+	if (new == old)
+		return;
+
+	do {
+		writel_relaxed(new, reg);
+		/* Order the write before checking the copy again */
+		memory_barrier();
+		old = new;
+		new = *(volatile unsigned long *)shadow;
+	} while (new != old);
+}
+
 /*
  * Most of the GIC distributor writes only reconfigure the IRQs corresponding to
  * the bits of the written value, by using separate `set' and `clear' registers.
- * Such registers can be handled by setting the `is_poke' boolean, which allows
- * to simply restrict the access->val with the cell configuration mask.
- * Others, such as the priority registers, will need to be read and written back
- * with a restricted value, by using the distributor lock.
+ * Such registers are passed without a shadow, which allows to simply restrict
+ * the access->val with the cell configuration mask.
+ * Others, such as the priority registers, are served from their shadow: reads
+ * never reach the distributor, and writes only replace the bits of the cell,
+ * see dist_shadow_update.
  */
 static int restrict_bitmask_access(struct per_cpu *cpu_data,
 				struct mmio_access *access,
 				unsigned int reg_index,
 				unsigned int bits_per_irq,
-				bool is_poke)
+				unsigned long *shadow)
 {
-	unsigned int spi;
+	unsigned int spi, shift;
 	unsigned long access_mask = 0;
 	/*
 	 * In order to avoid division, the number of bits per irq is limited
@@ -57,9 +123,15 @@ static int restrict_bitmask_access(struct per_cpu *cpu_data,
 	/* First, extract the first interrupt affected by this access */
 	unsigned int first_irq = reg_index * irqs_per_reg;
 
-	/* For SGIs or PPIs, let the caller do the mmio access */
-	if (!is_spi(first_irq))
+	/*
+	 * For SGIs or PPIs, let the caller do the mmio access, but keep the
+	 * hypervisor timer out of reach of the cell.
+	 */
+	if (!is_spi(first_irq)) {
+		if (access->is_write && bits_per_irq == 1)
+			access->val &= ~(1UL << HYP_TIMER_IRQ);
 		return TRAP_UNHANDLED;
+	}
 
 	/* For SPIs, compare against the cell config mask */
 	first_irq -= 32;
@@ -69,42 +141,138 @@ static int restrict_bitmask_access(struct per_cpu *cpu_data,
 			access_mask |= spi_bits << bit_nr;
 	}
 
-	if (!access->is_write) {
-		/* Restrict the read value */
-		arch_mmio_access(access);
+	if (!shadow) {
+		if (!access->is_write) {
+			/* Restrict the read value */
+			arch_mmio_access(access);
+			access->val &= access_mask;
+			return TRAP_HANDLED;
+		}
+
 		access->val &= access_mask;
-		return TRAP_HANDLED;
+		/* Do the access */
+		return TRAP_UNHANDLED;
 	}
 
-	if (!is_poke) {
-		/*
-		 * Modify the existing value of this register by first reading
-		 * it into access->val
-		 * Relies on a spinlock since we need two mmio accesses.
-		 */
-		unsigned long access_val = access->val;
+	/* Byte-accessible registers: only touch the bytes of this access */
+	shift = 8 * (access->addr % 4);
+	if (access->size < 4)
+		access_mask &= ((1UL << (8 * access->size)) - 1) << shift;
 
-		spin_lock(&dist_lock);
+	if (access->is_write)
+		dist_shadow_update(&shadow[reg_index],
+				   (void *)(access->addr & ~0x3UL),
+				   access_mask, access->val << shift);
+	else
+		access->val = (shadow[reg_index] & access_mask) >> shift;
 
-		access->is_write = false;
-		arch_mmio_access(access);
-		access->is_write = true;
+	return TRAP_HANDLED;
+}
 
-		/* Clear 0 bits */
-		access->val &= ~(access_mask & ~access_val);
-		access->val |= access_val;
-		arch_mmio_access(access);
+/*
+ * Record the priorities written by a cell, one byte per IRQ starting at irq.
+ * SGIs and PPIs are banked per CPU, SPIs are shared by all CPUs of the cell.
+ */
+void gic_set_priorities(struct per_cpu *cpu_data, unsigned int irq,
+			unsigned long val, unsigned int size)
+{
+	struct cell *cell = cpu_data->cell;
+	unsigned int cpu;
 
-		spin_unlock(&dist_lock);
+	for (; size > 0 && irq < MAX_VIRT_IRQS; size--, irq++, val >>= 8) {
+		if (!is_spi(irq))
+			cpu_data->pending_irqs->priority[irq] = val;
+		else if (spi_in_cell(cell, irq - 32))
+			for_each_cpu(cpu, cell->cpu_set)
+				per_cpu(cpu)->pending_irqs->priority[irq] = val;
+	}
+}
 
-		return TRAP_HANDLED;
-	} else {
-		access->val &= access_mask;
-		/* Do the access */
-		return TRAP_UNHANDLED;
+/*
+ * Load the priorities currently programmed into the GIC, e.g. by the root cell
+ * before the hypervisor was enabled. banked_priorities points to the priority
+ * registers of the SGIs and PPIs of this CPU.
+ */
+void gic_read_priorities(struct per_cpu *cpu_data, void *banked_priorities)
+{
+	u8 *priority = cpu_data->pending_irqs->priority;
+	unsigned int irq, num_irqs = gic_num_irqs();
+	u32 val;
+
+	for (irq = 0; irq < num_irqs; irq += 4) {
+		if (irq < 32)
+			val = readl_relaxed(banked_priorities + irq);
+		else
+			val = dist_ipriorityr[irq / 4];
+
+		priority[irq] = val;
+		priority[irq + 1] = val >> 8;
+		priority[irq + 2] = val >> 16;
+		priority[irq + 3] = val >> 24;
 	}
 }
 
+/*
+ * Both LR formats keep the virtual ID in their lowest bits, and only IDs below
+ * MAX_VIRT_IRQS are injected.
+ */
+static unsigned int lr_virt_id(u64 lr)
+{
+	return lr & (MAX_VIRT_IRQS - 1);
+}
+
+/* Forget the list register entries that the guest has completed */
+void gic_sync_lrs(struct pending_irqs *pending, u64 elsr)
+{
+	unsigned long retired = pending->lr_used & elsr;
+	unsigned int n;
+
+	pending->lr_used &= ~retired;
+	while (retired) {
+		n = ffsl(retired);
+		retired &= ~(1UL << n);
+		clear_bit(lr_virt_id(pending->lr[n]), pending->in_lr);
+	}
+	pending->lrs_synced = true;
+}
+
+/* Returns the index of a free list register or -1 if all are in use */
+int gic_get_free_lr(struct pending_irqs *pending, unsigned int num_lr)
+{
+	if (pending->lr_used == (1UL << num_lr) - 1)
+		return -1;
+	return ffzl(pending->lr_used);
+}
+
+/* Record that list register n was written with lr */
+void gic_shadow_lr(struct pending_irqs *pending, unsigned int n, u64 lr)
+{
+	pending->lr[n] = lr;
+	pending->lr_used |= 1 << n;
+	set_bit(lr_virt_id(lr), pending->in_lr);
+}
+
+/* Record that list register n was cleared */
+void gic_unshadow_lr(struct pending_irqs *pending, unsigned int n)
+{
+	pending->lr_used &= ~(1 << n);
+	clear_bit(lr_virt_id(pending->lr[n]), pending->in_lr);
+}
+
+static int handle_irq_priority(struct per_cpu *cpu_data,
+			       struct mmio_access *access, unsigned int reg)
+{
+	unsigned long val = access->val;
+	int ret;
+
+	ret = restrict_bitmask_access(cpu_data, access, reg / 4, 8,
+				      dist_ipriorityr);
+	if (access->is_write)
+		gic_set_priorities(cpu_data, reg, val, access->size);
+
+	return ret;
+}
+
 /*
  * GICv3 uses a 64bit register IROUTER for each IRQ
  */
@@ -160,8 +328,6 @@ static int handle_irq_target(struct per_cpu *cpu_data,
 	 */
 	unsigned int i, cpu;
 	unsigned int spi = reg - 32;
-	unsigned int offset;
-	u32 access_mask = 0;
 	u8 targets;
 
 	/*
@@ -171,22 +337,8 @@ static int handle_irq_target(struct per_cpu *cpu_data,
 	if (!is_spi(reg))
 		return TRAP_UNHANDLED;
 
-	/*
-	 * The registers are byte-accessible, extend the access to a word if
-	 * necessary.
-	 */
-	offset = spi % 4;
-	access->val <<= 8 * offset;
-	access->size = 4;
-	spi -= offset;
-
-	for (i = 0; i < 4; i++, spi++) {
-		if (spi_in_cell(cpu_data->cell, spi))
-			access_mask |= 0xff << (8 * i);
-		else
-			continue;
-
-		if (!access->is_write)
+	for (i = 0; access->is_write && i < access->size; i++, spi++) {
+		if (!spi_in_cell(cpu_data->cell, spi))
 			continue;
 
 		targets = (access->val >> (8 * i)) & 0xff;
@@ -204,22 +356,8 @@ static int handle_irq_target(struct per_cpu *cpu_data,
 		}
 	}
 
-	if (access->is_write) {
-		spin_lock(&dist_lock);
-		u32 itargetsr = readl_relaxed(gicd_base + GICD_ITARGETSR + reg
-				+ offset);
-		access->val &= access_mask;
-		/* Combine with external SPIs */
-		access->val |= (itargetsr & ~access_mask);
-		/* And do the access */
-		arch_mmio_access(access);
-		spin_unlock(&dist_lock);
-	} else {
-		arch_mmio_access(access);
-		access->val &= access_mask;
-	}
-
-	return TRAP_HANDLED;
+	return restrict_bitmask_access(cpu_data, access, reg / 4, 8,
+				       dist_itargetsr);
 }
 
 static int handle_sgir_access(struct per_cpu *cpu_data,
@@ -263,6 +401,11 @@ int gic_probe_cpu_id(unsigned int cpu)
 	return 0;
 }
 
+/*
+ * Queue a virtual SGI directly on all target CPUs and kick those that may be
+ * running their guest with a single physical SGI. The sender's own copy is
+ * injected right away.
+ */
 int gic_handle_sgir_write(struct per_cpu *cpu_data, struct sgi *sgi,
 			  bool virt_input)
 {
@@ -271,34 +414,51 @@ int gic_handle_sgir_write(struct per_cpu *cpu_data, struct sgi *sgi,
 	unsigned int this_cpu = cpu_data->cpu_id;
 	struct cell *cell = cpu_data->cell;
 	bool is_target = false;
+	struct sgi kick;
 
 	cpu_data->stats[JAILHOUSE_CPU_STAT_VMEXITS_VSGI]++;
 
 	targets = sgi->targets;
-	sgi->targets = 0;
+
+	kick.routing_mode = 0;
+	kick.aff1 = 0;
+	kick.aff2 = 0;
+	kick.aff3 = 0;
+	kick.targets = 0;
+	kick.id = SGI_INJECT;
 
 	/* Filter the targets */
-	for_each_cpu_except(cpu, cell->cpu_set, this_cpu) {
+	for_each_cpu(cpu, cell->cpu_set) {
 		/*
 		 * When using a cpu map to target the different CPUs (GICv2),
 		 * they are independent from the physical CPU IDs, so there is
 		 * no need to translate them to the hypervisor's virtual IDs.
 		 */
-		if (virt_input)
+		if (sgi->routing_mode == 1)
+			is_target = cpu != this_cpu;
+		else if (sgi->routing_mode == 2)
+			is_target = cpu == this_cpu;
+		else if (virt_input)
 			is_target = !!test_bit(cpu_phys2virt(cpu), &targets);
 		else
 			is_target = !!(targets & target_cpu_map[cpu]);
 
-		if (sgi->routing_mode == 0 && !is_target)
+		if (!is_target)
 			continue;
 
+		if (cpu == this_cpu) {
+			irqchip_set_pending(cpu_data, sgi->id, true);
+			continue;
+		}
+
 		irqchip_set_pending(per_cpu(cpu), sgi->id, false);
-		sgi->targets |= (1 << cpu);
+		if (irqchip_needs_kick(per_cpu(cpu)))
+			kick.targets |= 1 << cpu;
 	}
 
-	/* Let the other CPUS inject their SGIs */
-	sgi->id = SGI_INJECT;
-	irqchip_send_sgi(sgi);
+	/* Let the other CPUs inject their SGIs */
+	if (kick.targets)
+		irqchip_send_sgi(&kick);
 
 	return TRAP_HANDLED;
 }
@@ -326,22 +486,22 @@ int gic_handle_dist_access(struct per_cpu *cpu_data,
 	case REG_RANGE(GICD_ICACTIVER, 32, 4):
 	case REG_RANGE(GICD_ISACTIVER, 32, 4):
 		ret = restrict_bitmask_access(cpu_data, access,
-				(reg & 0x7f) / 4, 1, true);
+				(reg & 0x7f) / 4, 1, NULL);
 		break;
 
 	case REG_RANGE(GICD_IGROUPR, 32, 4):
 		ret = restrict_bitmask_access(cpu_data, access,
-				(reg & 0x7f) / 4, 1, false);
+				(reg & 0x7f) / 4, 1, dist_igroupr);
 		break;
 
 	case REG_RANGE(GICD_ICFGR, 64, 4):
 		ret = restrict_bitmask_access(cpu_data, access,
-				(reg & 0xff) / 4, 2, false);
+				(reg & 0xff) / 4, 2, dist_icfgr);
 		break;
 
 	case REG_RANGE(GICD_IPRIORITYR, 255, 4):
-		ret = restrict_bitmask_access(cpu_data, access,
-				(reg & 0x3ff) / 4, 8, false);
+		ret = handle_irq_priority(cpu_data, access,
+				reg - GICD_IPRIORITYR);
 		break;
 
 	case GICD_SGIR:
@@ -404,12 +564,10 @@ void gic_handle_irq(struct per_cpu *cpu_data)
 
 void gic_target_spis(struct cell *config_cell, struct cell *dest_cell)
 {
-	unsigned int i, first_cpu, cpu_itf;
-	unsigned int shift = 0;
-	void *itargetsr = gicd_base + GICD_ITARGETSR;
-	u32 targets;
-	u32 mask = 0;
-	u32 bits = 0;
+	unsigned int i, spi, first_cpu, cpu_itf;
+	unsigned int num_spis = gic_num_irqs() - 32;
+	unsigned long spis;
+	u32 mask, bits;
 
 	/* Always route to the first logical CPU on reset */
 	for_each_cpu(first_cpu, dest_cell->cpu_set)
@@ -417,24 +575,27 @@ void gic_target_spis(struct cell *config_cell, struct cell *dest_cell)
 
 	cpu_itf = target_cpu_map[first_cpu];
 
-	/* ITARGETSR0-7 contain the PPIs and SGIs, and are read-only. */
-	itargetsr += 4 * 8;
+	/*
+	 * ITARGETSRs have 4 IRQs per register, skip those without an SPI of
+	 * the cell. ITARGETSR0-7 contain the PPIs and SGIs, and are read-only.
+	 */
+	for (spi = 0; spi < num_spis; spi += 4) {
+		spis = config_cell->arch.spis[spi / BITS_PER_LONG] >>
+			(spi % BITS_PER_LONG);
+		if (!(spis & 0xf))
+			continue;
 
-	for (i = 0; i < 64; i++, shift = (shift + 8) % 32) {
-		if (spi_in_cell(config_cell, i)) {
-			mask |= (0xff << shift);
-			bits |= (cpu_itf << shift);
+		mask = 0;
+		bits = 0;
+		for (i = 0; i < 4; i++) {
+			if (spis & (1 << i)) {
+				mask |= 0xff << (8 * i);
+				bits |= cpu_itf << (8 * i);
+			}
 		}
 
-		/* ITARGETRs have 4 IRQ per register */
-		if ((i + 1) % 4 == 0) {
-			targets = readl_relaxed(itargetsr);
-			targets &= ~mask;
-			targets |= bits;
-			writel_relaxed(targets, itargetsr);
-			itargetsr += 4;
-			mask = 0;
-			bits = 0;
-		}
+		dist_shadow_update(&dist_itargetsr[8 + spi / 4],
+				   gicd_base + GICD_ITARGETSR + 32 + spi,
+				   mask, bits);
 	}
 }
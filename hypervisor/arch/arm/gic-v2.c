@@ -31,6 +31,8 @@ static int gic_init(void)
 {
 	int err;
 
+	gic_dist_shadow_init();
+
 	/* FIXME: parse device tree */
 	gicc_base = GICC_BASE;
 	gicc_size = GICC_SIZE;
@@ -71,6 +73,11 @@ static int gic_cpu_reset(struct per_cpu *cpu_data, bool is_shutdown)
 		writel_relaxed(0xffff0000, gicd_base + GICD_ICENABLER);
 	/* Ensure IPIs are enabled */
 	writel_relaxed(0x0000ffff, gicd_base + GICD_ISENABLER);
+	/* The hypervisor timer is ours until shutdown */
+	if (is_shutdown)
+		writel_relaxed(1 << HYP_TIMER_IRQ, gicd_base + GICD_ICENABLER);
+	else
+		writel_relaxed(1 << HYP_TIMER_IRQ, gicd_base + GICD_ISENABLER);
 
 	writel_relaxed(0, gich_base + GICH_APR);
 
@@ -94,6 +101,9 @@ static int gic_cpu_reset(struct per_cpu *cpu_data, bool is_shutdown)
 	}
 	writel_relaxed(gich_vmcr, gich_base + GICH_VMCR);
 
+	if (!is_shutdown)
+		gic_read_priorities(cpu_data, gicd_base + GICD_IPRIORITYR);
+
 	return 0;
 }
 
@@ -102,8 +112,9 @@ static int gic_cpu_init(struct per_cpu *cpu_data)
 	u32 vtr, vmcr;
 	u32 cell_gicc_ctlr, cell_gicc_pmr;
 
-	/* Ensure all IPIs are enabled */
-	writel_relaxed(0x0000ffff, gicd_base + GICD_ISENABLER);
+	/* Ensure all IPIs and the hypervisor timer are enabled */
+	writel_relaxed(0x0000ffff | 1 << HYP_TIMER_IRQ,
+		       gicd_base + GICD_ISENABLER);
 
 	cell_gicc_ctlr = readl_relaxed(gicc_base + GICC_CTLR);
 	cell_gicc_pmr = readl_relaxed(gicc_base + GICC_PMR);
@@ -114,6 +125,8 @@ static int gic_cpu_init(struct per_cpu *cpu_data)
 
 	vtr = readl_relaxed(gich_base + GICH_VTR);
 	gic_num_lr = (vtr & 0x3f) + 1;
+	if (gic_num_lr > GIC_MAX_LRS)
+		gic_num_lr = GIC_MAX_LRS;
 
 	/* VMCR only contains 5 bits of priority */
 	vmcr = (cell_gicc_pmr >> GICV_PMR_SHIFT) << GICH_VMCR_PMR_SHIFT;
@@ -140,6 +153,8 @@ static int gic_cpu_init(struct per_cpu *cpu_data)
 	/* Register ourselves into the CPU itf map */
 	gic_probe_cpu_id(cpu_data->cpu_id);
 
+	gic_read_priorities(cpu_data, gicd_base + GICD_IPRIORITYR);
+
 	return 0;
 }
 
@@ -208,42 +223,101 @@ static int gic_send_sgi(struct sgi *sgi)
 	return 0;
 }
 
-static int gic_inject_irq(struct per_cpu *cpu_data, struct pending_irq *irq)
+/*
+ * Put the IRQ of a list register that the guest has not acknowledged yet back
+ * into the pending bitmap, so that the register can be reused.
+ */
+static void gic_requeue_lr(struct per_cpu *cpu_data, unsigned int n)
 {
-	int i;
-	int first_free = -1;
-	u32 lr;
-	u64 elsr;
+	struct pending_irq irq;
+	u32 lr = cpu_data->pending_irqs->lr[n];
+
+	irq.virt_id = lr & GICH_LR_VIRT_ID_MASK;
+	irq.hw = !!(lr & GICH_LR_HW_BIT);
+	if (irq.hw) {
+		irq.type.irq = lr >> GICH_LR_PHYS_ID_SHIFT &
+			GICH_LR_VIRT_ID_MASK;
+	} else {
+		irq.type.sgi.cpuid = lr >> GICH_LR_CPUID_SHIFT & 0x7;
+		irq.type.sgi.maintenance = !!(lr & GICH_LR_SGI_EOI_BIT);
+	}
 
-	elsr = readl_relaxed(gich_base + GICH_ELSR0);
-	elsr |= (u64)readl_relaxed(gich_base + GICH_ELSR1) << 32;
-	for (i = 0; i < gic_num_lr; i++) {
-		if (test_bit(i, (unsigned long *)&elsr)) {
-			/* Entry is available */
-			if (first_free == -1)
-				first_free = i;
-			continue;
+	gic_write_lr(n, 0);
+	gic_unshadow_lr(cpu_data->pending_irqs, n);
+	irqchip_insert_pending(cpu_data, &irq);
+}
+
+/*
+ * Returns the list register holding the lowest-priority IRQ below the given
+ * one that the guest has not acknowledged yet, or -1. The state of the
+ * entries changes while the guest runs, so read them from the hardware.
+ */
+static int gic_find_preemptible_lr(u32 priority)
+{
+	int n, victim = -1;
+	u32 lr, lr_priority;
+
+	for (n = 0; n < gic_num_lr; n++) {
+		lr = gic_read_lr(n);
+		lr_priority = lr >> GICH_LR_PRIORITY_SHIFT &
+			GICH_LR_PRIORITY_MASK;
+		if ((lr & (GICH_LR_PENDING_BIT | GICH_LR_ACTIVE_BIT)) ==
+		    GICH_LR_PENDING_BIT && lr_priority > priority) {
+			victim = n;
+			priority = lr_priority;
 		}
+	}
+
+	return victim;
+}
 
-		/* Check that there is no overlapping */
-		lr = gic_read_lr(i);
-		if ((lr & GICH_LR_VIRT_ID_MASK) == irq->virt_id)
-			return -EINVAL;
+static void gic_update_lrs(struct per_cpu *cpu_data)
+{
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+	u64 elsr;
+
+	if (!pending->lrs_synced) {
+		elsr = readl_relaxed(gich_base + GICH_ELSR0);
+		elsr |= (u64)readl_relaxed(gich_base + GICH_ELSR1) << 32;
+		gic_sync_lrs(pending, elsr);
 	}
+}
 
-	if (first_free == -1) {
-		/* Enable maintenance IRQ */
+static int gic_inject_irq(struct per_cpu *cpu_data, struct pending_irq *irq)
+{
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+	u32 priority = irq->priority >> GICH_LR_PRIORITY_LOSS;
+	u32 lr;
+	int n;
+
+	gic_update_lrs(cpu_data);
+
+	/* Check that there is no overlapping */
+	if (test_bit(irq->virt_id, pending->in_lr))
+		return -EINVAL;
+
+	n = gic_get_free_lr(pending, gic_num_lr);
+	if (n < 0) {
+		/*
+		 * Enable maintenance IRQ, also to inject a preempted IRQ again
+		 * once a list register is available.
+		 */
 		u32 hcr;
 		hcr = readl_relaxed(gich_base + GICH_HCR);
 		hcr |= GICH_HCR_UIE;
 		writel_relaxed(hcr, gich_base + GICH_HCR);
 
-		return -EBUSY;
+		n = gic_find_preemptible_lr(priority);
+		if (n < 0)
+			return -EBUSY;
+
+		gic_requeue_lr(cpu_data, n);
 	}
 
 	/* Inject group 0 interrupt (seen as IRQ by the guest) */
 	lr = irq->virt_id;
 	lr |= GICH_LR_PENDING_BIT;
+	lr |= priority << GICH_LR_PRIORITY_SHIFT;
 
 	if (irq->hw) {
 		lr |= GICH_LR_HW_BIT;
@@ -254,7 +328,8 @@ static int gic_inject_irq(struct per_cpu *cpu_data, struct pending_irq *irq)
 			lr |= GICH_LR_SGI_EOI_BIT;
 	}
 
-	gic_write_lr(first_free, lr);
+	gic_write_lr(n, lr);
+	gic_shadow_lr(pending, n, lr);
 
 	return 0;
 }
@@ -279,6 +354,7 @@ struct irqchip_ops gic_irqchip = {
 	.send_sgi = gic_send_sgi,
 	.handle_irq = gic_handle_irq,
 	.inject_irq = gic_inject_irq,
+	.update_lrs = gic_update_lrs,
 	.eoi_irq = gic_eoi_irq,
 	.mmio_access = gic_mmio_access,
 };
@@ -42,6 +42,8 @@ static int gic_init(void)
 {
 	int err;
 
+	gic_dist_shadow_init();
+
 	/* FIXME: parse a dt */
 	gicr_base = GICR_BASE;
 	gicr_size = GICR_SIZE;
@@ -83,6 +85,11 @@ static int gic_cpu_reset(struct per_cpu *cpu_data, bool is_shutdown)
 	if (!root_shutdown)
 		writel_relaxed(0xffff0000, gicr + GICR_ICENABLER);
 	writel_relaxed(0x0000ffff, gicr + GICR_ISENABLER);
+	/* The hypervisor timer is ours until shutdown */
+	if (is_shutdown)
+		writel_relaxed(1 << HYP_TIMER_IRQ, gicr + GICR_ICENABLER);
+	else
+		writel_relaxed(1 << HYP_TIMER_IRQ, gicr + GICR_ISENABLER);
 
 	/* Clear active priority bits */
 	if (gic_num_priority_bits >= 5)
@@ -110,6 +117,9 @@ static int gic_cpu_reset(struct per_cpu *cpu_data, bool is_shutdown)
 
 	arm_write_sysreg(ICH_VMCR_EL2, 0);
 
+	if (!is_shutdown)
+		gic_read_priorities(cpu_data, gicr + GICR_IPRIORITYR);
+
 	return 0;
 }
 
@@ -145,8 +155,9 @@ static int gic_cpu_init(struct per_cpu *cpu_data)
 		return -ENODEV;
 	}
 
-	/* Ensure all IPIs are enabled */
-	writel_relaxed(0x0000ffff, redist_base + GICR_SGI_BASE + GICR_ISENABLER);
+	/* Ensure all IPIs and the hypervisor timer are enabled */
+	writel_relaxed(0x0000ffff | 1 << HYP_TIMER_IRQ,
+		       redist_base + GICR_SGI_BASE + GICR_ISENABLER);
 
 	/*
 	 * Set EOIMode to 1
@@ -180,22 +191,32 @@ static int gic_cpu_init(struct per_cpu *cpu_data)
 	/* After this, the cells access the virtual interface of the GIC. */
 	arm_write_sysreg(ICH_HCR_EL2, ICH_HCR_EN);
 
+	gic_read_priorities(cpu_data,
+			    redist_base + GICR_SGI_BASE + GICR_IPRIORITYR);
+
 	return 0;
 }
 
 static void gic_route_spis(struct cell *config_cell, struct cell *dest_cell)
 {
-	int i;
-	void *irouter = gicd_base + GICD_IROUTER;
-	unsigned int first_cpu;
+	unsigned int n, spi, first_cpu;
+	unsigned int num_spis = gic_num_irqs() - 32;
+	unsigned long spis;
 
 	/* Use the core functions to retrieve the first physical id */
 	for_each_cpu(first_cpu, dest_cell->cpu_set)
 		break;
 
-	for (i = 0; i < 64; i++, irouter += 8) {
-		if (spi_in_cell(config_cell, i))
-			writeq_relaxed(first_cpu, irouter);
+	/* IROUTER0-31 are reserved, the one of SPI 0 is IROUTER32 */
+	for (n = 0; n < num_spis; n += BITS_PER_LONG) {
+		spis = config_cell->arch.spis[n / BITS_PER_LONG];
+		while (spis) {
+			spi = n + ffsl(spis);
+			spis &= ~(1UL << (spi - n));
+			if (spi < num_spis)
+				writeq_relaxed(first_cpu, gicd_base +
+					       GICD_IROUTER + 8 * (32 + spi));
+		}
 	}
 }
 
@@ -265,53 +286,103 @@ static void gic_eoi_irq(u32 irq_id, bool deactivate)
 		arm_write_sysreg(ICC_DIR_EL1, irq_id);
 }
 
-static int gic_inject_irq(struct per_cpu *cpu_data, struct pending_irq *irq)
+/*
+ * Put the IRQ of a list register that the guest has not acknowledged yet back
+ * into the pending bitmap, so that the register can be reused.
+ */
+static void gic_requeue_lr(struct per_cpu *cpu_data, unsigned int n)
 {
-	int i;
-	int free_lr = -1;
-	u32 elsr;
+	struct pending_irq irq;
+	u64 lr = cpu_data->pending_irqs->lr[n];
+
+	irq.virt_id = (u32)lr;
+	irq.hw = !!(lr & ICH_LR_HW_BIT);
+	if (irq.hw) {
+		irq.type.irq = lr >> ICH_LR_PHYS_ID_SHIFT & ICH_LR_PHYS_ID_MASK;
+	} else {
+		irq.type.sgi.cpuid = 0;
+		irq.type.sgi.maintenance = !!(lr & ICH_LR_SGI_EOI);
+	}
+
+	gic_write_lr(n, 0);
+	gic_unshadow_lr(cpu_data->pending_irqs, n);
+	irqchip_insert_pending(cpu_data, &irq);
+}
+
+/*
+ * Returns the list register holding the lowest-priority IRQ below the given
+ * one that the guest has not acknowledged yet, or -1. The state of the
+ * entries changes while the guest runs, so read them from the hardware.
+ */
+static int gic_find_preemptible_lr(u8 priority)
+{
+	int n, victim = -1;
+	u8 lr_priority;
 	u64 lr;
 
-	arm_read_sysreg(ICH_ELSR_EL2, elsr);
-	for (i = 0; i < gic_num_lr; i++) {
-		if ((elsr >> i) & 1) {
-			/* Entry is invalid, candidate for injection */
-			if (free_lr == -1)
-				free_lr = i;
-			continue;
+	for (n = 0; n < gic_num_lr; n++) {
+		lr = gic_read_lr(n);
+		lr_priority = lr >> ICH_LR_PRIORITY_SHIFT;
+		if ((lr & ICH_LR_PENDACTIVE) == ICH_LR_PENDING &&
+		    lr_priority > priority) {
+			victim = n;
+			priority = lr_priority;
 		}
+	}
 
-		/*
-		 * Entry is in use, check that it doesn't match the one we want
-		 * to inject.
-		 */
-		lr = gic_read_lr(i);
+	return victim;
+}
 
-		/*
-		 * A strict phys->virt id mapping is used for SPIs, so this test
-		 * should be sufficient.
-		 */
-		if ((u32)lr == irq->virt_id)
-			return -EINVAL;
+static void gic_update_lrs(struct per_cpu *cpu_data)
+{
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+	u32 elsr;
+
+	if (!pending->lrs_synced) {
+		arm_read_sysreg(ICH_ELSR_EL2, elsr);
+		gic_sync_lrs(pending, elsr);
 	}
+}
+
+static int gic_inject_irq(struct per_cpu *cpu_data, struct pending_irq *irq)
+{
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+	u64 lr;
+	int n;
+
+	gic_update_lrs(cpu_data);
 
-	if (free_lr == -1) {
+	/*
+	 * A strict phys->virt id mapping is used for SPIs, so checking the
+	 * virtual ID is sufficient to avoid overlapping.
+	 */
+	if (test_bit(irq->virt_id, pending->in_lr))
+		return -EINVAL;
+
+	n = gic_get_free_lr(pending, gic_num_lr);
+	if (n < 0) {
 		u32 hcr;
 		/*
 		 * All list registers are in use, trigger a maintenance
-		 * interrupt once they are available again.
+		 * interrupt once they are available again. This also injects
+		 * a preempted IRQ again.
 		 */
 		arm_read_sysreg(ICH_HCR_EL2, hcr);
 		hcr |= ICH_HCR_UIE;
 		arm_write_sysreg(ICH_HCR_EL2, hcr);
 
-		return -EBUSY;
+		n = gic_find_preemptible_lr(irq->priority);
+		if (n < 0)
+			return -EBUSY;
+
+		gic_requeue_lr(cpu_data, n);
 	}
 
 	lr = irq->virt_id;
 	/* Only group 1 interrupts */
 	lr |= ICH_LR_GROUP_BIT;
 	lr |= ICH_LR_PENDING;
+	lr |= (u64)irq->priority << ICH_LR_PRIORITY_SHIFT;
 	if (irq->hw) {
 		lr |= ICH_LR_HW_BIT;
 		lr |= (u64)irq->type.irq << ICH_LR_PHYS_ID_SHIFT;
@@ -319,7 +390,8 @@ static int gic_inject_irq(struct per_cpu *cpu_data, struct pending_irq *irq)
 		lr |= ICH_LR_SGI_EOI;
 	}
 
-	gic_write_lr(free_lr, lr);
+	gic_write_lr(n, lr);
+	gic_shadow_lr(pending, n, lr);
 
 	return 0;
 }
@@ -357,6 +429,18 @@ static int gic_handle_redist_access(struct per_cpu *cpu_data,
 	reg = address - virt_redist;
 	access->addr = (unsigned long)phys_redist + reg;
 
+	/* Track the priorities of the SGIs and PPIs of the target CPU */
+	if (access->is_write && reg >= GICR_SGI_BASE + GICR_IPRIORITYR &&
+	    reg < GICR_SGI_BASE + GICR_IPRIORITYR + 32)
+		gic_set_priorities(per_cpu(cpu),
+				   reg - GICR_SGI_BASE - GICR_IPRIORITYR,
+				   access->val, access->size);
+
+	/* Keep the hypervisor timer out of reach of the cell */
+	if (access->is_write && reg >= GICR_SGI_BASE + GICR_IGROUPR &&
+	    reg <= GICR_SGI_BASE + GICR_ICACTIVER && (reg & 0x7f) == 0)
+		access->val &= ~(1UL << HYP_TIMER_IRQ);
+
 	/* Change the ID register, all other accesses are allowed. */
 	if (!access->is_write) {
 		switch (reg) {
@@ -407,6 +491,7 @@ struct irqchip_ops gic_irqchip = {
 	.send_sgi = gic_send_sgi,
 	.handle_irq = gic_handle_irq,
 	.inject_irq = gic_inject_irq,
+	.update_lrs = gic_update_lrs,
 	.eoi_irq = gic_eoi_irq,
 	.mmio_access = gic_mmio_access,
 };
@@ -98,6 +98,27 @@ static inline int test_and_set_bit(int nr, volatile unsigned long *addr)
 	return !!(test);
 }
 
+/* Replace the bits of mask in *addr with those of val, returns the old word */
+static inline unsigned long replace_bits(unsigned long mask, unsigned long val,
+					 volatile unsigned long *addr)
+{
+	unsigned long ret, old, new;
+
+	PRELOAD(addr);
+	do {
+		asm volatile (
+		"ldrex	%1, %3\n"
+		"bic	%2, %1, %4\n"
+		"orr	%2, %5\n"
+		"strex	%0, %2, %3\n"
+		: "=&r" (ret), "=&r" (old), "=&r" (new),
+		  "+Qo" (*addr)
+		: "r" (mask), "r" (val & mask));
+	} while (ret);
+
+	return old;
+}
+
 
 /* Count leading zeroes */
 static inline unsigned long clz(unsigned long word)
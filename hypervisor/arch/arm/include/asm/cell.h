@@ -17,6 +17,9 @@
 #include <asm/spinlock.h>
 #include <asm/types.h>
 
+/* SPIs are the interrupts 32 to 1019 of a GIC */
+#define MAX_SPIS		988
+
 #ifndef __ASSEMBLY__
 
 #include <jailhouse/cell-config.h>
@@ -26,11 +29,12 @@
 struct arch_cell {
 	struct paging_structures mm;
 	struct smp_ops *smp;
+	spinlock_t psci_lock;
 
 	spinlock_t caches_lock;
 	bool needs_flush;
 
-	u64 spis;
+	unsigned long spis[(MAX_SPIS + BITS_PER_LONG - 1) / BITS_PER_LONG];
 
 	unsigned int last_virt_id;
 };
@@ -46,6 +50,16 @@ struct cell {
 	struct cpu_set small_cpu_set;
 
 	bool loadable;
+	spinlock_t lock;
+
+	u32 notified_state;
+	u32 heartbeat_seen;
+	u32 heartbeat_missed;
+	u64 heartbeat_deadline;
+
+	/* pristine copy of the loadable regions, see cell_restart */
+	void *snapshot;
+	unsigned int snapshot_pages;
 
 	struct cell *next;
 
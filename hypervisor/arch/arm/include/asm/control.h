@@ -18,6 +18,7 @@
 
 #define SGI_INJECT	0
 #define SGI_CPU_OFF	1
+#define SGI_MONITOR	2
 
 #define CACHES_CLEAN		0
 #define CACHES_CLEAN_INVALIDATE	1
@@ -27,7 +28,7 @@
 void arch_cpu_dcaches_flush(unsigned int action);
 void arch_cpu_icache_flush(void);
 void arch_cpu_tlb_flush(struct per_cpu *cpu_data);
-void arch_cell_caches_flush(struct cell *cell);
+void arch_cell_caches_flush(struct per_cpu *cpu_data, struct cell *cell);
 int arch_mmu_cell_init(struct cell *cell);
 void arch_mmu_cell_destroy(struct cell *cell);
 int arch_mmu_cpu_cell_init(struct per_cpu *cpu_data);
@@ -36,6 +37,7 @@ void arch_handle_trap(struct per_cpu *cpu_data, struct registers *guest_regs);
 struct registers* arch_handle_exit(struct per_cpu *cpu_data,
 				   struct registers *regs);
 bool arch_handle_phys_irq(struct per_cpu *cpu_data, u32 irqn);
+void arch_cell_wait_traps_init(struct cell *cell);
 void arch_reset_self(struct per_cpu *cpu_data);
 void arch_shutdown_self(struct per_cpu *cpu_data);
 
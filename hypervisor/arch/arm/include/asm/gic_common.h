@@ -34,6 +34,8 @@
 #define GICD_SPENDSGIR			0x0f20
 #define GICD_IROUTER			0x6000
 
+#define GICD_TYPER_ITLINESNUMBER	0x1f
+
 #define GICD_PIDR2_ARCH(pidr)		(((pidr) & 0xf0) >> 4)
 
 #define is_sgi(irqn)			((u32)(irqn) < 16)
@@ -44,6 +46,7 @@
 
 struct cell;
 struct mmio_access;
+struct pending_irqs;
 struct per_cpu;
 struct sgi;
 
@@ -53,7 +56,17 @@ int gic_handle_dist_access(struct per_cpu *cpu_data,
 int gic_handle_sgir_write(struct per_cpu *cpu_data, struct sgi *sgi,
 			  bool virt_input);
 void gic_handle_irq(struct per_cpu *cpu_data);
+unsigned int gic_num_irqs(void);
+void gic_dist_shadow_init(void);
 void gic_target_spis(struct cell *config_cell, struct cell *dest_cell);
+void gic_read_priorities(struct per_cpu *cpu_data, void *banked_priorities);
+void gic_set_priorities(struct per_cpu *cpu_data, unsigned int irq,
+			unsigned long val, unsigned int size);
+
+void gic_sync_lrs(struct pending_irqs *pending, u64 elsr);
+int gic_get_free_lr(struct pending_irqs *pending, unsigned int num_lr);
+void gic_shadow_lr(struct pending_irqs *pending, unsigned int n, u64 lr);
+void gic_unshadow_lr(struct pending_irqs *pending, unsigned int n);
 
 #endif /* !__ASSEMBLY__ */
 #endif /* !_JAILHOUSE_ASM_GIC_COMMON_H */
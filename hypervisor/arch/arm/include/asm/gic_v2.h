@@ -87,6 +87,9 @@
 #define GICH_LR_ACTIVE_BIT	(1 << 29)
 #define GICH_LR_PENDING_BIT	(1 << 28)
 #define GICH_LR_PRIORITY_SHIFT	23
+#define GICH_LR_PRIORITY_MASK	0x1f
+/* LRs only hold the upper 5 bits of the priority */
+#define GICH_LR_PRIORITY_LOSS	3
 #define GICH_LR_SGI_EOI_BIT	(1 << 19)
 #define GICH_LR_CPUID_SHIFT	10
 #define GICH_LR_PHYS_ID_SHIFT	10
@@ -51,7 +51,7 @@
 #define GICR_ICENABLER		GICD_ICENABLER
 #define GICR_ISACTIVER		GICD_ISACTIVER
 #define GICR_ICACTIVER		GICD_ICACTIVER
-#define GICR_IPRIORITY		GICD_IPRIORITY
+#define GICR_IPRIORITYR		GICD_IPRIORITYR
 
 #define GICR_TYPER_Last		(1 << 4)
 #define GICR_PIDR2_ARCH		GICD_PIDR2_ARCH
@@ -179,6 +179,7 @@
 #define ICH_LR_PRIORITY_SHIFT	48
 #define ICH_LR_SGI_EOI		(0x1ULL << 41)
 #define ICH_LR_PHYS_ID_SHIFT	32
+#define ICH_LR_PHYS_ID_MASK	0x3ff
 
 #ifndef __ASSEMBLY__
 
@@ -13,19 +13,23 @@
 #ifndef _JAILHOUSE_ASM_IRQCHIP_H
 #define _JAILHOUSE_ASM_IRQCHIP_H
 
-/*
- * Since there is no finer-grained allocation than page-alloc for the moment,
- * and it is very complicated to predict the total size needed at
- * initialisation, each cpu is allocated one page of pending irqs.
- * This allows for 256 pending IRQs, which should be sufficient.
- */
-#define MAX_PENDING_IRQS	(PAGE_SIZE / sizeof(struct pending_irq))
+/* Number of interrupt IDs a GIC can signal, including the special ones */
+#define MAX_VIRT_IRQS		1024
+
+/* List registers tracked in software, GICv3 implements at most 16 */
+#define GIC_MAX_LRS		16
+
+/* Attributes of pending virtual IRQs */
+#define PENDING_IRQ_HW		(1 << 0)
+#define PENDING_IRQ_MAINTENANCE	(1 << 1)
 
 #include <asm/percpu.h>
 #include <asm/traps.h>
 
 #ifndef __ASSEMBLY__
 
+struct pending_irq;
+
 struct sgi {
 	/*
 	 * Routing mode values:
@@ -54,11 +58,12 @@ struct irqchip_ops {
 	void	(*handle_irq)(struct per_cpu *cpu_data);
 	void	(*eoi_irq)(u32 irqn, bool deactivate);
 	int	(*inject_irq)(struct per_cpu *cpu_data, struct pending_irq *irq);
+	void	(*update_lrs)(struct per_cpu *cpu_data);
 
 	int	(*mmio_access)(struct per_cpu *cpu_data, struct mmio_access *access);
 };
 
-/* Virtual interrupts waiting to be injected */
+/* Virtual interrupt to be injected into the list registers */
 struct pending_irq {
 	u32	virt_id;
 
@@ -74,11 +79,36 @@ struct pending_irq {
 			u16 maintenance	: 1;
 		} sgi __attribute__((packed));
 	} type;
-
-	struct pending_irq *next;
-	struct pending_irq *prev;
 } __attribute__((packed));
 
+/*
+ * Virtual interrupts waiting to be injected into a CPU, one page per CPU.
+ * Any CPU can mark an interrupt pending by setting its bit atomically after
+ * writing its attributes. Only the owning CPU scans and clears the bitmap,
+ * highest priority first, then lowest interrupt ID. Pending requests for the
+ * same interrupt merge, just like on the physical distributor.
+ * The priorities are the ones the cell programmed for this CPU, see
+ * gic_set_priorities.
+ * The page also holds the owner-only copy of the list registers and of the
+ * IRQs they contain. The guest retires entries while it runs, so the copy is
+ * synchronised with ELSR on the first injection after each exit, see
+ * gic_sync_lrs.
+ */
+struct pending_irqs {
+	unsigned long bitmap[MAX_VIRT_IRQS / BITS_PER_LONG];
+	u8 attrs[MAX_VIRT_IRQS];
+	u8 priority[MAX_VIRT_IRQS];
+
+	unsigned long in_lr[MAX_VIRT_IRQS / BITS_PER_LONG];
+	u64 lr[GIC_MAX_LRS];
+	u32 lr_used;
+	bool lrs_synced;
+
+	/* Set while the owner is in the hypervisor, see irqchip_needs_kick */
+	bool in_hypervisor;
+	bool recheck;
+};
+
 int irqchip_init(void);
 int irqchip_cpu_init(struct per_cpu *cpu_data);
 int irqchip_cpu_reset(struct per_cpu *cpu_data);
@@ -96,20 +126,19 @@ int irqchip_mmio_access(struct per_cpu *cpu_data, struct mmio_access *access);
 
 int irqchip_inject_pending(struct per_cpu *cpu_data);
 int irqchip_insert_pending(struct per_cpu *cpu_data, struct pending_irq *irq);
-int irqchip_remove_pending(struct per_cpu *cpu_data, struct pending_irq *irq);
 int irqchip_set_pending(struct per_cpu *cpu_data, u32 irq_id, bool try_inject);
+int irqchip_send_virtual_spi(struct per_cpu *target_data, u32 irq_id);
+bool irqchip_needs_kick(struct per_cpu *target_data);
+void irqchip_guest_exited(struct per_cpu *cpu_data);
+void irqchip_guest_resume(struct per_cpu *cpu_data);
+void irqchip_wait_for_irq(struct per_cpu *cpu_data);
 
 static inline bool spi_in_cell(struct cell *cell, unsigned int spi)
 {
-	/* FIXME: Change the configuration to a bitmask range */
-	u64 spi_mask;
-
-	if (spi > 64)
+	if (spi >= MAX_SPIS)
 		return false;
 
-	spi_mask = cell->arch.spis;
-
-	return spi_mask & (1 << spi);
+	return test_bit(spi, cell->arch.spis);
 }
 
 #endif /* __ASSEMBLY__ */
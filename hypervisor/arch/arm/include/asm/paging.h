@@ -52,13 +52,11 @@
 
 /*
  * Stage-1 and Stage-2 lower attributes.
- * FIXME: The upper attributes (contiguous hint and XN) are not currently in
- * use. If needed in the future, they should be shifted towards the lower word,
- * since the core uses unsigned long to pass the flags.
+ * FIXME: The XN upper attribute is not currently in use. If needed in the
+ * future, it should be shifted towards the lower word, since the core uses
+ * unsigned long to pass the flags.
  * An arch-specific typedef for the flags as well as the addresses would be
  * useful.
- * The contiguous bit is a hint that allows the PE to store blocks of 16 pages
- * in the TLB. This may be a useful optimisation.
  */
 #define PTE_ACCESS_FLAG		(0x1 << 10)
 /*
@@ -73,6 +71,14 @@
 #define PTE_FLAG_TERMINAL	(0x1 << 1)
 #define PTE_FLAG_VALID		(0x1 << 0)
 
+/*
+ * The contiguous hint allows the PE to store a run of 16 adjacent entries of
+ * the same level in a single TLB entry. It is not passed through the core, but
+ * maintained on the stage-2 tables after each update, see mmu_cell.c.
+ */
+#define PTE_FLAG_CONTIGUOUS	(0x1ULL << 52)
+#define PTE_CONTIGUOUS_ENTRIES	16
+
 /* These bits differ in stage 1 and 2 translations */
 #define S1_PTE_NG		(0x1 << 11)
 #define S1_PTE_ACCESS_RW	(0x0 << 7)
@@ -30,7 +30,7 @@
 #include <asm/spinlock.h>
 #include <jailhouse/control.h>
 
-struct pending_irq;
+struct pending_irqs;
 
 struct per_cpu {
 	/* Keep these two in sync with defines above! */
@@ -43,10 +43,8 @@ struct per_cpu {
 	unsigned int cpu_id;
 	unsigned int virt_id;
 
-	/* Other CPUs can insert sgis into the pending array */
-	spinlock_t gic_lock;
-	struct pending_irq *pending_irqs;
-	struct pending_irq *first_pending;
+	/* Other CPUs can mark virtual IRQs pending here, without locking */
+	struct pending_irqs *pending_irqs;
 	/* Only GICv3: redistributor base */
 	void *gicr_base;
 
@@ -59,9 +57,13 @@ struct per_cpu {
 	/* The mbox will be accessed with a ldrd, which requires alignment */
 	__attribute__((aligned(8))) struct psci_mbox psci_mbox;
 	struct psci_mbox guest_mbox;
+	/* PSCI_CPU_IS_*, protected by the psci_lock of the cell */
+	unsigned int guest_psci_state;
 
 	bool cpu_stopped;
 	bool cell_pages_dirty;
+	/* clean and invalidate the local data caches by set/way on reset */
+	bool flush_dcaches;
 	int shutdown_state;
 	bool shutdown;
 	bool failed;
@@ -53,6 +53,7 @@
 # endif /* GIC */
 
 # define MAINTENANCE_IRQ 25
+# define HYP_TIMER_IRQ	26
 # define SYSREGS_BASE	0x1c010000
 
 #endif /* CONFIG_ARCH_VEXPRESS */
@@ -144,6 +144,8 @@
 /* Condition code */
 #define ESR_ICC_CV_BIT		(1 << 24)
 #define ESR_ICC_COND(icc)	((icc) >> 20 & 0xf)
+/* WFI/WFE trap, set for WFE */
+#define ESR_ISS_WFX_WFE		(1 << 0)
 
 #define EXIT_REASON_UNDEF	0x1
 #define EXIT_REASON_HVC		0x2
@@ -39,6 +39,11 @@
 #define PSCI_NOT_PRESENT	(-7)
 #define PSCI_DISABLED		(-8)
 
+/* AFFINITY_INFO return values, also the power state of the guest CPUs */
+#define PSCI_CPU_IS_ON		0
+#define PSCI_CPU_IS_OFF		1
+#define PSCI_CPU_IS_ON_PENDING	2
+
 #define IS_PSCI_FN(hvc)		((((hvc) >> 24) & 0x84) == 0x84)
 
 #define PSCI_INVALID_ADDRESS	0xffffffff
@@ -46,6 +51,7 @@
 #ifndef __ASSEMBLY__
 
 struct trap_context;
+struct cell;
 struct per_cpu;
 struct psci_mbox {
 	unsigned long entry;
@@ -60,12 +66,15 @@ int psci_wait_cpu_stopped(unsigned int cpu_id);
 
 void psci_suspend(struct per_cpu *cpu_data);
 long psci_resume(unsigned int target);
-long psci_try_resume(unsigned int cpu_id);
 
 long psci_dispatch(struct per_cpu *cpu_data, struct trap_context *ctx);
 
 int psci_cell_init(struct cell *cell);
 unsigned long psci_emulate_spin(struct per_cpu *cpu_data);
+void psci_guest_cpu_reset(struct per_cpu *cpu_data);
+void psci_cell_reset(struct cell *cell);
+long psci_guest_cpu_on(struct per_cpu *target_data, unsigned long entry,
+		       unsigned long context);
 
 #endif /* !__ASSEMBLY__ */
 #endif /* _JAILHOUSE_ASM_PSCI_H */
@@ -62,6 +62,32 @@ static inline void spin_lock(spinlock_t *lock)
 	dmb(ish);
 }
 
+static inline bool spin_trylock(spinlock_t *lock)
+{
+	unsigned long contended, res;
+	u32 slock;
+
+	do {
+		asm volatile (
+"	.arch_extension mp\n"
+"	ldrex	%0, [%3]\n"
+"	mov	%2, #0\n"
+"	subs	%1, %0, %0, ror #16\n"
+"	addeq	%0, %0, %4\n"
+"	strexeq	%2, %0, [%3]"
+		: "=&r" (slock), "=&r" (contended), "=&r" (res)
+		: "r" (&lock->slock), "I" (1 << TICKET_SHIFT)
+		: "cc");
+	} while (res);
+
+	if (contended)
+		return false;
+
+	/* Ensure we have the lock before doing any more memory ops */
+	dmb(ish);
+	return true;
+}
+
 static inline void spin_unlock(spinlock_t *lock)
 {
 	/* Ensure all memory ops are finished before releasing the lock */
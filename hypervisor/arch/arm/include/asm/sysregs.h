@@ -53,6 +53,11 @@
 #define TTBR1_EL1	SYSREG_64(1, c2)
 #define PAR_EL1		SYSREG_64(0, c7)
 
+#define CNTFRQ_EL0	SYSREG_32(0, c14, c0, 0)
+#define CNTPCT_EL0	SYSREG_64(0, c14)
+#define CNTHCTL_EL2	SYSREG_32(4, c14, c1, 0)
+#define CNTHP_CTL_EL2	SYSREG_32(4, c14, c2, 1)
+#define CNTHP_CVAL_EL2	SYSREG_64(6, c14)
 #define CNTKCTL_EL1	SYSREG_32(0, c14, c1, 0)
 #define CNTP_TVAL_EL0	SYSREG_32(0, c14, c2, 0)
 #define CNTP_CTL_EL0	SYSREG_32(0, c14, c2, 1)
@@ -99,7 +104,8 @@
 
 #define ICIALLUIS	SYSREG_32(0, c7, c1, 0)
 #define ICIALLU		SYSREG_32(0, c7, c5, 0)
-#define DCCIMVAC	SYSREG_32(0, c7, c10, 1)
+#define DCCMVAC		SYSREG_32(0, c7, c10, 1)
+#define DCCIMVAC	SYSREG_32(0, c7, c14, 1)
 #define DCCSW		SYSREG_32(0, c7, c10, 2)
 #define DCCISW		SYSREG_32(0, c7, c14, 2)
 
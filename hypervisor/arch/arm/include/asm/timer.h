@@ -0,0 +1,29 @@
+/*
+ * Jailhouse, a Linux-based partitioning hypervisor
+ *
+ * Copyright (c) Siemens AG, 2014
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _JAILHOUSE_ASM_TIMER_H
+#define _JAILHOUSE_ASM_TIMER_H
+
+#define CNTHCTL_EVNTEN		(1 << 2)
+#define CNTHCTL_EVNTDIR		(1 << 3)
+#define CNTHCTL_EVNTI_SHIFT	4
+#define CNTHCTL_EVNTI_MASK	(0xf << CNTHCTL_EVNTI_SHIFT)
+
+#define CNTHP_CTL_ENABLE	(1 << 0)
+
+#ifndef __ASSEMBLY__
+
+int timer_init(void);
+void timer_cpu_init(void);
+void timer_wait_for_event(void);
+void timer_set_deadline(u64 time_us);
+void timer_cancel(void);
+
+#endif /* !__ASSEMBLY__ */
+#endif /* !_JAILHOUSE_ASM_TIMER_H */
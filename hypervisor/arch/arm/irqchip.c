@@ -10,6 +10,7 @@
  * the COPYING file in the top-level directory.
  */
 
+#include <asm/control.h>
 #include <asm/gic_common.h>
 #include <asm/irqchip.h>
 #include <asm/io.h>
@@ -20,6 +21,7 @@
 #include <jailhouse/paging.h>
 #include <jailhouse/printk.h>
 #include <jailhouse/string.h>
+#include <jailhouse/utils.h>
 
 void *gicd_base;
 unsigned long gicd_size;
@@ -33,80 +35,39 @@ static struct irqchip_ops irqchip;
 
 static int irqchip_init_pending(struct per_cpu *cpu_data)
 {
-	struct pending_irq *pend_array;
-
 	if (cpu_data->pending_irqs == NULL) {
-		cpu_data->pending_irqs = pend_array = page_alloc(&mem_pool, 1);
-		if (pend_array == NULL)
+		cpu_data->pending_irqs = page_alloc(&mem_pool, 1);
+		if (cpu_data->pending_irqs == NULL)
 			return -ENOMEM;
-	} else {
-		pend_array = cpu_data->pending_irqs;
 	}
 
-	memset(pend_array, 0, PAGE_SIZE);
-
-	cpu_data->pending_irqs = pend_array;
-	cpu_data->first_pending = NULL;
+	memset(cpu_data->pending_irqs, 0, PAGE_SIZE);
 
 	return 0;
 }
 
 /*
- * Find the first available pending struct for insertion. The `prev' pointer is
- * set to the previous pending interrupt, if any, to help inserting the new one
- * into the list.
- * Returns NULL when no slot is available
+ * Mark a virtual IRQ pending on the target CPU. This can be called from any
+ * CPU and does not wait for the target. Hardware interrupts are mapped 1:1,
+ * so only their virtual ID is recorded.
  */
-static struct pending_irq* get_pending_slot(struct per_cpu *cpu_data,
-					    struct pending_irq **prev)
-{
-	u32 i, pending_idx;
-	struct pending_irq *pending = cpu_data->first_pending;
-
-	*prev = NULL;
-
-	for (i = 0; i < MAX_PENDING_IRQS; i++) {
-		pending_idx = pending - cpu_data->pending_irqs;
-		if (pending == NULL || i < pending_idx)
-			return cpu_data->pending_irqs + i;
-
-		*prev = pending;
-		pending = pending->next;
-	}
-
-	return NULL;
-}
-
 int irqchip_insert_pending(struct per_cpu *cpu_data, struct pending_irq *irq)
 {
-	struct pending_irq *prev = NULL;
-	struct pending_irq *slot;
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+	u8 attrs = 0;
 
-	spin_lock(&cpu_data->gic_lock);
+	if (irq->virt_id >= MAX_VIRT_IRQS)
+		return -EINVAL;
 
-	slot = get_pending_slot(cpu_data, &prev);
-	if (slot == NULL) {
-		spin_unlock(&cpu_data->gic_lock);
-		return -ENOMEM;
-	}
+	if (irq->hw)
+		attrs |= PENDING_IRQ_HW;
+	else if (irq->type.sgi.maintenance)
+		attrs |= PENDING_IRQ_MAINTENANCE;
 
-	/*
-	 * Don't override the pointers yet, they may be read by the injection
-	 * loop. Odds are astronomically low, but hey.
-	 */
-	memcpy(slot, irq, sizeof(struct pending_irq) - 2 * sizeof(void *));
-	slot->prev = prev;
-	if (prev) {
-		slot->next = prev->next;
-		prev->next = slot;
-	} else {
-		slot->next = cpu_data->first_pending;
-		cpu_data->first_pending = slot;
-	}
-	if (slot->next)
-		slot->next->prev = slot;
-
-	spin_unlock(&cpu_data->gic_lock);
+	pending->attrs[irq->virt_id] = attrs;
+	/* publish the attributes before the interrupt becomes visible */
+	memory_barrier();
+	set_bit(irq->virt_id, pending->bitmap);
 
 	return 0;
 }
@@ -116,8 +77,7 @@ int irqchip_set_pending(struct per_cpu *cpu_data, u32 irq_id, bool try_inject)
 	struct pending_irq pending;
 
 	pending.virt_id = irq_id;
-	/* Priority must be less than ICC_PMR */
-	pending.priority = 0;
+	pending.priority = cpu_data->pending_irqs->priority[irq_id];
 
 	if (is_sgi(irq_id)) {
 		pending.hw = 0;
@@ -135,47 +95,201 @@ int irqchip_set_pending(struct per_cpu *cpu_data, u32 irq_id, bool try_inject)
 }
 
 /*
- * Only executed by `irqchip_inject_pending' on a CPU to inject its own stuff.
+ * Queue a purely virtual SPI, i.e. without physical counterpart, on the target
+ * CPU and kick it for injection. Nothing is sent while the interrupt is
+ * disabled in the distributor.
  */
-int irqchip_remove_pending(struct per_cpu *cpu_data, struct pending_irq *irq)
+int irqchip_send_virtual_spi(struct per_cpu *target_data, u32 irq_id)
 {
-	spin_lock(&cpu_data->gic_lock);
+	struct pending_irq pending;
+	struct sgi sgi;
+	u32 enabled;
+	int err;
 
-	if (cpu_data->first_pending == irq)
-		cpu_data->first_pending = irq->next;
-	if (irq->prev)
-		irq->prev->next = irq->next;
-	if (irq->next)
-		irq->next->prev = irq->prev;
+	enabled = readl_relaxed(gicd_base + GICD_ISENABLER + irq_id / 32 * 4);
+	if (!(enabled & (1 << (irq_id % 32))))
+		return -ENODEV;
 
-	spin_unlock(&cpu_data->gic_lock);
+	pending.virt_id = irq_id;
+	pending.priority = target_data->pending_irqs->priority[irq_id];
+	pending.hw = 0;
+	pending.type.sgi.maintenance = 0;
+	pending.type.sgi.cpuid = 0;
 
-	return 0;
+	err = irqchip_insert_pending(target_data, &pending);
+	if (err || !irqchip_needs_kick(target_data))
+		return err;
+
+	sgi.routing_mode = 0;
+	sgi.aff1 = 0;
+	sgi.aff2 = 0;
+	sgi.aff3 = 0;
+	sgi.targets = 1 << target_data->cpu_id;
+	sgi.id = SGI_INJECT;
+
+	return irqchip_send_sgi(&sgi);
 }
 
+/*
+ * Called after marking IRQs pending on another CPU. Returns true if that CPU
+ * may be running its guest and has to be kicked with SGI_INJECT. Otherwise,
+ * it picks the IRQs up before returning to the guest, see
+ * irqchip_guest_resume.
+ */
+bool irqchip_needs_kick(struct per_cpu *target_data)
+{
+	struct pending_irqs *pending = target_data->pending_irqs;
+
+	pending->recheck = true;
+	/* pairs with the barrier in irqchip_guest_resume */
+	memory_barrier();
+	return !pending->in_hypervisor;
+}
+
+void irqchip_guest_exited(struct per_cpu *cpu_data)
+{
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+
+	pending->in_hypervisor = true;
+	/* The guest may have completed list register entries meanwhile. */
+	pending->lrs_synced = false;
+}
+
+void irqchip_guest_resume(struct per_cpu *cpu_data)
+{
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+
+	pending->in_hypervisor = false;
+	memory_barrier();
+	if (pending->recheck) {
+		pending->recheck = false;
+		irqchip_inject_pending(cpu_data);
+	}
+}
+
+static bool irqchip_has_pending(struct per_cpu *cpu_data)
+{
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+	unsigned int n;
+
+	irqchip.update_lrs(cpu_data);
+	if (pending->lr_used)
+		return true;
+
+	for (n = 0; n < ARRAY_SIZE(pending->bitmap); n++)
+		if (pending->bitmap[n])
+			return true;
+
+	return false;
+}
+
+/*
+ * Idle until the guest has something to handle. Physical interrupts are masked
+ * in the hypervisor, but they still end WFI, including the SGI_INJECT sent by
+ * CPUs that queue virtual IRQs for us once in_hypervisor is cleared. Those
+ * already queued or in the list registers are checked beforehand, as they do
+ * not wake us up.
+ */
+void irqchip_wait_for_irq(struct per_cpu *cpu_data)
+{
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+
+	pending->in_hypervisor = false;
+	/* pairs with the barrier in irqchip_needs_kick */
+	memory_barrier();
+	if (!irqchip_has_pending(cpu_data))
+		wfi();
+	pending->in_hypervisor = true;
+}
+
+/*
+ * Collects the pending IRQs with the highest priorities in a single scan, the
+ * ones with the lowest IDs among equals, sorted in this order. No more than
+ * GIC_MAX_LRS can be injected in one round.
+ * Returns the number of IRQs stored in irqs.
+ */
+static unsigned int irqchip_collect_pending(struct pending_irqs *pending,
+					    u16 irqs[GIC_MAX_LRS])
+{
+	unsigned int n, i, irq, pos, count = 0;
+	unsigned long word;
+
+	for (n = 0; n < ARRAY_SIZE(pending->bitmap); n++) {
+		word = pending->bitmap[n];
+		while (word) {
+			irq = ffsl(word);
+			word &= ~(1UL << irq);
+			irq += n * BITS_PER_LONG;
+
+			/* IRQs are scanned by ID, so equals stay behind */
+			pos = count;
+			while (pos > 0 && pending->priority[irqs[pos - 1]] >
+			       pending->priority[irq])
+				pos--;
+			if (pos == GIC_MAX_LRS)
+				continue;
+
+			if (count < GIC_MAX_LRS)
+				count++;
+			for (i = count - 1; i > pos; i--)
+				irqs[i] = irqs[i - 1];
+			irqs[pos] = irq;
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Only executed by a CPU to inject its own pending IRQs. The injection stops at
+ * the first IRQ that neither fits into a free list register nor preempts a
+ * lower-priority one; the maintenance interrupt requested by the backend will
+ * resume it. The bitmap is only scanned again after a full round of
+ * GIC_MAX_LRS injections, IRQs raised meanwhile are picked up through the
+ * recheck flag otherwise.
+ */
 int irqchip_inject_pending(struct per_cpu *cpu_data)
 {
-	int err;
-	struct pending_irq *pending = cpu_data->first_pending;
-
-	while (pending != NULL) {
-		err = irqchip.inject_irq(cpu_data, pending);
-		if (err == -EBUSY)
-			/* The list registers are full. */
-			break;
-		else
+	struct pending_irqs *pending = cpu_data->pending_irqs;
+	u16 irqs[GIC_MAX_LRS];
+	struct pending_irq irq;
+	unsigned int count, n;
+	u16 virt_id;
+	u8 attrs;
+
+	do {
+		count = irqchip_collect_pending(pending, irqs);
+
+		for (n = 0; n < count; n++) {
+			virt_id = irqs[n];
+
 			/*
-			 * Removal only changes the pointers, but does not
-			 * deallocate anything.
-			 * Concurrent accesses are avoided with the spinlock,
-			 * but the `next' pointer of the current pending object
-			 * may be rewritten by an external insert before or
-			 * after this removal, which isn't an issue.
+			 * Clear the bit before reading the attributes: a
+			 * concurrent raise then either merges with this
+			 * injection or leaves the bit set for the next round.
 			 */
-			irqchip_remove_pending(cpu_data, pending);
-
-		pending = pending->next;
-	}
+			clear_bit(virt_id, pending->bitmap);
+			memory_barrier();
+			attrs = pending->attrs[virt_id];
+
+			irq.virt_id = virt_id;
+			irq.priority = pending->priority[virt_id];
+			irq.hw = !!(attrs & PENDING_IRQ_HW);
+			if (irq.hw) {
+				irq.type.irq = virt_id;
+			} else {
+				irq.type.sgi.cpuid = 0;
+				irq.type.sgi.maintenance =
+					!!(attrs & PENDING_IRQ_MAINTENANCE);
+			}
+
+			if (irqchip.inject_irq(cpu_data, &irq) == -EBUSY) {
+				/* The list registers are full. */
+				set_bit(virt_id, pending->bitmap);
+				return 0;
+			}
+		}
+	} while (count == GIC_MAX_LRS);
 
 	return 0;
 }
@@ -242,41 +356,49 @@ int irqchip_mmio_access(struct per_cpu *cpu_data, struct mmio_access *access)
 	return TRAP_UNHANDLED;
 }
 
-static const struct jailhouse_irqchip *
-irqchip_find_config(struct jailhouse_cell_desc *config)
+/* Collect the SPIs of all irqchip entries of a cell configuration */
+static void irqchip_config_spis(struct jailhouse_cell_desc *config,
+				unsigned long *spis)
 {
 	const struct jailhouse_irqchip *irq_config =
 		jailhouse_cell_irqchips(config);
+	unsigned int n, pin;
 
-	if (config->num_irqchips)
-		return irq_config;
-	else
-		return NULL;
+	memset(spis, 0, sizeof(root_cell.arch.spis));
+
+	for (n = 0; n < config->num_irqchips; n++, irq_config++)
+		for (pin = 0; pin < 64; pin++)
+			if (irq_config->pin_bitmap & (1ULL << pin) &&
+			    irq_config->pin_base + pin < MAX_SPIS)
+				set_bit(irq_config->pin_base + pin, spis);
 }
 
 void irqchip_cell_init(struct cell *cell)
 {
-	const struct jailhouse_irqchip *pins = irqchip_find_config(cell->config);
-
-	cell->arch.spis = (pins ? pins->pin_bitmap : 0);
+	irqchip_config_spis(cell->config, cell->arch.spis);
 
 	irqchip.cell_init(cell);
 }
 
 void irqchip_cell_exit(struct cell *cell)
 {
-	const struct jailhouse_irqchip *root_pins =
-		irqchip_find_config(root_cell.config);
+	unsigned long root_spis[ARRAY_SIZE(root_cell.arch.spis)];
+	unsigned int n;
 
-	if (root_pins)
-		root_cell.arch.spis |= cell->arch.spis & root_pins->pin_bitmap;
+	irqchip_config_spis(root_cell.config, root_spis);
+
+	for (n = 0; n < ARRAY_SIZE(root_spis); n++)
+		root_cell.arch.spis[n] |= cell->arch.spis[n] & root_spis[n];
 
 	irqchip.cell_exit(cell);
 }
 
 void irqchip_root_cell_shrink(struct cell *cell)
 {
-	root_cell.arch.spis &= ~(cell->arch.spis);
+	unsigned int n;
+
+	for (n = 0; n < ARRAY_SIZE(root_cell.arch.spis); n++)
+		root_cell.arch.spis[n] &= ~cell->arch.spis[n];
 }
 
 /* Only the GIC is implemented */
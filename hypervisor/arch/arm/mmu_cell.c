@@ -16,11 +16,177 @@
 #include <jailhouse/paging.h>
 #include <jailhouse/printk.h>
 
+#define ENTRIES_PER_TABLE	(PAGE_SIZE / sizeof(u64))
+
+/*
+ * Cell RAM beyond this size is cleaned by set/way instead of by VA, which
+ * takes longer than walking the whole cache hierarchy.
+ */
+#define DCACHE_FLUSH_BY_VA_MAX	(4 * 1024 * 1024)
+
+/*
+ * Returns true if the n entries from pte on, the first one translating virt,
+ * are terminal and map a physical range aligned to its size, with identical
+ * attributes.
+ */
+static bool entries_contiguous(const struct paging *paging, pt_entry_t pte,
+			       unsigned long virt, unsigned int n)
+{
+	unsigned long phys, flags;
+	unsigned int i;
+
+	if (!paging->entry_valid(pte))
+		return false;
+	phys = paging->get_phys(pte, virt);
+	if (phys == INVALID_PHYS_ADDR || (phys & (n * paging->page_size - 1)))
+		return false;
+	flags = paging->get_flags(pte);
+
+	for (i = 1; i < n; i++) {
+		pte++;
+		virt += paging->page_size;
+		phys += paging->page_size;
+		if (!paging->entry_valid(pte) ||
+		    paging->get_phys(pte, virt) != phys ||
+		    paging->get_flags(pte) != flags)
+			return false;
+	}
+	return true;
+}
+
+/* Returns the table of the given level that translates virt, if any */
+static page_table_t find_table(const struct paging_structures *pg_structs,
+			       const struct paging *level, unsigned long virt)
+{
+	const struct paging *paging = pg_structs->root_paging;
+	page_table_t pt = pg_structs->root_table;
+	pt_entry_t pte;
+
+	for (; paging != level; paging++) {
+		pte = paging->get_entry(pt, virt);
+		if (!paging->entry_valid(pte) ||
+		    paging->get_phys(pte, virt) != INVALID_PHYS_ADDR)
+			return NULL;
+		pt = page_map_phys2hvirt(paging->get_next_pt(pte));
+	}
+	return pt;
+}
+
+/*
+ * Replace the num tables below the given level, from virt on, by a block when
+ * they map their whole range contiguously. The core splits blocks on partial
+ * updates, e.g. when a cell takes some pages from the root cell, but never
+ * merges them again once the pages are given back.
+ */
+static void merge_tables(const struct paging_structures *pg_structs,
+			 const struct paging *level, unsigned long virt,
+			 unsigned long num)
+{
+	const struct paging *sub_level = level + 1;
+	page_table_t pt, sub_pt;
+	unsigned long flags;
+	pt_entry_t pte;
+
+	for (; num > 0; num--, virt += level->page_size) {
+		pt = find_table(pg_structs, level, virt);
+		if (!pt)
+			continue;
+
+		pte = level->get_entry(pt, virt);
+		if (!level->entry_valid(pte) ||
+		    level->get_phys(pte, virt) != INVALID_PHYS_ADDR)
+			continue;
+
+		sub_pt = page_map_phys2hvirt(level->get_next_pt(pte));
+		if (!entries_contiguous(sub_level, sub_pt, virt,
+					ENTRIES_PER_TABLE))
+			continue;
+
+		/* Level 3 pages carry the table bit, blocks must not */
+		flags = sub_level->get_flags(sub_pt) & ~PTE_FLAG_TERMINAL;
+		level->set_terminal(pte, sub_level->get_phys(sub_pt, virt),
+				    flags);
+		page_free(&mem_pool, sub_pt, 1);
+	}
+}
+
+/*
+ * Set the contiguous hint on the num aligned runs of entries of the given
+ * level from virt on that allow it, and clear it on the others.
+ */
+static void update_contiguous_hint(const struct paging_structures *pg_structs,
+				   const struct paging *level,
+				   unsigned long virt, unsigned long num)
+{
+	unsigned long run = level->page_size * PTE_CONTIGUOUS_ENTRIES;
+	pt_entry_t pte;
+	page_table_t pt;
+	unsigned int n;
+	bool hint;
+
+	for (; num > 0; num--, virt += run) {
+		pt = find_table(pg_structs, level, virt);
+		if (!pt)
+			continue;
+
+		pte = level->get_entry(pt, virt);
+		hint = entries_contiguous(level, pte, virt,
+					  PTE_CONTIGUOUS_ENTRIES);
+		for (n = 0; n < PTE_CONTIGUOUS_ENTRIES; n++, pte++)
+			if (hint)
+				*pte |= PTE_FLAG_CONTIGUOUS;
+			else
+				*pte &= ~PTE_FLAG_CONTIGUOUS;
+	}
+}
+
+/*
+ * The core maps a region with the largest blocks its alignment allows. Merge
+ * the tables around the updated range that can be blocks again, and maintain
+ * the contiguous hint, which the core does not know about. Both reduce the
+ * number of TLB entries that the guest needs.
+ */
+static void update_blocks(struct cell *cell, unsigned long virt,
+			  unsigned long size)
+{
+	const struct paging_structures *pg_structs = &cell->arch.mm;
+	const struct paging *level;
+	unsigned long first, last, unit;
+	int n;
+
+	if (size == 0)
+		return;
+	last = virt + size - 1;
+
+	/* Bottom-up, so that merged tables can be merged in turn */
+	for (n = MAX_PAGE_DIR_LEVELS - 2; n >= 0; n--) {
+		level = pg_structs->root_paging + n;
+		if (level->page_size == 0)
+			continue;
+		first = virt & ~(level->page_size - 1);
+		merge_tables(pg_structs, level, first,
+			     (last - first) / level->page_size + 1);
+	}
+
+	for (n = 0; n < MAX_PAGE_DIR_LEVELS; n++) {
+		level = pg_structs->root_paging + n;
+		/* A run of 1GB blocks does not fit in a 32-bit IPA space */
+		if (level->page_size == 0 ||
+		    level->page_size > ~0UL / PTE_CONTIGUOUS_ENTRIES)
+			continue;
+		unit = level->page_size * PTE_CONTIGUOUS_ENTRIES;
+		first = virt & ~(unit - 1);
+		update_contiguous_hint(pg_structs, level, first,
+				       (last - first) / unit + 1);
+	}
+}
+
 int arch_map_memory_region(struct cell *cell,
 			   const struct jailhouse_memory *mem)
 {
 	u64 phys_start = mem->phys_start;
 	u32 flags = PTE_FLAG_VALID | PTE_ACCESS_FLAG;
+	int err;
 
 	if (mem->flags & JAILHOUSE_MEM_READ)
 		flags |= S2_PTE_ACCESS_RO;
@@ -40,15 +206,29 @@ int arch_map_memory_region(struct cell *cell,
 		flags |= S2_PAGE_ACCESS_XN;
 	*/
 
-	return page_map_create(&cell->arch.mm, phys_start, mem->size,
+	err = page_map_create(&cell->arch.mm, phys_start, mem->size,
 		mem->virt_start, flags, PAGE_MAP_NON_COHERENT);
+	if (err)
+		return err;
+
+	update_blocks(cell, mem->virt_start, mem->size);
+
+	return 0;
 }
 
 int arch_unmap_memory_region(struct cell *cell,
 			     const struct jailhouse_memory *mem)
 {
-	return page_map_destroy(&cell->arch.mm, mem->virt_start, mem->size,
+	int err;
+
+	err = page_map_destroy(&cell->arch.mm, mem->virt_start, mem->size,
 			PAGE_MAP_NON_COHERENT);
+	if (err)
+		return err;
+
+	update_blocks(cell, mem->virt_start, mem->size);
+
+	return 0;
 }
 
 unsigned long arch_page_map_gphys2phys(struct per_cpu *cpu_data,
@@ -118,21 +298,103 @@ void arch_cpu_tlb_flush(struct per_cpu *cpu_data)
 	cpu_data->cell_pages_dirty = false;
 }
 
-void arch_cell_caches_flush(struct cell *cell)
+/* device regions are neither executable nor loadable */
+static bool cell_mem_is_ram(const struct jailhouse_memory *mem)
+{
+	return !(mem->flags & JAILHOUSE_MEM_COMM_REGION) &&
+		(mem->flags & (JAILHOUSE_MEM_EXECUTE | JAILHOUSE_MEM_LOADABLE));
+}
+
+static int cell_mem_flush(struct per_cpu *cpu_data,
+			  const struct jailhouse_memory *mem)
+{
+	unsigned long mapping_addr = TEMPORARY_MAPPING_CPU_BASE(cpu_data);
+	unsigned long offs, size;
+	int err;
+
+	for (offs = 0; offs < mem->size; offs += size) {
+		size = mem->size - offs;
+		if (size > NUM_TEMPORARY_PAGES * PAGE_SIZE)
+			size = NUM_TEMPORARY_PAGES * PAGE_SIZE;
+
+		err = page_map_create(&hv_paging_structs,
+				      mem->phys_start + offs, size,
+				      mapping_addr, PAGE_DEFAULT_FLAGS,
+				      PAGE_MAP_NON_COHERENT);
+		if (err)
+			return err;
+
+		flush_cache((void *)mapping_addr, size);
+	}
+	return 0;
+}
+
+/*
+ * Clean and invalidate the memory of a cell to the point of coherency by VA.
+ * Maintenance by VA is broadcast, so one CPU is enough. The communication
+ * region, written by the hypervisor, and the loadable regions, written by the
+ * root cell or from a snapshot, are always flushed this way. The other RAM
+ * regions, handed over from the root cell, are only flushed if they are not
+ * larger than DCACHE_FLUSH_BY_VA_MAX in total.
+ *
+ * Return: 0 if all RAM was flushed, -E2BIG if the remaining RAM has to be
+ * flushed by set/way, other negative error code if mapping a region failed.
+ */
+static int cell_dcaches_flush(struct per_cpu *cpu_data, struct cell *cell)
+{
+	const struct jailhouse_memory *mem =
+		jailhouse_cell_mem_regions(cell->config);
+	unsigned long ram_size = 0;
+	unsigned int n;
+	int err;
+
+	flush_cache(&cell->comm_page, sizeof(cell->comm_page));
+
+	for (n = 0; n < cell->config->num_memory_regions; n++)
+		if (cell_mem_is_ram(&mem[n]) &&
+		    !(mem[n].flags & JAILHOUSE_MEM_LOADABLE))
+			ram_size += mem[n].size;
+
+	for (n = 0; n < cell->config->num_memory_regions; n++, mem++) {
+		if (!(mem->flags & JAILHOUSE_MEM_LOADABLE) &&
+		    (!cell_mem_is_ram(mem) || ram_size > DCACHE_FLUSH_BY_VA_MAX))
+			continue;
+
+		err = cell_mem_flush(cpu_data, mem);
+		if (err)
+			return err;
+	}
+	dsb(ish);
+
+	return ram_size > DCACHE_FLUSH_BY_VA_MAX ? -E2BIG : 0;
+}
+
+void arch_cell_caches_flush(struct per_cpu *cpu_data, struct cell *cell)
 {
-	/* Only the first CPU needs to clean the data caches */
+	unsigned int cpu;
+
+	/* Only the first CPU needs to clean the data caches by VA */
 	spin_lock(&cell->arch.caches_lock);
 	if (cell->arch.needs_flush) {
 		/*
-		 * Since there is no way to know which virtual addresses have been used
-		 * by the root cell to write the new cell's data, a complete clean has
-		 * to be performed.
+		 * The cell may start with its caches disabled, so the images
+		 * written into it have to reach memory, and no stale line may
+		 * hide them later on. Set/way operations only act on the
+		 * caches of the executing CPU, so every CPU of the cell has to
+		 * perform them if large RAM regions are left or mapping failed.
 		 */
-		arch_cpu_dcaches_flush(CACHES_CLEAN_INVALIDATE);
+		if (cell_dcaches_flush(cpu_data, cell) != 0)
+			for_each_cpu(cpu, cell->cpu_set)
+				per_cpu(cpu)->flush_dcaches = true;
 		cell->arch.needs_flush = false;
 	}
 	spin_unlock(&cell->arch.caches_lock);
 
+	if (cpu_data->flush_dcaches) {
+		arch_cpu_dcaches_flush(CACHES_CLEAN_INVALIDATE);
+		cpu_data->flush_dcaches = false;
+	}
+
 	/*
 	 * New instructions may have been written, so the I-cache needs to be
 	 * invalidated even though the VMID is different.
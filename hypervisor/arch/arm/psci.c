@@ -11,6 +11,7 @@
  */
 
 #include <asm/control.h>
+#include <asm/irqchip.h>
 #include <asm/percpu.h>
 #include <asm/psci.h>
 #include <asm/traps.h>
@@ -55,24 +56,81 @@ bool psci_cpu_stopped(unsigned int cpu_id)
 	return per_cpu(cpu_id)->psci_mbox.entry == PSCI_INVALID_ADDRESS;
 }
 
-long psci_try_resume(unsigned int cpu_id)
+int psci_wait_cpu_stopped(unsigned int cpu_id)
 {
-	if (psci_cpu_stopped(cpu_id))
-		return psci_resume(cpu_id);
+	/*
+	 * _psci_cpu_off sends an event once the mbox is invalidated. One that
+	 * arrives between the check and the wfe is latched and ends it
+	 * immediately. cpu_relax keeps the mbox read inside the loop.
+	 */
+	while (!psci_cpu_stopped(cpu_id)) {
+		wfe();
+		cpu_relax();
+	}
 
-	return -EBUSY;
+	return 0;
 }
 
-int psci_wait_cpu_stopped(unsigned int cpu_id)
+/*
+ * Called by the CPU that resets @cpu_data, before releasing it. Root cell CPUs
+ * and the first CPU of other cells start right away, the others wait for the
+ * guest to turn them on.
+ */
+void psci_guest_cpu_reset(struct per_cpu *cpu_data)
 {
-	/* FIXME: add a delay */
-	do {
-		if (psci_cpu_stopped(cpu_id))
-			return 0;
-		cpu_relax();
-	} while (1);
+	if (cpu_data->cell == &root_cell || cpu_data->virt_id == 0)
+		cpu_data->guest_psci_state = PSCI_CPU_IS_ON;
+	else
+		cpu_data->guest_psci_state = PSCI_CPU_IS_OFF;
+}
+
+/*
+ * All CPUs of the cell have to be stopped. Their states must be set before the
+ * first one is released, or it could turn on a sibling that is still seen as
+ * on from the previous run.
+ */
+void psci_cell_reset(struct cell *cell)
+{
+	unsigned int cpu;
+
+	spin_lock(&cell->arch.psci_lock);
+	for_each_cpu(cpu, cell->cpu_set)
+		psci_guest_cpu_reset(per_cpu(cpu));
+	spin_unlock(&cell->arch.psci_lock);
+}
+
+/*
+ * Start a guest CPU that is off. It is stopped in psci_emulate_spin, or about
+ * to be, so resuming it only waits for the stop.
+ */
+long psci_guest_cpu_on(struct per_cpu *target_data, unsigned long entry,
+		       unsigned long context)
+{
+	struct cell *cell = target_data->cell;
+	long ret = PSCI_SUCCESS;
+
+	spin_lock(&cell->arch.psci_lock);
+
+	if (target_data->guest_psci_state == PSCI_CPU_IS_OFF) {
+		target_data->guest_mbox.entry = entry;
+		target_data->guest_mbox.context = context;
+		target_data->guest_psci_state = PSCI_CPU_IS_ON_PENDING;
+	} else if (target_data->guest_psci_state == PSCI_CPU_IS_ON) {
+		ret = PSCI_ALREADY_ON;
+	} else {
+		ret = PSCI_ON_PENDING;
+	}
+
+	spin_unlock(&cell->arch.psci_lock);
 
-	return -EBUSY;
+	/*
+	 * If the CPU has been woken up by someone else meanwhile, it still
+	 * finds the pending request in psci_emulate_spin.
+	 */
+	if (ret == PSCI_SUCCESS)
+		psci_resume(target_data->cpu_id);
+
+	return ret;
 }
 
 static long psci_emulate_cpu_on(struct per_cpu *cpu_data,
@@ -80,32 +138,45 @@ static long psci_emulate_cpu_on(struct per_cpu *cpu_data,
 {
 	unsigned int target = ctx->regs[1];
 	unsigned int cpu;
-	struct psci_mbox *mbox;
 
 	cpu = cpu_virt2phys(cpu_data->cell, target);
 	if (cpu == -1)
 		/* Virtual id not in set */
 		return PSCI_DENIED;
 
-	mbox = &(per_cpu(cpu)->guest_mbox);
-	mbox->entry = ctx->regs[2];
-	mbox->context = ctx->regs[3];
+	return psci_guest_cpu_on(per_cpu(cpu), ctx->regs[2], ctx->regs[3]);
+}
+
+static long psci_emulate_affinity_info(struct per_cpu *cpu_data,
+				       struct trap_context *ctx)
+{
+	unsigned int cpu = cpu_virt2phys(cpu_data->cell, ctx->regs[1]);
+
+	/* Only single CPUs, affinity level 0, are described */
+	if (cpu == -1 || ctx->regs[2] != 0)
+		return PSCI_INVALID_PARAMETERS;
 
-	return psci_resume(cpu);
+	return per_cpu(cpu)->guest_psci_state;
 }
 
 /* Returns the secondary address set by the guest */
 unsigned long psci_emulate_spin(struct per_cpu *cpu_data)
 {
-	struct psci_mbox *mbox = &(cpu_data->guest_mbox);
-
-	mbox->entry = 0;
+	struct cell *cell = cpu_data->cell;
+	bool started;
 
-	/* Wait for emulate_cpu_on or a trapped mmio to the mbox */
-	while (mbox->entry == 0)
+	/* Wait for psci_guest_cpu_on */
+	do {
 		psci_suspend(cpu_data);
 
-	return mbox->entry;
+		spin_lock(&cell->arch.psci_lock);
+		started = cpu_data->guest_psci_state == PSCI_CPU_IS_ON_PENDING;
+		if (started)
+			cpu_data->guest_psci_state = PSCI_CPU_IS_ON;
+		spin_unlock(&cell->arch.psci_lock);
+	} while (!started);
+
+	return cpu_data->guest_mbox.entry;
 }
 
 int psci_cell_init(struct cell *cell)
@@ -130,6 +201,10 @@ long psci_dispatch(struct per_cpu *cpu_data, struct trap_context *ctx)
 		return 2;
 
 	case PSCI_CPU_OFF:
+		spin_lock(&cpu_data->cell->arch.psci_lock);
+		cpu_data->guest_psci_state = PSCI_CPU_IS_OFF;
+		spin_unlock(&cpu_data->cell->arch.psci_lock);
+
 		/*
 		 * The reset function will take care of calling
 		 * psci_emulate_spin
@@ -139,9 +214,20 @@ long psci_dispatch(struct per_cpu *cpu_data, struct trap_context *ctx)
 		/* Not reached */
 		return 0;
 
+	case PSCI_CPU_SUSPEND_32:
+		/*
+		 * Power down states are handled like standby, which is allowed:
+		 * the guest resumes after the call once it has an IRQ to take.
+		 */
+		irqchip_wait_for_irq(cpu_data);
+		return PSCI_SUCCESS;
+
 	case PSCI_CPU_ON_32:
 		return psci_emulate_cpu_on(cpu_data, ctx);
 
+	case PSCI_AFFINITY_INFO_32:
+		return psci_emulate_affinity_info(cpu_data, ctx);
+
 	default:
 		return PSCI_NOT_SUPPORTED;
 	}
@@ -16,6 +16,7 @@
 #include <asm/platform.h>
 #include <asm/setup.h>
 #include <asm/sysregs.h>
+#include <asm/timer.h>
 #include <jailhouse/control.h>
 #include <jailhouse/entry.h>
 #include <jailhouse/paging.h>
@@ -47,6 +48,10 @@ int arch_init_early(void)
 	if ((err = arch_check_features()) != 0)
 		return err;
 
+	err = timer_init();
+	if (err)
+		return err;
+
 	err = arch_mmu_cell_init(&root_cell);
 	if (err)
 		return err;
@@ -85,6 +90,9 @@ int arch_cpu_init(struct per_cpu *cpu_data)
 
 	/* Setup guest traps */
 	arm_write_sysreg(HCR, hcr);
+	arch_cell_wait_traps_init(&root_cell);
+
+	timer_cpu_init();
 
 	err = arch_mmu_cpu_cell_init(cpu_data);
 	if (err)
@@ -120,6 +128,7 @@ void arch_cpu_activate_vmm(struct per_cpu *cpu_data)
 
 void arch_shutdown_self(struct per_cpu *cpu_data)
 {
+	timer_cancel();
 	irqchip_cpu_shutdown(cpu_data);
 
 	/* Free the guest */
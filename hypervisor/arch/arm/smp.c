@@ -51,10 +51,9 @@ int arch_generic_smp_mmio(struct per_cpu *cpu_data, struct mmio_access *access,
 		/* Ignore all other accesses */
 		return TRAP_HANDLED;
 
-	for_each_cpu_except(cpu, cpu_data->cell->cpu_set, cpu_data->cpu_id) {
-		per_cpu(cpu)->guest_mbox.entry = access->val;
-		psci_try_resume(cpu);
-	}
+	/* Only starts the CPUs that are still off, like CPU_ON */
+	for_each_cpu_except(cpu, cpu_data->cell->cpu_set, cpu_data->cpu_id)
+		psci_guest_cpu_on(per_cpu(cpu), access->val, 0);
 
 	return TRAP_HANDLED;
 }
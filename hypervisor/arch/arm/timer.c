@@ -0,0 +1,141 @@
+/*
+ * Jailhouse, a Linux-based partitioning hypervisor
+ *
+ * Copyright (c) Siemens AG, 2014
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <jailhouse/entry.h>
+#include <jailhouse/printk.h>
+#include <jailhouse/processor.h>
+#include <asm/sysregs.h>
+#include <asm/timer.h>
+
+/*
+ * Generate an event each 2^(EVNTI + 1) counter ticks to bound waits on WFE,
+ * i.e. about every 85 us at 24 MHz.
+ */
+#define CNTHCTL_EVNTI		10
+
+static u32 timer_freq;
+/* microseconds per counter tick, as integral and 0.32 fixed-point part */
+static u32 timer_us_mult_int;
+static u32 timer_us_mult_frac;
+
+/* 64 by 32 bit division without relying on libgcc */
+static u64 div_u64_u32(u64 dividend, u32 divisor)
+{
+	u64 quotient = 0, rem = 0;
+	int bit;
+
+	for (bit = 63; bit >= 0; bit--) {
+		rem = (rem << 1) | ((dividend >> bit) & 1);
+		if (rem >= divisor) {
+			rem -= divisor;
+			quotient |= 1ULL << bit;
+		}
+	}
+	return quotient;
+}
+
+/**
+ * timer_init() - Derive the time base from the generic timer frequency
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+int timer_init(void)
+{
+	u32 freq;
+
+	arm_read_sysreg(CNTFRQ_EL0, freq);
+	if (freq == 0)
+		return -ENODEV;
+
+	timer_freq = freq;
+	/* the integral part is only non-zero for frequencies up to 1 MHz */
+	timer_us_mult_int = 1000000 / freq;
+	timer_us_mult_frac = div_u64_u32((u64)(1000000 % freq) << 32, freq);
+
+	printk("Generic timer frequency: %d Hz\n", freq);
+
+	return 0;
+}
+
+/*
+ * Program the event stream interval, but leave the stream disabled. It also
+ * wakes up WFE of the guest, so it only runs while the hypervisor waits.
+ */
+void timer_cpu_init(void)
+{
+	u32 cnthctl;
+
+	arm_read_sysreg(CNTHCTL_EL2, cnthctl);
+	cnthctl &= ~(CNTHCTL_EVNTI_MASK | CNTHCTL_EVNTDIR | CNTHCTL_EVNTEN);
+	cnthctl |= CNTHCTL_EVNTI << CNTHCTL_EVNTI_SHIFT;
+	arm_write_sysreg(CNTHCTL_EL2, cnthctl);
+
+	timer_cancel();
+}
+
+/**
+ * timer_wait_for_event() - Wait for an event, at most one stream interval
+ *
+ * The event stream is enabled for the duration of the WFE only.
+ */
+void timer_wait_for_event(void)
+{
+	u32 cnthctl;
+
+	arm_read_sysreg(CNTHCTL_EL2, cnthctl);
+	arm_write_sysreg(CNTHCTL_EL2, cnthctl | CNTHCTL_EVNTEN);
+	isb();
+	wfe();
+	arm_write_sysreg(CNTHCTL_EL2, cnthctl);
+	isb();
+}
+
+/**
+ * timer_set_deadline() - Raise HYP_TIMER_IRQ on this CPU at the given time
+ * @time_us:	Time as returned by arch_get_time_us()
+ *
+ * The interrupt stays asserted until timer_cancel() is called or a later
+ * deadline is set.
+ */
+void timer_set_deadline(u64 time_us)
+{
+	u64 now = arch_get_time_us(), delta_us = 0, ticks;
+
+	if (time_us > now) {
+		/* about 71 minutes, a later deadline just causes a recheck */
+		delta_us = time_us - now;
+		if (delta_us > 0xffffffff)
+			delta_us = 0xffffffff;
+	}
+
+	arm_read_sysreg(CNTPCT_EL0, ticks);
+	ticks += div_u64_u32(delta_us * timer_freq, 1000000);
+
+	arm_write_sysreg(CNTHP_CVAL_EL2, ticks);
+	arm_write_sysreg(CNTHP_CTL_EL2, CNTHP_CTL_ENABLE);
+	isb();
+}
+
+void timer_cancel(void)
+{
+	arm_write_sysreg(CNTHP_CTL_EL2, 0);
+	isb();
+}
+
+u64 arch_get_time_us(void)
+{
+	u64 ticks;
+
+	isb();
+	arm_read_sysreg(CNTPCT_EL0, ticks);
+
+	return ticks * timer_us_mult_int +
+		(ticks >> 32) * timer_us_mult_frac +
+		(((ticks & 0xffffffff) * timer_us_mult_frac) >> 32);
+}
@@ -16,6 +16,7 @@
 
 #include <asm/control.h>
 #include <asm/gic_common.h>
+#include <asm/irqchip.h>
 #include <asm/platform.h>
 #include <asm/psci.h>
 #include <asm/traps.h>
@@ -231,6 +232,21 @@ static int arch_handle_hvc(struct per_cpu *cpu_data, struct trap_context *ctx)
 	return TRAP_HANDLED;
 }
 
+static int arch_handle_wfx(struct per_cpu *cpu_data, struct trap_context *ctx)
+{
+	/*
+	 * Only trapped if the cell asked for it. WFE is a hint that the guest
+	 * spins, so simply let it poll again. Masked interrupts would not end
+	 * a WFE in the hypervisor.
+	 */
+	if (!(ctx->esr & ESR_ISS_WFX_WFE))
+		irqchip_wait_for_irq(cpu_data);
+
+	arch_skip_instruction(ctx);
+
+	return TRAP_HANDLED;
+}
+
 static int arch_handle_cp15_32(struct per_cpu *cpu_data, struct trap_context *ctx)
 {
 	u32 opc2	= ctx->esr >> 17 & 0x7;
@@ -287,6 +303,7 @@ static int arch_handle_cp15_64(struct per_cpu *cpu_data, struct trap_context *ct
 
 static const trap_handler trap_handlers[38] =
 {
+	[ESR_EC_WFI]		= arch_handle_wfx,
 	[ESR_EC_CP15_32]	= arch_handle_cp15_32,
 	[ESR_EC_CP15_64]	= arch_handle_cp15_64,
 	[ESR_EC_HVC]		= arch_handle_hvc,
@@ -183,6 +183,27 @@ void apic_send_nmi_ipi(struct per_cpu *target_data)
 			  APIC_ICR_SH_NONE);
 }
 
+/**
+ * apic_send_irq() - Send an interrupt on behalf of the hypervisor
+ * @dest:	Destination APIC ID or logical destination
+ * @logical:	True if @dest is a logical destination
+ * @vector:	Interrupt vector
+ *
+ * The caller has to ensure that @dest only addresses CPUs of the cell that
+ * shall receive the interrupt.
+ */
+void apic_send_irq(u32 dest, bool logical, u8 vector)
+{
+	apic_ops.send_ipi(dest,
+			  APIC_ICR_DLVR_FIXED |
+			  (logical ? APIC_ICR_DEST_LOGICAL :
+				     APIC_ICR_DEST_PHYSICAL) |
+			  APIC_ICR_LV_ASSERT |
+			  APIC_ICR_TM_EDGE |
+			  APIC_ICR_SH_NONE |
+			  vector);
+}
+
 void apic_nmi_handler(struct per_cpu *cpu_data)
 {
 	vmx_schedule_vmexit(cpu_data);
@@ -356,6 +377,63 @@ bool apic_handle_icr_write(struct per_cpu *cpu_data, u32 lo_val, u32 hi_val)
 	return true;
 }
 
+/**
+ * apic_dest_valid() - Check if an interrupt destination only targets a cell
+ * @cell:	Cell the interrupt source is assigned to
+ * @dest:	8-bit destination field of the interrupt message
+ * @logical:	True if @dest is in logical destination mode
+ *
+ * Return: True if all destination CPUs belong to @cell.
+ */
+bool apic_dest_valid(const struct cell *cell, u32 dest, bool logical)
+{
+	unsigned long dest_bits = dest;
+	unsigned int cpu_id;
+
+	if (!logical) {
+		if (dest > APIC_MAX_PHYS_ID)
+			return false;
+		cpu_id = apic_to_cpu_id[dest];
+		return cpu_id != APIC_INVALID_ID &&
+			cpu_id <= cell->cpu_set->max_cpu_id &&
+			test_bit(cpu_id, cell->cpu_set->bitmap);
+	}
+
+	/*
+	 * Only flat logical mode with LDR = 1 << cpu_id is supported, see
+	 * apic_cpu_init. x2APIC logical IDs cannot be expressed in 8 bits.
+	 */
+	if (using_x2apic || dest_bits == 0)
+		return false;
+
+	while (dest_bits != 0) {
+		cpu_id = ffsl(dest_bits);
+		dest_bits &= ~(1UL << cpu_id);
+		if (cpu_id > cell->cpu_set->max_cpu_id ||
+		    !test_bit(cpu_id, cell->cpu_set->bitmap))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * apic_msi_dest_valid() - Check if an MSI address only targets a given cell
+ * @cell:	Cell the message source is assigned to
+ * @msi_addr:	Lower 32 bits of the MSI address
+ *
+ * Return: True if all destination CPUs of the message belong to @cell.
+ */
+bool apic_msi_dest_valid(const struct cell *cell, u32 msi_addr)
+{
+	if ((u32)(msi_addr & APIC_MSI_ADDR_FIXED_MASK) !=
+	    APIC_MSI_ADDR_FIXED_VAL)
+		return false;
+
+	return apic_dest_valid(cell, (msi_addr & APIC_MSI_ADDR_DESTID_MASK) >>
+			       APIC_MSI_ADDR_DESTID_SHIFT,
+			       msi_addr & APIC_MSI_ADDR_DM_LOGICAL);
+}
+
 static bool apic_accessing_reserved_bits(unsigned int reg, u32 val)
 {
 	if ((apic_reserved_bits[reg] & val) == 0)
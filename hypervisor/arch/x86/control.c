@@ -39,26 +39,34 @@ int arch_cell_create(struct per_cpu *cpu_data, struct cell *cell)
 		return err;
 
 	err = vtd_cell_init(cell);
-	if (err)
-		goto error_vmx_exit;
+	if (err) {
+		vmx_cell_exit(cell);
+		return err;
+	}
+
+	cell->comm_page.comm_region.pm_timer_address =
+		system_config->platform_info.x86.pm_timer_address;
+
+	return 0;
+}
+
+/* all root cell CPUs (except cpu_data) have to be stopped */
+int arch_cell_assign_resources(struct per_cpu *cpu_data, struct cell *cell)
+{
+	int err;
+
+	vmx_root_cell_shrink(cell->config);
 
 	err = pci_cell_init(cell);
 	if (err)
-		goto error_vtd_exit;
+		return err;
 
-	ioapic_cell_init(cell);
+	err = ioapic_cell_init(cell);
+	if (err)
+		return err;
 	ioapic_root_cell_shrink(cell->config);
 
-	cell->comm_page.comm_region.pm_timer_address =
-		system_config->platform_info.x86.pm_timer_address;
-
 	return 0;
-
-error_vtd_exit:
-	vtd_cell_exit(cell);
-error_vmx_exit:
-	vmx_cell_exit(cell);
-	return err;
 }
 
 int arch_map_memory_region(struct cell *cell,
@@ -88,10 +96,25 @@ int arch_unmap_memory_region(struct cell *cell,
 	return vmx_unmap_memory_region(cell, mem);
 }
 
-void arch_cell_destroy(struct per_cpu *cpu_data, struct cell *cell)
+/* all root cell CPUs (except cpu_data) have to be stopped */
+void arch_cell_release_resources(struct per_cpu *cpu_data, struct cell *cell)
 {
 	ioapic_cell_exit(cell);
 	pci_cell_exit(cell);
+	vmx_root_cell_restore(cell->config);
+}
+
+void arch_cell_reset_devices(struct cell *cell)
+{
+	pci_reset_devices(cell);
+}
+
+void arch_cell_reset(struct cell *cell)
+{
+}
+
+void arch_cell_destroy(struct per_cpu *cpu_data, struct cell *cell)
+{
 	vtd_cell_exit(cell);
 	vmx_cell_exit(cell);
 }
@@ -110,6 +133,8 @@ void arch_config_commit(struct per_cpu *cpu_data,
 				    cpu_data->cpu_id)
 			per_cpu(cpu)->flush_virt_caches = true;
 
+	pci_config_commit(cell_added_removed);
+
 	vmx_invept();
 
 	vtd_config_commit(cell_added_removed);
@@ -177,6 +202,40 @@ void arch_shutdown_cpu(unsigned int cpu_id)
 	 */
 }
 
+void arch_cell_monitor_kick(unsigned int cpu_id)
+{
+	/* the NMI handler requests a VM exit that runs the check */
+	apic_send_nmi_ipi(per_cpu(cpu_id));
+}
+
+void arch_notify_root_cell(void)
+{
+	if (system_config->state_notify_irq)
+		ioapic_send_root_irq(system_config->state_notify_irq);
+}
+
+/* set by arch_init_early */
+bool monitor_supported;
+
+void arch_monitor_address(const volatile void *addr)
+{
+	if (monitor_supported)
+		asm volatile("monitor" : : "a" (addr), "c" (0), "d" (0));
+}
+
+void arch_wait_for_monitor(void)
+{
+	/*
+	 * Interrupts are masked while we run, but they still terminate MWAIT
+	 * and remain pending for the guest. Waiting is thus bounded by the
+	 * next interrupt of the root cell, e.g. its timer tick.
+	 */
+	if (monitor_supported)
+		asm volatile("mwait" : : "a" (0), "c" (X86_MWAIT_INTR_BREAK));
+	else
+		cpu_relax();
+}
+
 void x86_send_init_sipi(unsigned int cpu_id, enum x86_init_sipi type,
 			int sipi_vector)
 {
@@ -83,13 +83,20 @@
 
 /* Message signaled interrupts (MSI) */
 /* DM: Delivery Mode */
+#define APIC_MSI_DATA_DM_MASK		(0x7 << 8)
+#define APIC_MSI_DATA_DM_FIXED		(0x0 << 8)
+#define APIC_MSI_DATA_DM_LOWPRI		(0x1 << 8)
 #define APIC_MSI_DATA_DM_NMI		(0x4 << 8)
 
+/* DM: Destination Mode */
+#define APIC_MSI_ADDR_DM_LOGICAL	(1 << 2)
+
 /* DESTID: destination ID */
 #define APIC_MSI_ADDR_DESTID_MASK	BIT_MASK(19, 12)
 #define APIC_MSI_ADDR_DESTID_SHIFT	12
 
 /* FIXED: fixed value for interrupt messages */
+#define APIC_MSI_ADDR_FIXED_MASK	BIT_MASK(31, 20)
 #define APIC_MSI_ADDR_FIXED_VAL		(0xfee << 20)
 
 extern bool using_x2apic;
@@ -100,12 +107,16 @@ int apic_cpu_init(struct per_cpu *cpu_data);
 void apic_clear(struct per_cpu *cpu_data);
 
 void apic_send_nmi_ipi(struct per_cpu *target_data);
+void apic_send_irq(u32 dest, bool logical, u8 vector);
 
 void apic_nmi_handler(struct per_cpu *cpu_data);
 void apic_irq_handler(struct per_cpu *cpu_data);
 
 bool apic_handle_icr_write(struct per_cpu *cpu_data, u32 lo_val, u32 hi_val);
 
+bool apic_dest_valid(const struct cell *cell, u32 dest, bool logical);
+bool apic_msi_dest_valid(const struct cell *cell, u32 msi_addr);
+
 unsigned int apic_mmio_access(struct registers *guest_regs,
 			      struct per_cpu *cpu_data, unsigned long rip,
 			      const struct guest_paging_structures *pg_structs,
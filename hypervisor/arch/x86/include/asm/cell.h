@@ -14,16 +14,36 @@
 #define _JAILHOUSE_ASM_CELL_H
 
 #include <jailhouse/paging.h>
+#include <asm/spinlock.h>
 
 #include <jailhouse/cell-config.h>
 #include <jailhouse/hypercall.h>
 
+#define IOAPIC_MAX_CHIPS	8
+/* the MRE field allows for 256 pins, the architecture defines up to 240 */
+#define IOAPIC_MAX_PINS		240
+
 struct pci_device;
 
+/**
+ * struct cell_ioapic - per-cell state of an IOAPIC
+ * @index_reg_val:	virtual index register
+ * @pin_bitmap:		pins owned by the cell
+ */
+struct cell_ioapic {
+	u32 index_reg_val;
+	unsigned long pin_bitmap[(IOAPIC_MAX_PINS + BITS_PER_LONG - 1) /
+				 BITS_PER_LONG];
+};
+
 /**
  * struct cell - cell-related state information
  * ...
+ * @pci_device_hash: open-addressing hash of pci_devices, keyed by segment
+ * 		     and BDF
+ * @pci_device_hash_bits: log2 of the number of hash slots
  * @pci_addr_port_val: virtual address port for PCI config space
+ * @ioapics: per-IOAPIC state, indexed like the root cell's irqchips
  * ...
  */
 /* TODO: factor out arch-independent bits, define struct arch_cell */
@@ -46,14 +66,25 @@ struct cell {
 	struct cpu_set small_cpu_set;
 
 	bool loadable;
+	spinlock_t lock;
+
+	u32 notified_state;
+	u32 heartbeat_seen;
+	u32 heartbeat_missed;
+	u64 heartbeat_deadline;
+
+	/* pristine copy of the loadable regions, see cell_restart */
+	void *snapshot;
+	unsigned int snapshot_pages;
 
 	struct cell *next;
 
 	struct pci_device *pci_devices;
+	struct pci_device **pci_device_hash;
+	unsigned int pci_device_hash_bits;
 	u32 pci_addr_port_val;
 
-	u32 ioapic_index_reg_val;
-	u64 ioapic_pin_bitmap;
+	struct cell_ioapic ioapics[IOAPIC_MAX_CHIPS];
 
 	union {
 		struct jailhouse_comm_region comm_region;
@@ -16,6 +16,8 @@ struct exception_frame;
 
 enum x86_init_sipi { X86_INIT, X86_SIPI };
 
+extern bool monitor_supported;
+
 void x86_send_init_sipi(unsigned int cpu_id, enum x86_init_sipi type,
 			int sipi_vector);
 
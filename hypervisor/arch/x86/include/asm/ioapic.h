@@ -12,20 +12,37 @@
 
 #include <asm/cell.h>
 
-#define IOAPIC_BASE_ADDR	0xfec00000
 #define IOAPIC_REG_INDEX	0x00
 #define IOAPIC_REG_DATA		0x10
 #define IOAPIC_REG_EOI		0x40
 #define IOAPIC_ID		0x00
 #define IOAPIC_VER		0x01
+# define IOAPIC_VER_MRE_MASK	BIT_MASK(23, 16)
+# define IOAPIC_VER_MRE_SHIFT	16
 #define IOAPIC_REDIR_TBL_START	0x10
-#define IOAPIC_REDIR_TBL_END	0x3f
+
+/* redirection entry, low word */
+#define IOAPIC_REDIR_VECTOR_MASK	BIT_MASK(7, 0)
+#define IOAPIC_REDIR_DEL_MODE_MASK	BIT_MASK(10, 8)
+# define IOAPIC_REDIR_DEL_MODE_FIXED	(0 << 8)
+# define IOAPIC_REDIR_DEL_MODE_LOWPRI	(1 << 8)
+#define IOAPIC_REDIR_DEST_LOGICAL	(1 << 11)
+#define IOAPIC_REDIR_DELIV_STATUS	(1 << 12)
+#define IOAPIC_REDIR_REMOTE_IRR		(1 << 14)
+#define IOAPIC_REDIR_STATUS_MASK	(IOAPIC_REDIR_DELIV_STATUS | \
+					 IOAPIC_REDIR_REMOTE_IRR)
+#define IOAPIC_REDIR_LEVEL_TRIGGER	(1 << 15)
+#define IOAPIC_REDIR_MASK		(1 << 16)
+/* redirection entry, high word */
+#define IOAPIC_REDIR_DEST_SHIFT		24
 
 int ioapic_init(void);
 
-void ioapic_cell_init(struct cell *cell);
+int ioapic_cell_init(struct cell *cell);
 void ioapic_root_cell_shrink(struct jailhouse_cell_desc *config);
 void ioapic_cell_exit(struct cell *cell);
 
+void ioapic_send_root_irq(unsigned int pin);
+
 int ioapic_access_handler(struct cell *cell, bool is_write, u64 addr,
 			  u32 *value);
@@ -15,12 +15,20 @@
 
 #include <asm/types.h>
 
+#define X86_FEATURE_MONITOR				(1 << 3)
 #define X86_FEATURE_VMX					(1 << 5)
 #define X86_FEATURE_GBPAGES				(1 << 26)
 #define X86_FEATURE_RDTSCP				(1 << 27)
 
+/* CPUID leaf 5 (MONITOR/MWAIT), ECX */
+#define X86_MWAIT_EXTENSIONS				(1 << 0)
+#define X86_MWAIT_INTR_BREAK_SUPPORTED			(1 << 1)
+
 #define X86_RFLAGS_VM					(1 << 17)
 
+/* MWAIT extension: wake up on interrupts even if they are masked */
+#define X86_MWAIT_INTR_BREAK				(1 << 0)
+
 #define X86_CR0_PE					0x00000001
 #define X86_CR0_ET					0x00000010
 #define X86_CR0_NW					0x20000000
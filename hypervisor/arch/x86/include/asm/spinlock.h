@@ -28,6 +28,11 @@ static inline void spin_lock(spinlock_t *lock)
 		cpu_relax();
 }
 
+static inline bool spin_trylock(spinlock_t *lock)
+{
+	return !test_and_set_bit(0, &lock->state);
+}
+
 static inline void spin_unlock(spinlock_t *lock)
 {
 	asm volatile("" : : : "memory");
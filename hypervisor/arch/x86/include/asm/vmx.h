@@ -202,10 +202,12 @@ enum vmcs_field {
 #define VM_EXIT_HOST_ADDR_SPACE_SIZE		0x00000200
 #define VM_EXIT_SAVE_IA32_EFER			0x00100000
 #define VM_EXIT_LOAD_IA32_EFER			0x00200000
+#define VM_EXIT_SAVE_VMX_PREEMPTION_TIMER	0x00400000
 
 #define VM_ENTRY_IA32E_MODE			0x00000200
 #define VM_ENTRY_LOAD_IA32_EFER			0x00008000
 
+#define VMX_MISC_PREEMPTION_TIMER_RATE		0x0000001f
 #define VMX_MISC_ACTIVITY_HLT			0x00000040
 
 #define INTR_INFO_UNBLOCK_NMI			0x1000
@@ -290,6 +292,8 @@ enum vmcs_field {
 int vmx_init(void);
 
 int vmx_cell_init(struct cell *cell);
+void vmx_root_cell_shrink(struct jailhouse_cell_desc *config);
+void vmx_root_cell_restore(struct jailhouse_cell_desc *config);
 int vmx_map_memory_region(struct cell *cell,
 			  const struct jailhouse_memory *mem);
 int vmx_unmap_memory_region(struct cell *cell,
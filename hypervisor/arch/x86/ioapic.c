@@ -12,77 +12,348 @@
 
 #include <jailhouse/mmio.h>
 #include <jailhouse/printk.h>
+#include <jailhouse/string.h>
+#include <jailhouse/utils.h>
+#include <asm/apic.h>
+#include <asm/bitops.h>
 #include <asm/ioapic.h>
 #include <asm/spinlock.h>
 
 #include <jailhouse/cell-config.h>
 
-static DEFINE_SPINLOCK(ioapic_lock);
-static void *ioapic;
+/**
+ * struct phys_ioapic - Hypervisor state of a physical IOAPIC
+ * @base_addr:	Physical MMIO base address
+ * @reg_base:	Hypervisor mapping of the registers
+ * @pins:	Number of redirection entries, at most IOAPIC_MAX_PINS
+ * @lock:	Serializes hardware accesses and updates of the shadow state
+ * @id:		Shadow of the ID register
+ * @version:	Shadow of the version register
+ * @shadow_redir_table:	Shadow of the redirection table, two words per pin
+ *
+ * Writers of the shadow state hold @lock, readers access the 32-bit words
+ * without locking.
+ */
+struct phys_ioapic {
+	u64 base_addr;
+	void *reg_base;
+	unsigned int pins;
+	spinlock_t lock;
+	u32 id;
+	u32 version;
+	u32 shadow_redir_table[IOAPIC_MAX_PINS * 2];
+};
 
-int ioapic_init(void)
+static struct phys_ioapic phys_ioapics[IOAPIC_MAX_CHIPS];
+static unsigned int num_phys_ioapics;
+
+/* caller holds ioapic->lock */
+static u32 ioapic_reg_read(struct phys_ioapic *ioapic, unsigned int reg)
+{
+	mmio_write32(ioapic->reg_base + IOAPIC_REG_INDEX, reg);
+	return mmio_read32(ioapic->reg_base + IOAPIC_REG_DATA);
+}
+
+/* caller holds ioapic->lock */
+static void ioapic_reg_write(struct phys_ioapic *ioapic, unsigned int reg,
+			     u32 value)
+{
+	mmio_write32(ioapic->reg_base + IOAPIC_REG_INDEX, reg);
+	mmio_write32(ioapic->reg_base + IOAPIC_REG_DATA, value);
+}
+
+/*
+ * Returns the pin described by bit n of a configuration entry, or -1 if the
+ * bit is clear or beyond the pins of the IOAPIC.
+ */
+static int ioapic_config_pin(const struct phys_ioapic *ioapic,
+			     const struct jailhouse_irqchip *irqchip,
+			     unsigned int n)
 {
+	unsigned int pin = irqchip->pin_base + n;
+
+	if (!(irqchip->pin_bitmap & (1ULL << n)) || pin >= ioapic->pins)
+		return -1;
+	return pin;
+}
+
+static void ioapic_mask_pins(struct phys_ioapic *ioapic,
+			     const struct jailhouse_irqchip *irqchip)
+{
+	u32 *entry_lo;
+	unsigned int n;
+	int pin;
+
+	spin_lock(&ioapic->lock);
+	for (n = 0; n < 64; n++) {
+		pin = ioapic_config_pin(ioapic, irqchip, n);
+		if (pin < 0)
+			continue;
+		entry_lo = &ioapic->shadow_redir_table[pin * 2];
+		if (*entry_lo & IOAPIC_REDIR_MASK)
+			continue;
+		*entry_lo |= IOAPIC_REDIR_MASK;
+		ioapic_reg_write(ioapic, IOAPIC_REDIR_TBL_START + pin * 2,
+				 *entry_lo);
+	}
+	spin_unlock(&ioapic->lock);
+}
+
+static struct phys_ioapic *ioapic_get_phys(u64 base_addr)
+{
+	unsigned int n;
+
+	for (n = 0; n < num_phys_ioapics; n++)
+		if (phys_ioapics[n].base_addr == base_addr)
+			return &phys_ioapics[n];
+	return NULL;
+}
+
+static int ioapic_phys_init(struct phys_ioapic *ioapic, u64 base_addr)
+{
+	unsigned int n;
 	int err;
 
-	ioapic = page_alloc(&remap_pool, 1);
-	if (!ioapic)
+	ioapic->reg_base = page_alloc(&remap_pool, 1);
+	if (!ioapic->reg_base)
 		return -ENOMEM;
-	err = page_map_create(&hv_paging_structs, IOAPIC_BASE_ADDR, PAGE_SIZE,
-			      (unsigned long)ioapic,
+	err = page_map_create(&hv_paging_structs, base_addr, PAGE_SIZE,
+			      (unsigned long)ioapic->reg_base,
 			      PAGE_DEFAULT_FLAGS | PAGE_FLAG_UNCACHED,
 			      PAGE_MAP_NON_COHERENT);
 	if (err)
 		return err;
 
-	ioapic_cell_init(&root_cell);
+	ioapic->base_addr = base_addr;
+
+	ioapic->id = ioapic_reg_read(ioapic, IOAPIC_ID);
+	ioapic->version = ioapic_reg_read(ioapic, IOAPIC_VER);
+	ioapic->pins = ((ioapic->version & IOAPIC_VER_MRE_MASK) >>
+			IOAPIC_VER_MRE_SHIFT) + 1;
+	if (ioapic->pins > IOAPIC_MAX_PINS) {
+		printk("ERROR: IOAPIC @%p reports %d pins, only %d supported\n",
+		       base_addr, ioapic->pins, IOAPIC_MAX_PINS);
+		return -EIO;
+	}
+
+	for (n = 0; n < ioapic->pins * 2; n++)
+		ioapic->shadow_redir_table[n] =
+			ioapic_reg_read(ioapic, IOAPIC_REDIR_TBL_START + n) &
+			~((n % 2) ? 0 : IOAPIC_REDIR_STATUS_MASK);
+
+	printk("Found IOAPIC @%p, %d pins\n", base_addr, ioapic->pins);
 
 	return 0;
 }
 
-static const struct jailhouse_irqchip *
-ioapic_find_config(struct jailhouse_cell_desc *config)
+/**
+ * ioapic_init() - Initialize IOAPICs listed in the root cell configuration
+ *
+ * An IOAPIC with more than 64 pins is listed once per 64 pins, each entry
+ * with its own pin_base.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+int ioapic_init(void)
 {
 	const struct jailhouse_irqchip *irqchip =
-		jailhouse_cell_irqchips(config);
+		jailhouse_cell_irqchips(root_cell.config);
 	unsigned int n;
+	int err;
 
-	for (n = 0; n < config->num_irqchips; n++, irqchip++)
-		if (irqchip->address == IOAPIC_BASE_ADDR)
-			return irqchip;
-	return NULL;
+	for (n = 0; n < root_cell.config->num_irqchips; n++, irqchip++) {
+		if (ioapic_get_phys(irqchip->address))
+			continue;
+		if (num_phys_ioapics == IOAPIC_MAX_CHIPS)
+			return -ERANGE;
+		err = ioapic_phys_init(&phys_ioapics[num_phys_ioapics],
+				       irqchip->address);
+		if (err)
+			return err;
+		num_phys_ioapics++;
+	}
+
+	return ioapic_cell_init(&root_cell);
 }
 
-void ioapic_cell_init(struct cell *cell)
+/**
+ * ioapic_cell_init() - Apply IOAPIC pin assignment of a cell
+ * @cell:	Cell to be initialized
+ *
+ * Pins handed over to a non-root cell are masked.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+int ioapic_cell_init(struct cell *cell)
 {
 	const struct jailhouse_irqchip *irqchip =
-		ioapic_find_config(cell->config);
+		jailhouse_cell_irqchips(cell->config);
+	struct cell_ioapic *cell_ioapic;
+	struct phys_ioapic *ioapic;
+	unsigned int n, bit;
+	int pin;
 
-	if (irqchip)
-		cell->ioapic_pin_bitmap = irqchip->pin_bitmap;
+	for (n = 0; n < IOAPIC_MAX_CHIPS; n++)
+		memset(cell->ioapics[n].pin_bitmap, 0,
+		       sizeof(cell->ioapics[n].pin_bitmap));
+
+	for (n = 0; n < cell->config->num_irqchips; n++, irqchip++) {
+		ioapic = ioapic_get_phys(irqchip->address);
+		if (!ioapic)
+			return -EINVAL;
+
+		cell_ioapic = &cell->ioapics[ioapic - phys_ioapics];
+		for (bit = 0; bit < 64; bit++) {
+			pin = ioapic_config_pin(ioapic, irqchip, bit);
+			if (pin >= 0)
+				set_bit(pin, cell_ioapic->pin_bitmap);
+		}
+
+		/* the new owner has to program its pins before using them */
+		if (cell != &root_cell)
+			ioapic_mask_pins(ioapic, irqchip);
+	}
+
+	return 0;
 }
 
 void ioapic_root_cell_shrink(struct jailhouse_cell_desc *config)
 {
-	const struct jailhouse_irqchip *irqchip = ioapic_find_config(config);
+	const struct jailhouse_irqchip *irqchip =
+		jailhouse_cell_irqchips(config);
+	struct phys_ioapic *ioapic;
+	unsigned long *root_pins;
+	unsigned int n, bit;
+	int pin;
 
-	if (irqchip)
-		root_cell.ioapic_pin_bitmap &= ~irqchip->pin_bitmap;
+	for (n = 0; n < config->num_irqchips; n++, irqchip++) {
+		ioapic = ioapic_get_phys(irqchip->address);
+		if (!ioapic)
+			continue;
+		root_pins = root_cell.ioapics[ioapic - phys_ioapics].pin_bitmap;
+		for (bit = 0; bit < 64; bit++) {
+			pin = ioapic_config_pin(ioapic, irqchip, bit);
+			if (pin >= 0)
+				clear_bit(pin, root_pins);
+		}
+	}
 }
 
 void ioapic_cell_exit(struct cell *cell)
 {
-	const struct jailhouse_irqchip *cell_irqchip =
-		ioapic_find_config(cell->config);
 	const struct jailhouse_irqchip *root_irqchip =
-		ioapic_find_config(root_cell.config);
+		jailhouse_cell_irqchips(root_cell.config);
+	unsigned long *cell_pins, *root_pins;
+	struct phys_ioapic *ioapic;
+	unsigned int n, bit;
+	int pin;
+
+	/* return the pins the root cell owned according to its config */
+	for (n = 0; n < root_cell.config->num_irqchips; n++, root_irqchip++) {
+		ioapic = ioapic_get_phys(root_irqchip->address);
+		cell_pins = cell->ioapics[ioapic - phys_ioapics].pin_bitmap;
+		root_pins = root_cell.ioapics[ioapic - phys_ioapics].pin_bitmap;
+		for (bit = 0; bit < 64; bit++) {
+			pin = ioapic_config_pin(ioapic, root_irqchip, bit);
+			if (pin >= 0 && test_bit(pin, cell_pins))
+				set_bit(pin, root_pins);
+		}
+	}
+}
+
+/**
+ * ioapic_send_root_irq() - Raise an IOAPIC pin of the root cell
+ * @pin:	Pin of the first IOAPIC
+ *
+ * The interrupt is sent as edge-triggered message according to the
+ * redirection entry programmed by the root cell. Nothing is sent while the
+ * pin is masked or not owned by the root cell.
+ */
+void ioapic_send_root_irq(unsigned int pin)
+{
+	struct phys_ioapic *ioapic = &phys_ioapics[0];
+	u32 entry_lo, entry_hi;
+
+	if (num_phys_ioapics == 0 || pin >= ioapic->pins ||
+	    !test_bit(pin, root_cell.ioapics[0].pin_bitmap))
+		return;
+
+	entry_lo = ioapic->shadow_redir_table[pin * 2];
+	entry_hi = ioapic->shadow_redir_table[pin * 2 + 1];
+	if (entry_lo & IOAPIC_REDIR_MASK)
+		return;
+
+	apic_send_irq(entry_hi >> IOAPIC_REDIR_DEST_SHIFT,
+		      entry_lo & IOAPIC_REDIR_DEST_LOGICAL,
+		      entry_lo & IOAPIC_REDIR_VECTOR_MASK);
+}
+
+static bool ioapic_redir_valid(const struct cell *cell, const u32 *entry)
+{
+	switch (entry[0] & IOAPIC_REDIR_DEL_MODE_MASK) {
+	case IOAPIC_REDIR_DEL_MODE_FIXED:
+	case IOAPIC_REDIR_DEL_MODE_LOWPRI:
+		break;
+	default:
+		return false;
+	}
 
-	if (cell_irqchip && root_irqchip)
-		root_cell.ioapic_pin_bitmap |= cell_irqchip->pin_bitmap &
-			root_irqchip->pin_bitmap;
+	return apic_dest_valid(cell, entry[1] >> IOAPIC_REDIR_DEST_SHIFT,
+			       entry[0] & IOAPIC_REDIR_DEST_LOGICAL);
+}
+
+static u32 ioapic_redir_read(struct phys_ioapic *ioapic, unsigned int index)
+{
+	unsigned int n = index - IOAPIC_REDIR_TBL_START;
+	u32 value = ioapic->shadow_redir_table[n];
+
+	/*
+	 * The remote IRR of level-triggered pins is maintained by the
+	 * hardware and polled by guests, so it cannot be shadowed. The
+	 * delivery status is reported as idle.
+	 */
+	if (n % 2 == 0 && value & IOAPIC_REDIR_LEVEL_TRIGGER) {
+		spin_lock(&ioapic->lock);
+		value |= ioapic_reg_read(ioapic, index) &
+			IOAPIC_REDIR_REMOTE_IRR;
+		spin_unlock(&ioapic->lock);
+	}
+	return value;
+}
+
+static bool ioapic_redir_write(struct cell *cell, struct phys_ioapic *ioapic,
+			       unsigned int index, u32 value)
+{
+	unsigned int n = index - IOAPIC_REDIR_TBL_START;
+	u32 entry[2];
+
+	if (n % 2 == 0)
+		value &= ~IOAPIC_REDIR_STATUS_MASK;
+
+	spin_lock(&ioapic->lock);
+
+	entry[0] = ioapic->shadow_redir_table[n & ~1];
+	entry[1] = ioapic->shadow_redir_table[n | 1];
+	entry[n % 2] = value;
+
+	/* masked entries may hold anything, they are checked on unmask */
+	if (!(entry[0] & IOAPIC_REDIR_MASK) &&
+	    !ioapic_redir_valid(cell, entry)) {
+		spin_unlock(&ioapic->lock);
+		return false;
+	}
+
+	if (value != ioapic->shadow_redir_table[n]) {
+		ioapic_reg_write(ioapic, index, value);
+		ioapic->shadow_redir_table[n] = value;
+	}
+
+	spin_unlock(&ioapic->lock);
+	return true;
 }
 
 /**
- * x86_ioapic_handler() - Handler for accesses to IOAPIC
+ * ioapic_access_handler() - Handler for accesses to IOAPIC
  * @cell:	Request issuing cell
  * @is_write:	True if write access
  * @addr:	Address accessed
@@ -93,50 +364,56 @@ void ioapic_cell_exit(struct cell *cell)
 int ioapic_access_handler(struct cell *cell, bool is_write, u64 addr,
 			  u32 *value)
 {
-	u32 index, entry;
+	struct phys_ioapic *ioapic = ioapic_get_phys(addr & PAGE_MASK);
+	struct cell_ioapic *cell_ioapic;
+	u32 index, pin;
 
-	if (addr < IOAPIC_BASE_ADDR || addr >= IOAPIC_BASE_ADDR + PAGE_SIZE)
+	if (!ioapic)
 		return 0;
 
-	switch (addr - IOAPIC_BASE_ADDR) {
+	cell_ioapic = &cell->ioapics[ioapic - phys_ioapics];
+
+	switch (addr - ioapic->base_addr) {
 	case IOAPIC_REG_INDEX:
 		if (is_write)
-			cell->ioapic_index_reg_val = *value;
+			cell_ioapic->index_reg_val = *value;
 		else
-			*value = cell->ioapic_index_reg_val;
+			*value = cell_ioapic->index_reg_val;
 		return 1;
 	case IOAPIC_REG_DATA:
-		index = cell->ioapic_index_reg_val;
-		if (index >= IOAPIC_REDIR_TBL_START &&
-		    index <= IOAPIC_REDIR_TBL_END) {
-			entry = (index - IOAPIC_REDIR_TBL_START) / 2;
-			/* Note: we only support one IOAPIC per system */
-			if ((cell->ioapic_pin_bitmap & (1UL << entry)) == 0)
+		index = cell_ioapic->index_reg_val;
+		if (index == IOAPIC_ID || index == IOAPIC_VER) {
+			if (is_write)
 				goto invalid_access;
-			// TODO validate written value, virtualize
-		} else if ((index != IOAPIC_ID && index != IOAPIC_VER) ||
-			   is_write)
+			*value = index == IOAPIC_ID ? ioapic->id :
+				ioapic->version;
+			return 1;
+		}
+		if (index < IOAPIC_REDIR_TBL_START ||
+		    index >= IOAPIC_REDIR_TBL_START + ioapic->pins * 2)
 			goto invalid_access;
 
-		spin_lock(&ioapic_lock);
-		mmio_write32(ioapic + IOAPIC_REG_INDEX, index);
-		if (is_write)
-			mmio_write32(ioapic + IOAPIC_REG_DATA, *value);
-		else
-			*value = mmio_read32(ioapic + IOAPIC_REG_DATA);
-		spin_unlock(&ioapic_lock);
+		pin = (index - IOAPIC_REDIR_TBL_START) / 2;
+		if (!test_bit(pin, cell_ioapic->pin_bitmap))
+			goto invalid_access;
+
+		if (!is_write)
+			*value = ioapic_redir_read(ioapic, index);
+		else if (!ioapic_redir_write(cell, ioapic, index, *value))
+			goto invalid_access;
 		return 1;
 	case IOAPIC_REG_EOI:
 		if (!is_write)
 			goto invalid_access;
 		// TODO: virtualize
-		mmio_write32(ioapic + IOAPIC_REG_EOI, *value);
+		mmio_write32(ioapic->reg_base + IOAPIC_REG_EOI, *value);
 		return 1;
 	}
 
 invalid_access:
-	panic_printk("FATAL: Invalid IOAPIC %s, reg: %x, index: %x\n",
-		     is_write ? "write" : "read", addr - IOAPIC_BASE_ADDR,
-		     cell->ioapic_index_reg_val);
+	panic_printk("FATAL: Invalid IOAPIC %s, IOAPIC: %p, reg: %x, "
+		     "index: %x\n", is_write ? "write" : "read",
+		     ioapic->base_addr, addr - ioapic->base_addr,
+		     cell_ioapic->index_reg_val);
 	return -1;
 }
@@ -14,6 +14,7 @@
 #include <jailhouse/pci.h>
 #include <jailhouse/printk.h>
 #include <jailhouse/utils.h>
+#include <asm/apic.h>
 #include <asm/io.h>
 #include <asm/pci.h>
 #include <asm/vtd.h>
@@ -198,7 +199,8 @@ int x86_pci_config_handler(struct registers *guest_regs, struct cell *cell,
 		addr_port_val = cell->pci_addr_port_val;
 
 		bdf = addr_port_val >> PCI_ADDR_BDF_SHIFT;
-		device = pci_get_assigned_device(cell, bdf);
+		/* port-based config space access only reaches segment 0 */
+		device = pci_get_assigned_device(cell, 0, bdf);
 
 		address = (addr_port_val & PCI_ADDR_REGNUM_MASK) +
 			port - PCI_REG_DATA_PORT;
@@ -223,3 +225,28 @@ void arch_pci_remove_device(struct pci_device *device)
 {
 	vtd_remove_pci_device(device);
 }
+
+/**
+ * arch_pci_msi_valid() - Check if an MSI message may be issued by a cell
+ * @cell:	Cell owning the message source
+ * @address:	MSI address
+ * @data:	MSI data
+ *
+ * Return: True if the message is a regular interrupt that only targets CPUs
+ * of @cell.
+ */
+bool arch_pci_msi_valid(const struct cell *cell, u64 address, u32 data)
+{
+	switch (data & APIC_MSI_DATA_DM_MASK) {
+	case APIC_MSI_DATA_DM_FIXED:
+	case APIC_MSI_DATA_DM_LOWPRI:
+		break;
+	default:
+		return false;
+	}
+
+	if (address >> 32)
+		return false;
+
+	return apic_msi_dest_valid(cell, address);
+}
@@ -16,7 +16,9 @@
 #include <jailhouse/processor.h>
 #include <asm/apic.h>
 #include <asm/bitops.h>
+#include <asm/control.h>
 #include <asm/ioapic.h>
+#include <asm/tsc.h>
 #include <asm/vmx.h>
 #include <asm/vtd.h>
 
@@ -55,15 +57,25 @@ static void set_idt_int_gate(unsigned int vector, unsigned long entry)
 int arch_init_early(void)
 {
 	unsigned long entry;
-	unsigned int vector;
+	unsigned int vector, mwait_ext;
 	int err;
 
 	cache_line_size = (cpuid_ebx(1) & 0xff00) >> 5;
+	/* MWAIT raises #GP if the interrupt break extension is missing */
+	if ((cpuid_ecx(1) & X86_FEATURE_MONITOR) && cpuid_eax(0) >= 5) {
+		mwait_ext = cpuid_ecx(5);
+		monitor_supported = (mwait_ext & X86_MWAIT_EXTENSIONS) &&
+			(mwait_ext & X86_MWAIT_INTR_BREAK_SUPPORTED);
+	}
 
 	err = apic_init();
 	if (err)
 		return err;
 
+	err = tsc_init();
+	if (err)
+		return err;
+
 	entry = (unsigned long)exception_entries;
 	for (vector = 0; vector < NUM_EXCP_DESC; vector++) {
 		if (vector == NMI_VECTOR || vector == 15)
@@ -0,0 +1,65 @@
+/*
+ * Jailhouse, a Linux-based partitioning hypervisor
+ *
+ * Copyright (c) Siemens AG, 2014
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <jailhouse/control.h>
+#include <jailhouse/printk.h>
+#include <jailhouse/processor.h>
+#include <asm/io.h>
+#include <asm/tsc.h>
+
+#define PM_TIMER_HZ		3579545
+/* only 24 bits are guaranteed, extended timers are masked accordingly */
+#define PM_TIMER_MASK		0xffffff
+
+#define TSC_CALIBRATION_MS	10
+
+unsigned long tsc_khz;
+
+static u32 pm_timer_read(u16 pm_timer_addr)
+{
+	return inl(pm_timer_addr) & PM_TIMER_MASK;
+}
+
+/**
+ * tsc_init() - Calibrate the TSC against the ACPI PM timer
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+int tsc_init(void)
+{
+	u16 pm_timer_addr = system_config->platform_info.x86.pm_timer_address;
+	u32 pm_start, pm_ticks;
+	u64 tsc_start;
+
+	if (pm_timer_addr == 0)
+		return -EINVAL;
+
+	pm_start = pm_timer_read(pm_timer_addr);
+	tsc_start = read_tsc();
+	do {
+		pm_ticks = (pm_timer_read(pm_timer_addr) - pm_start) &
+			PM_TIMER_MASK;
+	} while (pm_ticks < PM_TIMER_HZ / 1000 * TSC_CALIBRATION_MS);
+
+	tsc_khz = (read_tsc() - tsc_start) * (PM_TIMER_HZ / 1000) / pm_ticks;
+	if (tsc_khz == 0)
+		return -EIO;
+
+	printk("TSC frequency: %ld kHz\n", tsc_khz);
+
+	return 0;
+}
+
+u64 arch_get_time_us(void)
+{
+	u64 tsc = read_tsc();
+
+	/* split to avoid overflowing the multiplication */
+	return tsc / tsc_khz * 1000 + tsc % tsc_khz * 1000 / tsc_khz;
+}
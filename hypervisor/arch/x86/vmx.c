@@ -24,6 +24,7 @@
 #include <asm/io.h>
 #include <asm/ioapic.h>
 #include <asm/pci.h>
+#include <asm/tsc.h>
 #include <asm/vmx.h>
 #include <asm/vtd.h>
 
@@ -66,6 +67,7 @@ static u8 __attribute__((aligned(PAGE_SIZE))) msr_bitmap[][0x2000/8] = {
 static u8 __attribute__((aligned(PAGE_SIZE))) apic_access_page[PAGE_SIZE];
 static struct paging ept_paging[EPT_PAGE_DIR_LEVELS];
 static u32 enable_rdtscp;
+static unsigned int preemption_timer_shift;
 
 static bool vmxon(struct per_cpu *cpu_data)
 {
@@ -158,7 +160,7 @@ static bool vmcs_write32(unsigned long field, u32 value)
 static int vmx_check_features(void)
 {
 	unsigned long vmx_proc_ctrl, vmx_proc_ctrl2, ept_cap;
-	unsigned long vmx_pin_ctrl, vmx_basic;
+	unsigned long vmx_pin_ctrl, vmx_exit_ctrl, vmx_basic;
 
 	if (!(cpuid_ecx(1) & X86_FEATURE_VMX))
 		return -ENODEV;
@@ -179,6 +181,11 @@ static int vmx_check_features(void)
 	    !(vmx_pin_ctrl & PIN_BASED_VMX_PREEMPTION_TIMER))
 		return -EIO;
 
+	/* require saving of the preemption timer, it may run across exits */
+	vmx_exit_ctrl = read_msr(MSR_IA32_VMX_EXIT_CTLS) >> 32;
+	if (!(vmx_exit_ctrl & VM_EXIT_SAVE_VMX_PREEMPTION_TIMER))
+		return -EIO;
+
 	/* require I/O and MSR bitmap as well as secondary controls support */
 	vmx_proc_ctrl = read_msr(MSR_IA32_VMX_PROCBASED_CTLS) >> 32;
 	if (!(vmx_proc_ctrl & CPU_BASED_USE_IO_BITMAPS) ||
@@ -240,6 +247,10 @@ int vmx_init(void)
 	if (!(read_msr(MSR_IA32_VMX_EPT_VPID_CAP) & EPT_2M_PAGES))
 		ept_paging[2].page_size = 0;
 
+	/* the preemption timer ticks at the TSC rate divided by 2^shift */
+	preemption_timer_shift = read_msr(MSR_IA32_VMX_MISC) &
+		VMX_MISC_PREEMPTION_TIMER_RATE;
+
 	if (using_x2apic) {
 		/* allow direct x2APIC access except for ICR writes */
 		memset(&msr_bitmap[VMX_MSR_BMP_0000_READ][MSR_X2APIC_BASE/8],
@@ -297,18 +308,6 @@ int vmx_cell_init(struct cell *cell)
 		pio_bitmap_size -= size;
 	}
 
-	if (cell != &root_cell) {
-		/*
-		 * Shrink PIO access of root cell corresponding to new cell's
-		 * access rights.
-		 */
-		pio_bitmap = jailhouse_cell_pio_bitmap(cell->config);
-		pio_bitmap_size = cell->config->pio_bitmap_size;
-		for (b = root_cell.vmx.io_bitmap; pio_bitmap_size > 0;
-		     b++, pio_bitmap++, pio_bitmap_size--)
-			*b |= ~*pio_bitmap;
-	}
-
 	/* permit access to the PM timer */
 	pm_timer_addr = system_config->platform_info.x86.pm_timer_address;
 	for (n = 0; n < 4; n++, pm_timer_addr++) {
@@ -319,6 +318,39 @@ int vmx_cell_init(struct cell *cell)
 	return 0;
 }
 
+/* root cell CPUs have to be stopped */
+void vmx_root_cell_shrink(struct jailhouse_cell_desc *config)
+{
+	const u8 *pio_bitmap = jailhouse_cell_pio_bitmap(config);
+	u32 pio_bitmap_size = config->pio_bitmap_size;
+	u8 *b;
+
+	/*
+	 * Shrink PIO access of root cell corresponding to new cell's access
+	 * rights.
+	 */
+	for (b = root_cell.vmx.io_bitmap; pio_bitmap_size > 0;
+	     b++, pio_bitmap++, pio_bitmap_size--)
+		*b |= ~*pio_bitmap;
+}
+
+/* root cell CPUs have to be stopped */
+void vmx_root_cell_restore(struct jailhouse_cell_desc *config)
+{
+	const u8 *root_pio_bitmap =
+		jailhouse_cell_pio_bitmap(root_cell.config);
+	const u8 *pio_bitmap = jailhouse_cell_pio_bitmap(config);
+	u32 pio_bitmap_size = config->pio_bitmap_size;
+	u8 *b;
+
+	if (root_cell.config->pio_bitmap_size < pio_bitmap_size)
+		pio_bitmap_size = root_cell.config->pio_bitmap_size;
+
+	for (b = root_cell.vmx.io_bitmap; pio_bitmap_size > 0;
+	     b++, pio_bitmap++, root_pio_bitmap++, pio_bitmap_size--)
+		*b &= *pio_bitmap | *root_pio_bitmap;
+}
+
 int vmx_map_memory_region(struct cell *cell,
 			  const struct jailhouse_memory *mem)
 {
@@ -347,22 +379,9 @@ int vmx_unmap_memory_region(struct cell *cell,
 
 void vmx_cell_exit(struct cell *cell)
 {
-	const u8 *root_pio_bitmap =
-		jailhouse_cell_pio_bitmap(root_cell.config);
-	const u8 *pio_bitmap = jailhouse_cell_pio_bitmap(cell->config);
-	u32 pio_bitmap_size = cell->config->pio_bitmap_size;
-	u8 *b;
-
 	page_map_destroy(&cell->vmx.ept_structs, XAPIC_BASE, PAGE_SIZE,
 			 PAGE_MAP_NON_COHERENT);
 
-	if (root_cell.config->pio_bitmap_size < pio_bitmap_size)
-		pio_bitmap_size = root_cell.config->pio_bitmap_size;
-
-	for (b = root_cell.vmx.io_bitmap; pio_bitmap_size > 0;
-	     b++, pio_bitmap++, root_pio_bitmap++, pio_bitmap_size--)
-		*b &= *pio_bitmap | *root_pio_bitmap;
-
 	page_free(&mem_pool, cell->vmx.ept_structs.root_table, 1);
 }
 
@@ -566,7 +585,7 @@ static bool vmcs_setup(struct per_cpu *cpu_data)
 
 	val = read_msr(MSR_IA32_VMX_EXIT_CTLS);
 	val |= VM_EXIT_HOST_ADDR_SPACE_SIZE | VM_EXIT_SAVE_IA32_EFER |
-		VM_EXIT_LOAD_IA32_EFER;
+		VM_EXIT_LOAD_IA32_EFER | VM_EXIT_SAVE_VMX_PREEMPTION_TIMER;
 	ok &= vmcs_write32(VM_EXIT_CONTROLS, val);
 
 	ok &= vmcs_write32(VM_EXIT_MSR_STORE_COUNT, 0);
@@ -832,6 +851,9 @@ void vmx_schedule_vmexit(struct per_cpu *cpu_data)
 	if (cpu_data->vmx_state != VMCS_READY)
 		return;
 
+	/* the timer may still be armed for cell monitoring */
+	vmcs_write32(VMX_PREEMPTION_TIMER_VALUE, 0);
+
 	pin_based_ctrl = vmcs_read32(PIN_BASED_VM_EXEC_CONTROL);
 	pin_based_ctrl |= PIN_BASED_VMX_PREEMPTION_TIMER;
 	vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, pin_based_ctrl);
@@ -851,6 +873,38 @@ static void vmx_disable_preemption_timer(void)
 	vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, pin_based_ctrl);
 }
 
+static void vmx_arm_monitor_timer(u64 deadline)
+{
+	u32 pin_based_ctrl = vmcs_read32(PIN_BASED_VM_EXEC_CONTROL);
+	u64 now = arch_get_time_us(), ticks = 0;
+
+	/* an exit requested or armed meanwhile takes precedence */
+	if (pin_based_ctrl & PIN_BASED_VMX_PREEMPTION_TIMER)
+		return;
+
+	if (deadline > now) {
+		/* about 71 minutes, a later deadline just causes a recheck */
+		if (deadline - now > 0xffffffff)
+			deadline = now + 0xffffffff;
+		ticks = ((deadline - now) * tsc_khz / 1000) >>
+			preemption_timer_shift;
+		if (ticks > 0xffffffff)
+			ticks = 0xffffffff;
+	}
+
+	vmcs_write32(VMX_PREEMPTION_TIMER_VALUE, ticks);
+	pin_based_ctrl |= PIN_BASED_VMX_PREEMPTION_TIMER;
+	vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, pin_based_ctrl);
+}
+
+static void vmx_check_cell_monitor(struct per_cpu *cpu_data)
+{
+	u64 deadline = cell_monitor_check(cpu_data);
+
+	if (deadline)
+		vmx_arm_monitor_timer(deadline);
+}
+
 static void vmx_skip_emulated_instruction(unsigned int inst_len)
 {
 	vmcs_write64(GUEST_RIP, vmcs_read64(GUEST_RIP) + inst_len);
@@ -1104,6 +1158,7 @@ void vmx_handle_exit(struct registers *guest_regs, struct per_cpu *cpu_data)
 	case EXIT_REASON_PREEMPTION_TIMER:
 		cpu_data->stats[JAILHOUSE_CPU_STAT_VMEXITS_MANAGEMENT]++;
 		vmx_disable_preemption_timer();
+		vmx_check_cell_monitor(cpu_data);
 		sipi_vector = x86_handle_events(cpu_data);
 		if (sipi_vector >= 0) {
 			printk("CPU %d received SIPI, vector %x\n",
@@ -10,6 +10,7 @@
  * the COPYING file in the top-level directory.
  */
 
+#include <jailhouse/control.h>
 #include <jailhouse/mmio.h>
 #include <jailhouse/paging.h>
 #include <jailhouse/pci.h>
@@ -19,9 +20,19 @@
 #include <asm/apic.h>
 #include <asm/bitops.h>
 
-/* TODO: Support multiple segments */
-static struct vtd_entry __attribute__((aligned(PAGE_SIZE)))
-	root_entry_table[256];
+/* fault records logged per fault event, excess ones are only counted */
+#define VTD_MAX_LOGGED_FAULTS		16
+
+#define VTD_MAX_SEGMENTS		16
+#define VTD_MAX_UNITS			32
+
+/* root entry tables, allocated on demand and indexed by PCI segment */
+static struct vtd_entry *root_entry_tables[VTD_MAX_SEGMENTS];
+/* PCI segment served by each DMAR unit */
+static u16 dmar_unit_segment[VTD_MAX_UNITS];
+/* fault recording registers of each DMAR unit, located via CAP at init */
+static void *dmar_unit_fault_regs[VTD_MAX_UNITS];
+static unsigned int dmar_unit_num_fault_recs[VTD_MAX_UNITS];
 static struct paging vtd_paging[VTD_MAX_PAGE_DIR_LEVELS];
 static void *dmar_reg_base;
 static unsigned int dmar_units;
@@ -107,64 +118,114 @@ static void vtd_init_fault_nmi(void)
 	}
 }
 
-static void *vtd_get_fault_rec_reg_addr(void *reg_base)
+static u64 vtd_cap_field(unsigned long caps, u64 mask)
+{
+	return (caps & mask) >> (__builtin_ffsl(mask) - 1);
+}
+
+static u32 vtd_fault_source_cell(u16 segment, u16 sid)
 {
-	return reg_base + 16 *
-		mmio_read64_field(reg_base + VTD_CAP_REG, VTD_CAP_FRO_MASK);
+	u32 cell_id = JAILHOUSE_FAULT_NO_CELL;
+	struct cell *cell;
+
+	/* cells may be created or destroyed concurrently */
+	spin_lock(&cell_list_lock);
+	for_each_cell(cell)
+		if (pci_get_assigned_device(cell, segment, sid)) {
+			cell_id = cell->id;
+			break;
+		}
+	spin_unlock(&cell_list_lock);
+
+	return cell_id;
 }
 
-static void vtd_print_fault_record_reg_status(void *reg_base)
+static void vtd_log_fault_record(void *rec_reg_addr, u16 segment)
 {
-	unsigned int sid = mmio_read64_field(reg_base + VTD_FRCD_HI_REG,
-					     VTD_FRCD_HI_SID_MASK);
-	unsigned int fr = mmio_read64_field(reg_base + VTD_FRCD_HI_REG,
-					    VTD_FRCD_HI_FR_MASK);
-	unsigned long fi = mmio_read64_field(reg_base + VTD_FRCD_LO_REG,
-					     VTD_FRCD_LO_FI_MASK);
-	unsigned int type = mmio_read64_field(reg_base + VTD_FRCD_HI_REG,
-					      VTD_FRCD_HI_TYPE);
-
-	printk("VT-d fault event occurred:\n");
-	printk(" Source Identifier (bus:dev.func): %02x:%02x.%x\n",
-	       PCI_BDF_PARAMS(sid));
-	printk(" Fault Reason: 0x%x Fault Info: %x Type %d\n", fr, fi, type);
+	u16 sid = mmio_read64_field(rec_reg_addr + VTD_FRCD_HI_REG,
+				    VTD_FRCD_HI_SID_MASK);
+	u8 fr = mmio_read64_field(rec_reg_addr + VTD_FRCD_HI_REG,
+				  VTD_FRCD_HI_FR_MASK);
+	u64 fi = mmio_read64(rec_reg_addr + VTD_FRCD_LO_REG) &
+		VTD_FRCD_LO_FI_MASK;
+	u8 type = mmio_read64_field(rec_reg_addr + VTD_FRCD_HI_REG,
+				    VTD_FRCD_HI_TYPE);
+	u32 cell_id = vtd_fault_source_cell(segment, sid);
+
+	/* only report the first fault per source, the log keeps counting */
+	if (fault_log_record(segment, sid, fi, fr, type, cell_id))
+		printk("VT-d fault event occurred: source %04x:%02x:%02x.%x, "
+		       "reason 0x%x, cell %d\n", segment, PCI_BDF_PARAMS(sid),
+		       fr, cell_id);
 }
 
 void vtd_check_pending_faults(struct per_cpu *cpu_data)
 {
-	unsigned int fr_index;
+	unsigned int n, nfr, fr_index, logged = 0, dropped = 0;
+	void *fault_reg_base, *rec_reg_addr;
 	void *reg_base = dmar_reg_base;
-	unsigned int n;
-	void *fault_reg_addr, *rec_reg_addr;
 
 	if (cpu_data->cpu_id != fault_reporting_cpu_id)
 		return;
 
-	for (n = 0; n < dmar_units; n++, reg_base += PAGE_SIZE)
-		if (mmio_read32_field(reg_base + VTD_FSTS_REG, VTD_FSTS_PPF)) {
-			fr_index = mmio_read32_field(reg_base + VTD_FSTS_REG,
-						     VTD_FSTS_FRI_MASK);
-			fault_reg_addr = vtd_get_fault_rec_reg_addr(reg_base);
-			rec_reg_addr = fault_reg_addr + 16 * fr_index;
-			vtd_print_fault_record_reg_status(rec_reg_addr);
+	for (n = 0; n < dmar_units; n++, reg_base += PAGE_SIZE) {
+		if (mmio_read32_field(reg_base + VTD_FSTS_REG, VTD_FSTS_PFO)) {
+			/* the unit lost an unknown number of faults */
+			dropped++;
+			mmio_write32_field(reg_base + VTD_FSTS_REG,
+					   VTD_FSTS_PFO, VTD_FSTS_PFO_CLEAR);
+		}
+
+		if (!mmio_read32_field(reg_base + VTD_FSTS_REG, VTD_FSTS_PPF))
+			continue;
+
+		nfr = dmar_unit_num_fault_recs[n];
+		fault_reg_base = dmar_unit_fault_regs[n];
+		fr_index = mmio_read32_field(reg_base + VTD_FSTS_REG,
+					     VTD_FSTS_FRI_MASK);
+
+		/* walk the pending records, starting with the oldest one */
+		while (nfr-- > 0) {
+			rec_reg_addr = fault_reg_base + 16 * fr_index;
+			if (!mmio_read64_field(rec_reg_addr + VTD_FRCD_HI_REG,
+					       VTD_FRCD_HI_F))
+				break;
+
+			/*
+			 * Rate-limit the work per event so that fault storms
+			 * cannot stall this CPU. Excess records are only
+			 * counted.
+			 */
+			if (logged < VTD_MAX_LOGGED_FAULTS) {
+				vtd_log_fault_record(rec_reg_addr,
+						     dmar_unit_segment[n]);
+				logged++;
+			} else {
+				dropped++;
+			}
 
 			/* Clear faults in record registers */
 			mmio_write64_field(rec_reg_addr + VTD_FRCD_HI_REG,
 					   VTD_FRCD_HI_F, VTD_FRCD_HI_F_CLEAR);
+
+			fr_index = (fr_index + 1) %
+				dmar_unit_num_fault_recs[n];
 		}
+	}
+
+	if (dropped > 0)
+		fault_log_drop(dropped);
 }
 
-static void vtd_init_unit(void *reg_base)
+static void vtd_init_unit(unsigned int unit, void *reg_base,
+			  struct vtd_entry *root_entry_table)
 {
-	void *fault_reg_base;
-	unsigned int nfr, n;
-
-	nfr = mmio_read64_field(reg_base + VTD_CAP_REG, VTD_CAP_NFR_MASK);
-	fault_reg_base = vtd_get_fault_rec_reg_addr(reg_base);
+	unsigned int n;
 
-	for (n = 0; n < nfr; n++)
+	for (n = 0; n < dmar_unit_num_fault_recs[unit]; n++)
 		/* Clear fault recording register status */
-		mmio_write64_field(fault_reg_base + 16 * n + VTD_FRCD_HI_REG,
+		mmio_write64_field(dmar_unit_fault_regs[unit] + 16 * n +
+				   VTD_FRCD_HI_REG,
 				   VTD_FRCD_HI_F, VTD_FRCD_HI_F_CLEAR);
 
 	/* Clear fault overflow status */
@@ -210,11 +271,19 @@ int vtd_init(void)
 		    offset + drhd->header.length > dmar->header.length)
 			return -EIO;
 
-		/* TODO: support multiple segments */
-		if (drhd->segment != 0)
-			return -EIO;
+		if (drhd->segment >= VTD_MAX_SEGMENTS ||
+		    dmar_units >= VTD_MAX_UNITS)
+			return -ERANGE;
 
-		printk("Found DMAR @%p\n", drhd->register_base_addr);
+		printk("Found DMAR @%p, segment %d\n",
+		       drhd->register_base_addr, drhd->segment);
+
+		if (!root_entry_tables[drhd->segment]) {
+			root_entry_tables[drhd->segment] =
+				page_alloc(&mem_pool, 1);
+			if (!root_entry_tables[drhd->segment])
+				return -ENOMEM;
+		}
 
 		reg_base = page_alloc(&remap_pool, 1);
 		if (!reg_base)
@@ -260,9 +329,15 @@ int vtd_init(void)
 		if (num_did < dmar_num_did)
 			dmar_num_did = num_did;
 
-		dmar_units++;
+		dmar_unit_segment[dmar_units] = drhd->segment;
+		dmar_unit_fault_regs[dmar_units] = reg_base + 16 *
+			vtd_cap_field(caps, VTD_CAP_FRO_MASK);
+		dmar_unit_num_fault_recs[dmar_units] =
+			vtd_cap_field(caps, VTD_CAP_NFR_MASK) + 1;
 
-		vtd_init_unit(reg_base);
+		vtd_init_unit(dmar_units, reg_base,
+			      root_entry_tables[drhd->segment]);
+		dmar_units++;
 
 		offset += drhd->header.length;
 		drhd = (struct acpi_dmar_drhd *)
@@ -286,16 +361,31 @@ int vtd_init(void)
 	return vtd_cell_init(&root_cell);
 }
 
+static struct vtd_entry *vtd_get_root_entry(const struct pci_device *device)
+{
+	u16 segment = device->info->domain;
+
+	if (segment >= VTD_MAX_SEGMENTS || !root_entry_tables[segment])
+		return NULL;
+	return &root_entry_tables[segment][PCI_BUS(device->info->bdf)];
+}
+
 int vtd_add_pci_device(struct cell *cell, struct pci_device *device)
 {
+	struct vtd_entry *root_entry, *context_entry_table, *context_entry;
 	u16 bdf = device->info->bdf;
-	u64 *root_entry_lo = &root_entry_table[PCI_BUS(bdf)].lo_word;
-	struct vtd_entry *context_entry_table, *context_entry;
+	u64 *root_entry_lo;
 
 	// HACK for QEMU
 	if (dmar_units == 0)
 		return 0;
 
+	/* devices on segments without DMAR unit cannot be isolated */
+	root_entry = vtd_get_root_entry(device);
+	if (!root_entry)
+		return -EINVAL;
+	root_entry_lo = &root_entry->lo_word;
+
 	if (*root_entry_lo & VTD_ROOT_PRESENT) {
 		context_entry_table =
 			page_map_phys2hvirt(*root_entry_lo & PAGE_MASK);
@@ -321,16 +411,19 @@ int vtd_add_pci_device(struct cell *cell, struct pci_device *device)
 
 void vtd_remove_pci_device(struct pci_device *device)
 {
-	u16 bdf = device->info->bdf;
-	u64 *root_entry_lo = &root_entry_table[PCI_BUS(bdf)].lo_word;
+	struct vtd_entry *root_entry = vtd_get_root_entry(device);
 	struct vtd_entry *context_entry_table;
 	struct vtd_entry *context_entry;
+	u16 bdf = device->info->bdf;
+	u64 *root_entry_lo;
 	unsigned int n;
 
 	// HACK for QEMU
-	if (dmar_units == 0)
+	if (dmar_units == 0 || !root_entry)
 		return;
 
+	root_entry_lo = &root_entry->lo_word;
+
 	context_entry_table = page_map_phys2hvirt(*root_entry_lo & PAGE_MASK);
 	context_entry = &context_entry_table[PCI_DEVFN(bdf)];
 
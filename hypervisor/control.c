@@ -22,17 +22,37 @@
 
 enum msg_type {MSG_REQUEST, MSG_INFORMATION};
 enum failure_mode {ABORT_ON_ERROR, WARN_ON_ERROR};
-enum management_task {CELL_START, CELL_SET_LOADABLE, CELL_DESTROY};
+enum management_task {CELL_START, CELL_SET_LOADABLE, CELL_DESTROY,
+		      CELL_RESTART};
 
 struct jailhouse_system *system_config;
 
+/*
+ * The root cell maps the pages of the log, so it lives in a section of its
+ * own that the linker pads to full pages.
+ */
+struct jailhouse_fault_log fault_log
+	__attribute__((aligned(PAGE_SIZE), section(".bss.fault_log")));
+
+/*
+ * Synchronization of cell management:
+ *  - cell_list_lock protects lookups in the cell list. It is only held
+ *    briefly and never while waiting for other CPUs.
+ *  - cell->lock serializes management operations on that cell.
+ *  - reconfig_lock is held by operations that change the set of cells or
+ *    the mappings of the root cell, i.e. that have to stop the root cell.
+ *    The cell list is only modified while holding it and cell_list_lock,
+ *    so holders of reconfig_lock can walk the list without further locking.
+ * Root cell CPUs that spin inside the hypervisor cannot be suspended.
+ * Therefore, cell->lock and reconfig_lock are acquired via spin_trylock,
+ * and management requests fail with -EBUSY on contention.
+ */
+DEFINE_SPINLOCK(cell_list_lock);
+static DEFINE_SPINLOCK(reconfig_lock);
 static DEFINE_SPINLOCK(shutdown_lock);
+static DEFINE_SPINLOCK(fault_log_lock);
 static unsigned int num_cells = 1;
 
-#define for_each_cell(c)	for ((c) = &root_cell; (c); (c) = (c)->next)
-#define for_each_non_root_cell(c) \
-	for ((c) = root_cell.next; (c); (c) = (c)->next)
-
 unsigned int next_cpu(unsigned int cpu, struct cpu_set *cpu_set, int exception)
 {
 	do
@@ -51,6 +71,85 @@ bool cpu_id_valid(unsigned long cpu_id)
 		test_bit(cpu_id, system_cpu_set));
 }
 
+static void fault_log_update_begin(void)
+{
+	spin_lock(&fault_log_lock);
+	fault_log.seq++;
+	memory_barrier();
+}
+
+static void fault_log_update_end(void)
+{
+	memory_barrier();
+	fault_log.seq++;
+	spin_unlock(&fault_log_lock);
+}
+
+/**
+ * fault_log_record - Record a fault in the log shared with the root cell
+ * @segment: segment of the faulting source (e.g. PCI segment)
+ * @source_id: ID of the faulting source (e.g. PCI BDF)
+ * @address: faulting address
+ * @reason: architecture-specific fault reason
+ * @type: architecture-specific access type
+ * @cell_id: ID of the cell owning the source or JAILHOUSE_FAULT_NO_CELL
+ *
+ * Faults of a source that is already recorded with the same reason only
+ * increment the counter of the existing record and update its address.
+ * Otherwise, the oldest record is replaced.
+ *
+ * Returns true if a new record was created.
+ */
+bool fault_log_record(u16 segment, u16 source_id, u64 address, u8 reason,
+		      u8 type, u32 cell_id)
+{
+	struct jailhouse_fault_record *rec;
+	bool new_record = true;
+	unsigned int n;
+
+	fault_log_update_begin();
+
+	for (n = 0; n < JAILHOUSE_FAULT_LOG_SIZE; n++) {
+		rec = &fault_log.records[n];
+		if (rec->count > 0 && rec->segment == segment &&
+		    rec->source_id == source_id && rec->reason == reason &&
+		    rec->cell_id == cell_id) {
+			new_record = false;
+			break;
+		}
+	}
+
+	if (new_record) {
+		rec = &fault_log.records[fault_log.next];
+		fault_log.next = (fault_log.next + 1) %
+			JAILHOUSE_FAULT_LOG_SIZE;
+		rec->count = 0;
+		rec->segment = segment;
+		rec->source_id = source_id;
+		rec->reason = reason;
+		rec->cell_id = cell_id;
+	}
+	rec->address = address;
+	rec->type = type;
+	if (rec->count < ~0U)
+		rec->count++;
+
+	fault_log_update_end();
+
+	return new_record;
+}
+
+/**
+ * fault_log_drop - Account for faults that were not recorded
+ * @count: number of faults
+ */
+void fault_log_drop(unsigned int count)
+{
+	fault_log_update_begin();
+	fault_log.dropped += count;
+	fault_log_update_end();
+}
+
 static void cell_suspend(struct cell *cell, struct per_cpu *cpu_data)
 {
 	unsigned int cpu;
@@ -67,6 +166,54 @@ static void cell_resume(struct per_cpu *cpu_data)
 		arch_resume_cpu(cpu);
 }
 
+static bool cell_is_running(struct cell *cell)
+{
+	u32 state = cell->comm_page.comm_region.cell_state;
+
+	return state == JAILHOUSE_CELL_RUNNING ||
+		state == JAILHOUSE_CELL_RUNNING_LOCKED;
+}
+
+/* caller holds the cell lock or owns the cell exclusively */
+static void cell_set_state(struct cell *cell, u32 state)
+{
+	cell->comm_page.comm_region.cell_state = state;
+	cell->notified_state = state;
+	arch_notify_root_cell();
+}
+
+/*
+ * Records a state that the cell wrote on its own. Returns true if the root
+ * cell has to be notified about it. The caller has to hold the cell lock or
+ * the cell list lock.
+ */
+static bool cell_state_observed(struct cell *cell, u32 state)
+{
+	if (state == cell->notified_state)
+		return false;
+	cell->notified_state = state;
+	return true;
+}
+
+/*
+ * Stops all CPUs of a cell that no longer responds and reports it as failed.
+ * The caller has to hold the cell lock.
+ */
+static void cell_set_failed(struct cell *cell, const char *reason)
+{
+	unsigned int cpu;
+
+	printk("WARNING: Cell \"%s\" %s, stopping it\n", cell->config->name,
+	       reason);
+
+	for_each_cpu(cpu, cell->cpu_set) {
+		arch_suspend_cpu(cpu);
+		per_cpu(cpu)->failed = true;
+		arch_park_cpu(cpu);
+	}
+	cell_set_state(cell, JAILHOUSE_CELL_FAILED);
+}
+
 /**
  * cell_send_message - Deliver a message to cell and wait for the reply
  * @cell: target cell
@@ -77,22 +224,41 @@ static void cell_resume(struct per_cpu *cpu_data)
  * information message was acknowledged by the target cell. It also return true
  * of the target cell does not support a communication region, is shut down or
  * in failed state. Return false on request denial or invalid replies.
+ *
+ * If the cell does not reply within the msg_reply_timeout of its
+ * configuration, it is stopped and put into failed state.
  */
 static bool cell_send_message(struct cell *cell, u32 message,
 			      enum msg_type type)
 {
+	struct jailhouse_comm_region *comm_region =
+		&cell->comm_page.comm_region;
+	u32 timeout_ms = cell->config->msg_reply_timeout;
+	u64 deadline = 0;
+
 	if (cell->config->flags & JAILHOUSE_CELL_PASSIVE_COMMREG)
 		return true;
 
-	jailhouse_send_msg_to_cell(&cell->comm_page.comm_region, message);
+	if (timeout_ms)
+		deadline = arch_get_time_us() + timeout_ms * 1000ULL;
+
+	jailhouse_send_msg_to_cell(comm_region, message);
 
 	while (1) {
-		u32 reply = cell->comm_page.comm_region.reply_from_cell;
-		u32 cell_state = cell->comm_page.comm_region.cell_state;
+		u32 reply, cell_state;
+
+		/* reply_from_cell and cell_state share the monitored line */
+		arch_monitor_address(&comm_region->reply_from_cell);
+
+		reply = comm_region->reply_from_cell;
+		cell_state = comm_region->cell_state;
 
 		if (cell_state == JAILHOUSE_CELL_SHUT_DOWN ||
-		    cell_state == JAILHOUSE_CELL_FAILED)
+		    cell_state == JAILHOUSE_CELL_FAILED) {
+			if (cell_state_observed(cell, cell_state))
+				arch_notify_root_cell();
 			return true;
+		}
 
 		if ((type == MSG_REQUEST &&
 		     reply == JAILHOUSE_MSG_REQUEST_APPROVED) ||
@@ -103,10 +269,16 @@ static bool cell_send_message(struct cell *cell, u32 message,
 		if (reply != JAILHOUSE_MSG_NONE)
 			return false;
 
-		cpu_relax();
+		if (deadline && arch_get_time_us() >= deadline) {
+			cell_set_failed(cell, "did not reply in time");
+			return true;
+		}
+
+		arch_wait_for_monitor();
 	}
 }
 
+/* reconfig_lock has to be held */
 static bool cell_reconfig_ok(struct cell *excluded_cell)
 {
 	struct cell *cell;
@@ -119,13 +291,156 @@ static bool cell_reconfig_ok(struct cell *excluded_cell)
 	return true;
 }
 
+/* reconfig_lock has to be held */
 static void cell_reconfig_completed(void)
 {
 	struct cell *cell;
 
-	for_each_non_root_cell(cell)
+	/*
+	 * Waiting for the cell lock is safe here: holders of a cell lock can
+	 * not stop the root cell without reconfig_lock, which we own.
+	 */
+	for_each_non_root_cell(cell) {
+		spin_lock(&cell->lock);
 		cell_send_message(cell, JAILHOUSE_MSG_RECONFIG_COMPLETED,
 				  MSG_INFORMATION);
+		spin_unlock(&cell->lock);
+	}
+}
+
+/* the lowest root cell CPU monitors all other cells */
+static unsigned int monitor_cpu(void)
+{
+	return next_cpu(-1, root_cell.cpu_set, -1);
+}
+
+#define MONITOR_IDLE		(~0ULL)
+
+/* serializes cell_monitor_check() and protects monitor_next_check */
+static DEFINE_SPINLOCK(monitor_lock);
+/* time of the next due check, MONITOR_IDLE if no cell is watched */
+static u64 monitor_next_check = MONITOR_IDLE;
+
+static void cell_monitor_kick(void)
+{
+	/* a check in progress cannot override the request afterwards */
+	spin_lock(&monitor_lock);
+	monitor_next_check = 0;
+	spin_unlock(&monitor_lock);
+
+	arch_cell_monitor_kick(monitor_cpu());
+}
+
+/**
+ * cell_monitor_check() - Watch running cells for heartbeats and state changes
+ * @cpu_data:	Data structure of the calling CPU
+ *
+ * Cells with a heartbeat_period in their configuration have to change the
+ * heartbeat field of their communication region at least once per period
+ * while they are running. A cell that misses heartbeat_misses periods in a
+ * row is stopped and put into failed state.
+ *
+ * State changes that cells wrote on their own are reported to the root cell
+ * along the way, but do not cause any checks.
+ *
+ * Only the monitor CPU, the lowest root cell CPU, performs the checks, and
+ * only once the nearest deadline has passed. It has to make sure it traps at
+ * the returned time. Calls on other CPUs return right away. No deadline lies
+ * closer than CELL_MONITOR_INTERVAL_US in the future. Cells with management
+ * operations in progress are not stopped.
+ *
+ * Return: Time as returned by arch_get_time_us() at which the calling CPU has
+ * to call this function again, 0 if no trap is required.
+ */
+u64 cell_monitor_check(struct per_cpu *cpu_data)
+{
+	struct jailhouse_comm_region *comm_region;
+	struct cell *cell, *expired = NULL;
+	u64 now, next;
+	u32 heartbeat, misses;
+	bool notify = false;
+
+	if (cpu_data->cpu_id != monitor_cpu())
+		return 0;
+
+	/*
+	 * Racy read: the only concurrent writer is cell_monitor_kick, which
+	 * makes us come back with the new value afterwards.
+	 */
+	next = monitor_next_check;
+	if (next == MONITOR_IDLE)
+		return 0;
+
+	now = arch_get_time_us();
+	if (now < next)
+		return next;
+
+	/* a kick in progress makes us come back as well */
+	if (!spin_trylock(&monitor_lock))
+		return 0;
+
+	next = MONITOR_IDLE;
+
+	spin_lock(&cell_list_lock);
+	for_each_non_root_cell(cell) {
+		comm_region = &cell->comm_page.comm_region;
+
+		if (cell_state_observed(cell, comm_region->cell_state))
+			notify = true;
+
+		if (!cell_is_running(cell))
+			continue;
+
+		if (cell->config->heartbeat_period == 0)
+			continue;
+
+		heartbeat = comm_region->heartbeat;
+		if (cell->heartbeat_deadline == 0) {
+			cell->heartbeat_seen = heartbeat;
+			cell->heartbeat_missed = 0;
+			cell->heartbeat_deadline = now +
+				cell->config->heartbeat_period * 1000ULL;
+		} else if (now >= cell->heartbeat_deadline) {
+			if (heartbeat != cell->heartbeat_seen) {
+				cell->heartbeat_seen = heartbeat;
+				cell->heartbeat_missed = 0;
+			} else {
+				cell->heartbeat_missed++;
+			}
+			cell->heartbeat_deadline = now +
+				cell->config->heartbeat_period * 1000ULL;
+
+			misses = cell->config->heartbeat_misses;
+			if (misses == 0)
+				misses = 1;
+			if (cell->heartbeat_missed >= misses && !expired &&
+			    spin_trylock(&cell->lock)) {
+				expired = cell;
+				continue;
+			}
+		}
+
+		if (next > cell->heartbeat_deadline)
+			next = cell->heartbeat_deadline;
+	}
+	spin_unlock(&cell_list_lock);
+
+	/* do not busy-loop on cells that cannot be stopped right now */
+	if (next != MONITOR_IDLE && next < now + CELL_MONITOR_INTERVAL_US)
+		next = now + CELL_MONITOR_INTERVAL_US;
+	monitor_next_check = next;
+
+	spin_unlock(&monitor_lock);
+
+	/* the cell lock keeps the cell alive */
+	if (expired) {
+		cell_set_failed(expired, "missed its heartbeat");
+		spin_unlock(&expired->lock);
+	} else if (notify) {
+		arch_notify_root_cell();
+	}
+
+	return next == MONITOR_IDLE ? 0 : next;
 }
 
 static unsigned int get_free_cell_id(void)
@@ -285,11 +600,64 @@ static void cell_destroy_internal(struct per_cpu *cpu_data, struct cell *cell)
 			remap_to_root_cell(mem, WARN_ON_ERROR);
 	}
 
+	arch_cell_release_resources(cpu_data, cell);
 	arch_cell_destroy(cpu_data, cell);
 
 	arch_config_commit(cpu_data, cell);
 }
 
+/* reconfig_lock has to be held */
+static bool cell_name_in_use(const char *name)
+{
+	struct cell *cell;
+
+	for_each_cell(cell)
+		if (strcmp(cell->config->name, name) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Builds everything that is private to the new cell, i.e. its architecture
+ * state and its memory mappings, while the root cell keeps running.
+ */
+static int cell_prepare(struct per_cpu *cpu_data, struct cell *cell)
+{
+	const struct jailhouse_memory *mem =
+		jailhouse_cell_mem_regions(cell->config);
+	unsigned int n;
+	int err;
+
+	err = arch_cell_create(cpu_data, cell);
+	if (err)
+		return err;
+
+	for (n = 0; n < cell->config->num_memory_regions; n++, mem++) {
+		err = arch_map_memory_region(cell, mem);
+		if (err)
+			goto err_unmap;
+	}
+
+	return 0;
+
+err_unmap:
+	while (n-- > 0)
+		arch_unmap_memory_region(cell, --mem);
+	arch_cell_destroy(cpu_data, cell);
+	return err;
+}
+
+static void cell_unprepare(struct per_cpu *cpu_data, struct cell *cell)
+{
+	const struct jailhouse_memory *mem =
+		jailhouse_cell_mem_regions(cell->config);
+	unsigned int n;
+
+	for (n = 0; n < cell->config->num_memory_regions; n++, mem++)
+		arch_unmap_memory_region(cell, mem);
+	arch_cell_destroy(cpu_data, cell);
+}
+
 static int cell_create(struct per_cpu *cpu_data, unsigned long config_address)
 {
 	unsigned long mapping_addr = TEMPORARY_MAPPING_CPU_BASE(cpu_data);
@@ -305,11 +673,12 @@ static int cell_create(struct per_cpu *cpu_data, unsigned long config_address)
 	if (cpu_data->cell != &root_cell)
 		return -EPERM;
 
-	cell_suspend(&root_cell, cpu_data);
+	if (!spin_trylock(&reconfig_lock))
+		return -EBUSY;
 
 	if (!cell_reconfig_ok(NULL)) {
 		err = -EPERM;
-		goto err_resume;
+		goto err_unlock;
 	}
 
 	cfg_header_size = (config_address & ~PAGE_MASK) +
@@ -319,36 +688,42 @@ static int cell_create(struct per_cpu *cpu_data, unsigned long config_address)
 			      cfg_header_size, mapping_addr,
 			      PAGE_READONLY_FLAGS, PAGE_MAP_NON_COHERENT);
 	if (err)
-		goto err_resume;
+		goto err_unlock;
 
 	cfg = (struct jailhouse_cell_desc *)(mapping_addr + cfg_page_offs);
+	if (memcmp(cfg->signature, JAILHOUSE_CELL_DESC_SIGNATURE,
+		   sizeof(cfg->signature)) != 0 ||
+	    cfg->revision != JAILHOUSE_CONFIG_REVISION) {
+		err = -EINVAL;
+		goto err_unlock;
+	}
+
 	cfg_total_size = jailhouse_cell_config_size(cfg);
 	if (cfg_total_size + cfg_page_offs > NUM_TEMPORARY_PAGES * PAGE_SIZE) {
 		err = -E2BIG;
-		goto err_resume;
+		goto err_unlock;
 	}
 
-	for_each_cell(cell)
-		if (strcmp(cell->config->name, cfg->name) == 0) {
-			err = -EEXIST;
-			goto err_resume;
-		}
+	if (cell_name_in_use(cfg->name)) {
+		err = -EEXIST;
+		goto err_unlock;
+	}
 
 	err = page_map_create(&hv_paging_structs, config_address & PAGE_MASK,
 			      cfg_total_size + cfg_page_offs, mapping_addr,
 			      PAGE_READONLY_FLAGS, PAGE_MAP_NON_COHERENT);
 	if (err)
-		goto err_resume;
+		goto err_unlock;
 
 	err = check_mem_regions(cfg);
 	if (err)
-		goto err_resume;
+		goto err_unlock;
 
 	cell_pages = PAGE_ALIGN(sizeof(*cell) + cfg_total_size) / PAGE_SIZE;
 	cell = page_alloc(&mem_pool, cell_pages);
 	if (!cell) {
 		err = -ENOMEM;
-		goto err_resume;
+		goto err_unlock;
 	}
 
 	cell->data_pages = cell_pages;
@@ -377,10 +752,22 @@ static int cell_create(struct per_cpu *cpu_data, unsigned long config_address)
 			goto err_free_cpu_set;
 		}
 
-	err = arch_cell_create(cpu_data, cell);
+	err = cell_prepare(cpu_data, cell);
 	if (err)
 		goto err_free_cpu_set;
 
+	/*
+	 * Only the hand-over of resources from the root cell requires its CPUs
+	 * to be stopped. The state of the other cells may have changed while
+	 * we were preparing, so check it again.
+	 */
+	cell_suspend(&root_cell, cpu_data);
+
+	if (!cell_reconfig_ok(NULL)) {
+		err = -EPERM;
+		goto err_abort_cell;
+	}
+
 	for_each_cpu(cpu, cell->cpu_set) {
 		arch_park_cpu(cpu);
 
@@ -389,36 +776,40 @@ static int cell_create(struct per_cpu *cpu_data, unsigned long config_address)
 		memset(per_cpu(cpu)->stats, 0, sizeof(per_cpu(cpu)->stats));
 	}
 
+	err = arch_cell_assign_resources(cpu_data, cell);
+	if (err)
+		goto err_destroy_cell;
+
 	/*
-	 * Unmap the cell's memory regions from the root cell and map them to
-	 * the new cell instead.
+	 * Unmap the cell's memory regions from the root cell. They are already
+	 * mapped into the new cell.
+	 * Unmap exceptions:
+	 *  - the communication region is not backed by root memory
 	 */
 	mem = jailhouse_cell_mem_regions(cell->config);
-	for (n = 0; n < cell->config->num_memory_regions; n++, mem++) {
-		/*
-		 * Unmap exceptions:
-		 *  - the communication region is not backed by root memory
-		 */
+	for (n = 0; n < cell->config->num_memory_regions; n++, mem++)
 		if (!(mem->flags & JAILHOUSE_MEM_COMM_REGION)) {
 			err = unmap_from_root_cell(mem);
 			if (err)
 				goto err_destroy_cell;
 		}
 
-		err = arch_map_memory_region(cell, mem);
-		if (err)
-			goto err_destroy_cell;
-	}
-
 	arch_config_commit(cpu_data, cell);
 
-	cell->comm_page.comm_region.cell_state = JAILHOUSE_CELL_SHUT_DOWN;
+	cell_set_state(cell, JAILHOUSE_CELL_SHUT_DOWN);
 
+	spin_lock(&cell_list_lock);
 	last = &root_cell;
 	while (last->next)
 		last = last->next;
 	last->next = cell;
 	num_cells++;
+	spin_unlock(&cell_list_lock);
+
+	cell_resume(cpu_data);
+
+	/* the watchdog CPU may have been handed over to the new cell */
+	cell_monitor_kick();
 
 	cell_reconfig_completed();
 
@@ -426,19 +817,23 @@ static int cell_create(struct per_cpu *cpu_data, unsigned long config_address)
 
 	page_map_dump_stats("after cell creation");
 
-	cell_resume(cpu_data);
+	spin_unlock(&reconfig_lock);
 
 	return cell->id;
 
 err_destroy_cell:
 	cell_destroy_internal(cpu_data, cell);
+	cell_resume(cpu_data);
+	goto err_free_cpu_set;
+err_abort_cell:
+	cell_resume(cpu_data);
+	cell_unprepare(cpu_data, cell);
 err_free_cpu_set:
 	destroy_cpu_set(cell);
 err_free_cell:
 	page_free(&mem_pool, cell, cell_pages);
-
-err_resume:
-	cell_resume(cpu_data);
+err_unlock:
+	spin_unlock(&reconfig_lock);
 
 	return err;
 }
@@ -449,81 +844,261 @@ static bool cell_shutdown_ok(struct cell *cell)
 				 MSG_REQUEST);
 }
 
+static bool management_task_reconfigures(enum management_task task,
+					 struct cell *cell)
+{
+	return task == CELL_DESTROY || task == CELL_SET_LOADABLE ||
+		(task == CELL_START && cell->loadable);
+}
+
 static int cell_management_prologue(enum management_task task,
 				    struct per_cpu *cpu_data, unsigned long id,
 				    struct cell **cell_ptr)
 {
+	struct cell *cell;
+
 	/* We do not support management commands over non-root cells. */
 	if (cpu_data->cell != &root_cell)
 		return -EPERM;
 
-	cell_suspend(&root_cell, cpu_data);
+	spin_lock(&cell_list_lock);
 
-	for_each_cell(*cell_ptr)
-		if ((*cell_ptr)->id == id)
+	for_each_cell(cell)
+		if (cell->id == id)
 			break;
 
-	if (!*cell_ptr) {
-		cell_resume(cpu_data);
+	if (!cell) {
+		spin_unlock(&cell_list_lock);
 		return -ENOENT;
 	}
 
 	/* root cell cannot be managed */
-	if (*cell_ptr == &root_cell) {
-		cell_resume(cpu_data);
+	if (cell == &root_cell) {
+		spin_unlock(&cell_list_lock);
 		return -EINVAL;
 	}
 
-	if ((task == CELL_DESTROY && !cell_reconfig_ok(*cell_ptr)) ||
-	    !cell_shutdown_ok(*cell_ptr)) {
-		cell_resume(cpu_data);
+	if (!spin_trylock(&cell->lock)) {
+		spin_unlock(&cell_list_lock);
+		return -EBUSY;
+	}
+
+	spin_unlock(&cell_list_lock);
+
+	if (management_task_reconfigures(task, cell) &&
+	    !spin_trylock(&reconfig_lock)) {
+		spin_unlock(&cell->lock);
+		return -EBUSY;
+	}
+
+	if ((task == CELL_DESTROY && !cell_reconfig_ok(cell)) ||
+	    !cell_shutdown_ok(cell)) {
+		if (management_task_reconfigures(task, cell))
+			spin_unlock(&reconfig_lock);
+		spin_unlock(&cell->lock);
 		return -EPERM;
 	}
 
-	cell_suspend(*cell_ptr, cpu_data);
+	cell_suspend(cell, cpu_data);
 
+	*cell_ptr = cell;
 	return 0;
 }
 
+static void cell_management_epilogue(struct cell *cell, bool reconfig)
+{
+	if (reconfig)
+		spin_unlock(&reconfig_lock);
+	spin_unlock(&cell->lock);
+}
+
+static unsigned int cell_snapshot_pages(struct cell *cell)
+{
+	const struct jailhouse_memory *mem =
+		jailhouse_cell_mem_regions(cell->config);
+	unsigned long size = 0;
+	unsigned int n;
+
+	for (n = 0; n < cell->config->num_memory_regions; n++, mem++)
+		if (mem->flags & JAILHOUSE_MEM_LOADABLE)
+			size += mem->size;
+	return size / PAGE_SIZE;
+}
+
+/*
+ * Copies the loadable memory regions of a cell into its snapshot or, if
+ * restore is set, back from it. The regions are accessed through the
+ * temporary mapping window of the calling CPU, one window at a time.
+ */
+static int cell_snapshot_copy(struct per_cpu *cpu_data, struct cell *cell,
+			      bool restore)
+{
+	unsigned long mapping_addr = TEMPORARY_MAPPING_CPU_BASE(cpu_data);
+	const struct jailhouse_memory *mem =
+		jailhouse_cell_mem_regions(cell->config);
+	void *snapshot = cell->snapshot;
+	unsigned long offs, size;
+	unsigned int n;
+	int err;
+
+	for (n = 0; n < cell->config->num_memory_regions; n++, mem++) {
+		if (!(mem->flags & JAILHOUSE_MEM_LOADABLE))
+			continue;
+
+		for (offs = 0; offs < mem->size; offs += size) {
+			size = mem->size - offs;
+			if (size > NUM_TEMPORARY_PAGES * PAGE_SIZE)
+				size = NUM_TEMPORARY_PAGES * PAGE_SIZE;
+
+			err = page_map_create(&hv_paging_structs,
+					      mem->phys_start + offs, size,
+					      mapping_addr, PAGE_DEFAULT_FLAGS,
+					      PAGE_MAP_NON_COHERENT);
+			if (err)
+				return err;
+
+			if (restore)
+				memcpy((void *)mapping_addr, snapshot, size);
+			else
+				memcpy(snapshot, (void *)mapping_addr, size);
+			snapshot += size;
+		}
+	}
+	return 0;
+}
+
+/* all CPUs of the cell have to be stopped */
+static void cell_launch(struct cell *cell)
+{
+	unsigned int cpu;
+
+	/* present a consistent Communication Region state to the cell */
+	cell_set_state(cell, JAILHOUSE_CELL_RUNNING);
+	cell->comm_page.comm_region.msg_to_cell = JAILHOUSE_MSG_NONE;
+
+	/* the first heartbeat is due one full timeout after the start */
+	cell->heartbeat_deadline = 0;
+	cell->heartbeat_missed = 0;
+
+	arch_cell_reset(cell);
+
+	for_each_cpu(cpu, cell->cpu_set) {
+		per_cpu(cpu)->failed = false;
+		arch_reset_cpu(cpu);
+	}
+
+	if (cell->config->heartbeat_period)
+		cell_monitor_kick();
+}
+
 static int cell_start(struct per_cpu *cpu_data, unsigned long id)
 {
 	const struct jailhouse_memory *mem;
-	unsigned int cpu, n;
+	unsigned int snapshot_pages;
 	struct cell *cell;
+	bool reconfig;
+	unsigned int n;
 	int err;
 
 	err = cell_management_prologue(CELL_START, cpu_data, id, &cell);
 	if (err)
 		return err;
 
-	if (cell->loadable) {
+	reconfig = cell->loadable;
+	if (reconfig) {
+		if (cell->config->flags & JAILHOUSE_CELL_SNAPSHOT &&
+		    !cell->snapshot) {
+			snapshot_pages = cell_snapshot_pages(cell);
+			cell->snapshot = page_alloc(&mem_pool, snapshot_pages);
+			if (!cell->snapshot) {
+				err = -ENOMEM;
+				goto out_unlock;
+			}
+			cell->snapshot_pages = snapshot_pages;
+		}
+
+		cell_suspend(&root_cell, cpu_data);
+
+		/*
+		 * Take the snapshot while the root cell, which has just loaded
+		 * the images, cannot modify them anymore.
+		 */
+		if (cell->snapshot) {
+			err = cell_snapshot_copy(cpu_data, cell, false);
+			if (err) {
+				cell_resume(cpu_data);
+				goto out_unlock;
+			}
+		}
+
 		/* unmap all loadable memory regions from the root cell */
 		mem = jailhouse_cell_mem_regions(cell->config);
 		for (n = 0; n < cell->config->num_memory_regions; n++, mem++)
 			if (mem->flags & JAILHOUSE_MEM_LOADABLE) {
 				err = unmap_from_root_cell(mem);
-				if (err)
-					goto out_resume;
+				if (err) {
+					cell_resume(cpu_data);
+					goto out_unlock;
+				}
 			}
 
 		arch_config_commit(cpu_data, NULL);
 
+		cell_resume(cpu_data);
+
 		cell->loadable = false;
 	}
 
-	/* present a consistent Communication Region state to the cell */
-	cell->comm_page.comm_region.cell_state = JAILHOUSE_CELL_RUNNING;
-	cell->comm_page.comm_region.msg_to_cell = JAILHOUSE_MSG_NONE;
+	cell_launch(cell);
 
-	for_each_cpu(cpu, cell->cpu_set) {
-		per_cpu(cpu)->failed = false;
-		arch_reset_cpu(cpu);
+	printk("Started cell \"%s\"\n", cell->config->name);
+
+out_unlock:
+	cell_management_epilogue(cell, reconfig);
+
+	return err;
+}
+
+/*
+ * Restores the loadable memory regions of a cell from the snapshot taken on
+ * its start and restarts the cell, without having to reload its images via
+ * the root cell.
+ */
+static int cell_restart(struct per_cpu *cpu_data, unsigned long id)
+{
+	struct cell *cell;
+	unsigned int cpu;
+	int err;
+
+	err = cell_management_prologue(CELL_RESTART, cpu_data, id, &cell);
+	if (err)
+		return err;
+
+	if (cell->loadable || !cell->snapshot) {
+		err = -EINVAL;
+		goto out_resume;
 	}
 
-	printk("Started cell \"%s\"\n", cell->config->name);
+	err = cell_snapshot_copy(cpu_data, cell, true);
+	if (err)
+		goto out_resume;
+
+	for_each_cpu(cpu, cell->cpu_set)
+		arch_park_cpu(cpu);
+	cell_suspend(cell, cpu_data);
+
+	cell_launch(cell);
+
+	printk("Restarted cell \"%s\"\n", cell->config->name);
+
+	cell_management_epilogue(cell, false);
+
+	return 0;
 
 out_resume:
-	cell_resume(cpu_data);
+	for_each_cpu(cpu, cell->cpu_set)
+		arch_resume_cpu(cpu);
+	cell_management_epilogue(cell, false);
 
 	return err;
 }
@@ -545,11 +1120,13 @@ static int cell_set_loadable(struct per_cpu *cpu_data, unsigned long id)
 	}
 
 	if (cell->loadable)
-		goto out_resume;
+		goto out_unlock;
 
-	cell->comm_page.comm_region.cell_state = JAILHOUSE_CELL_SHUT_DOWN;
+	cell_set_state(cell, JAILHOUSE_CELL_SHUT_DOWN);
 	cell->loadable = true;
 
+	cell_suspend(&root_cell, cpu_data);
+
 	/* map all loadable memory regions into the root cell */
 	mem = jailhouse_cell_mem_regions(cell->config);
 	for (n = 0; n < cell->config->num_memory_regions; n++, mem++)
@@ -565,6 +1142,8 @@ static int cell_set_loadable(struct per_cpu *cpu_data, unsigned long id)
 
 out_resume:
 	cell_resume(cpu_data);
+out_unlock:
+	cell_management_epilogue(cell, true);
 
 	return err;
 }
@@ -580,20 +1159,35 @@ static int cell_destroy(struct per_cpu *cpu_data, unsigned long id)
 
 	printk("Closing cell \"%s\"\n", cell->config->name);
 
+	/* the cell may have left its devices in any state */
+	arch_cell_reset_devices(cell);
+
+	cell_suspend(&root_cell, cpu_data);
+
 	cell_destroy_internal(cpu_data, cell);
 
+	spin_lock(&cell_list_lock);
 	previous = &root_cell;
 	while (previous->next != cell)
 		previous = previous->next;
 	previous->next = cell->next;
 	num_cells--;
+	spin_unlock(&cell_list_lock);
+
+	cell_resume(cpu_data);
 
+	/* a lower CPU may have returned to the root cell */
+	cell_monitor_kick();
+
+	/* the cell is no longer visible, so its lock can go with it */
+	if (cell->snapshot)
+		page_free(&mem_pool, cell->snapshot, cell->snapshot_pages);
 	page_free(&mem_pool, cell, cell->data_pages);
 	page_map_dump_stats("after cell destruction");
 
 	cell_reconfig_completed();
 
-	cell_resume(cpu_data);
+	spin_unlock(&reconfig_lock);
 
 	return 0;
 }
@@ -601,30 +1195,34 @@ static int cell_destroy(struct per_cpu *cpu_data, unsigned long id)
 static int cell_get_state(struct per_cpu *cpu_data, unsigned long id)
 {
 	struct cell *cell;
+	int state = -ENOENT;
 
 	if (cpu_data->cell != &root_cell)
 		return -EPERM;
 
 	/*
-	 * We do not need explicit synchronization with cell_create/destroy
-	 * because their cell_suspend(root_cell) will not return before we left
-	 * this hypercall.
+	 * The state is read without taking the cell lock, so queries do not
+	 * wait for management operations in progress.
 	 */
+	spin_lock(&cell_list_lock);
 	for_each_cell(cell)
 		if (cell->id == id) {
-			u32 state = cell->comm_page.comm_region.cell_state;
+			state = cell->comm_page.comm_region.cell_state;
 
 			switch (state) {
 			case JAILHOUSE_CELL_RUNNING:
 			case JAILHOUSE_CELL_RUNNING_LOCKED:
 			case JAILHOUSE_CELL_SHUT_DOWN:
 			case JAILHOUSE_CELL_FAILED:
-				return state;
+				break;
 			default:
-				return -EINVAL;
+				state = -EINVAL;
 			}
+			break;
 		}
-	return -ENOENT;
+	spin_unlock(&cell_list_lock);
+
+	return state;
 }
 
 static int shutdown(struct per_cpu *cpu_data)
@@ -641,12 +1239,22 @@ static int shutdown(struct per_cpu *cpu_data)
 	spin_lock(&shutdown_lock);
 
 	if (cpu_data->shutdown_state == SHUTDOWN_NONE) {
-		state = SHUTDOWN_STARTED;
-		for_each_non_root_cell(cell)
-			if (!cell_shutdown_ok(cell))
-				state = -EPERM;
-
-		if (state == SHUTDOWN_STARTED) {
+		if (spin_trylock(&reconfig_lock)) {
+			state = SHUTDOWN_STARTED;
+			for_each_non_root_cell(cell) {
+				spin_lock(&cell->lock);
+				if (!cell_shutdown_ok(cell))
+					state = -EPERM;
+			}
+		} else
+			state = -EBUSY;
+
+		if (state == -EPERM) {
+			for_each_non_root_cell(cell)
+				spin_unlock(&cell->lock);
+			spin_unlock(&reconfig_lock);
+		} else if (state == SHUTDOWN_STARTED) {
+			/* the locks stay taken, no management after this */
 			printk("Shutting down hypervisor\n");
 
 			for_each_non_root_cell(cell) {
@@ -695,6 +1303,8 @@ static long hypervisor_get_info(struct per_cpu *cpu_data, unsigned long type)
 		return remap_pool.used_pages;
 	case JAILHOUSE_INFO_NUM_CELLS:
 		return num_cells;
+	case JAILHOUSE_INFO_FAULT_LOG:
+		return (void *)&fault_log - (void *)&hypervisor_header;
 	default:
 		return -EINVAL;
 	}
@@ -749,6 +1359,8 @@ long hypercall(struct per_cpu *cpu_data, unsigned long code,
 		return cell_get_state(cpu_data, arg1);
 	case JAILHOUSE_HC_CPU_GET_INFO:
 		return cpu_get_info(cpu_data, arg1, arg2);
+	case JAILHOUSE_HC_CELL_RESTART:
+		return cell_restart(cpu_data, arg1);
 	default:
 		return -ENOSYS;
 	}
@@ -13,11 +13,29 @@
 #ifndef _JAILHOUSE_CELL_CONFIG_H
 #define _JAILHOUSE_CELL_CONFIG_H
 
+/*
+ * Incremented on every incompatible change of the configuration format.
+ * Revision 1: PCI device flags, message and heartbeat timeouts, state
+ * notification IRQ.
+ * Revision 2: irqchip id narrowed to 32 bits, followed by a pin_base.
+ */
+#define JAILHOUSE_CONFIG_REVISION	2
+
+#define JAILHOUSE_CELL_DESC_SIGNATURE	"JHCELL"
+#define JAILHOUSE_SYSTEM_SIGNATURE	"JHSYST"
+
 #define JAILHOUSE_CELL_NAME_MAXLEN	31
 
 #define JAILHOUSE_CELL_PASSIVE_COMMREG	0x00000001
+#define JAILHOUSE_CELL_SNAPSHOT		0x00000002
+/* ARM only: let WFI/WFE trap instead of executing them natively */
+#define JAILHOUSE_CELL_TRAP_WFI		0x00000004
+#define JAILHOUSE_CELL_TRAP_WFE		0x00000008
 
 struct jailhouse_cell_desc {
+	char signature[6];
+	__u16 revision;
+
 	char name[JAILHOUSE_CELL_NAME_MAXLEN+1];
 	__u32 flags;
 
@@ -27,6 +45,13 @@ struct jailhouse_cell_desc {
 	__u32 pio_bitmap_size;
 	__u32 num_pci_devices;
 	__u32 num_pci_caps;
+
+	/* in milliseconds, 0: wait indefinitely */
+	__u32 msg_reply_timeout;
+	/* in milliseconds, 0: no heartbeat monitoring */
+	__u32 heartbeat_period;
+	/* number of missed periods before the cell is stopped, 0 acts as 1 */
+	__u32 heartbeat_misses;
 } __attribute__((packed));
 
 #define JAILHOUSE_MEM_READ		0x0001
@@ -50,21 +75,32 @@ struct jailhouse_memory {
 	__u64 flags;
 } __attribute__((packed));
 
+/*
+ * Pins pin_base to pin_base + 63 of an interrupt controller. A controller with
+ * more pins is described by several entries of the same address. The pins of
+ * a GIC are its SPIs, pin 0 being interrupt 32. The pins of an IOAPIC are its
+ * redirection entries.
+ */
 struct jailhouse_irqchip {
 	__u64 address;
-	__u64 id;
+	__u32 id;
+	__u32 pin_base;
 	__u64 pin_bitmap;
 } __attribute__((packed));
 
 #define JAILHOUSE_PCI_TYPE_DEVICE	0x01
 #define JAILHOUSE_PCI_TYPE_BRIDGE	0x02
 
+/* map the device's MMCONFIG page read-only, only trap writes */
+#define JAILHOUSE_PCI_MMCONFIG_RO	0x0001
+
 struct jailhouse_pci_device {
 	__u32 type;
 	__u16 domain;
 	__u16 bdf;
 	__u16 caps_start;
 	__u16 num_caps;
+	__u16 flags;
 } __attribute__((packed));
 
 #define JAILHOUSE_PCICAPS_WRITE		0x0001
@@ -77,6 +113,9 @@ struct jailhouse_pci_capability {
 } __attribute__((packed));
 
 struct jailhouse_system {
+	char signature[6];
+	__u16 revision;
+
 	struct jailhouse_memory hypervisor_memory;
 	struct jailhouse_memory config_memory;
 	union {
@@ -84,6 +123,11 @@ struct jailhouse_system {
 			__u16 pm_timer_address;
 		} x86;
 	} platform_info;
+	/*
+	 * Interrupt raised in the root cell on cell state changes, 0: none.
+	 * x86: pin of the first IOAPIC, ARM: SPI interrupt ID
+	 */
+	__u32 state_notify_irq;
 	struct jailhouse_cell_desc root_cell;
 } __attribute__((packed));
 
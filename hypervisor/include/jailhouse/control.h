@@ -34,14 +34,29 @@ unsigned int next_cpu(unsigned int cpu, struct cpu_set *cpu_set,
 	     (cpu) <= (set)->max_cpu_id;			\
 	    )
 
+extern struct jailhouse_fault_log fault_log;
+extern spinlock_t cell_list_lock;
+
+#define for_each_cell(c)	for ((c) = &root_cell; (c); (c) = (c)->next)
+#define for_each_non_root_cell(c) \
+	for ((c) = root_cell.next; (c); (c) = (c)->next)
+
 bool cpu_id_valid(unsigned long cpu_id);
 
+bool fault_log_record(u16 segment, u16 source_id, u64 address, u8 reason,
+		      u8 type, u32 cell_id);
+void fault_log_drop(unsigned int count);
+
 int check_mem_regions(const struct jailhouse_cell_desc *config);
 int cell_init(struct cell *cell, bool copy_cpu_set);
 
 long hypercall(struct per_cpu *cpu_data, unsigned long code,
 	       unsigned long arg1, unsigned long arg2);
 
+#define CELL_MONITOR_INTERVAL_US	1000
+
+u64 cell_monitor_check(struct per_cpu *cpu_data);
+
 void __attribute__((noreturn)) panic_stop(struct per_cpu *cpu_data);
 void panic_halt(struct per_cpu *cpu_data);
 
@@ -51,12 +66,79 @@ void arch_reset_cpu(unsigned int cpu_id);
 void arch_park_cpu(unsigned int cpu_id);
 void arch_shutdown_cpu(unsigned int cpu_id);
 
+/**
+ * arch_cell_monitor_kick() - Make a CPU call cell_monitor_check() soon
+ * @cpu_id:	Root cell CPU that takes over or resumes the monitoring
+ *
+ * Architectures that do not trap the CPU regularly anyway have to arm an
+ * exit on @cpu_id at the time cell_monitor_check() returns.
+ */
+void arch_cell_monitor_kick(unsigned int cpu_id);
+
+/**
+ * arch_notify_root_cell() - Raise the state change interrupt of the root cell
+ *
+ * The interrupt is defined by state_notify_irq of the system configuration.
+ * Nothing is sent if it is not set, not owned by the root cell or not enabled
+ * by the root cell yet.
+ */
+void arch_notify_root_cell(void);
+
 int arch_map_memory_region(struct cell *cell,
 			   const struct jailhouse_memory *mem);
 int arch_unmap_memory_region(struct cell *cell,
 			     const struct jailhouse_memory *mem);
 
+/**
+ * arch_cell_create() - Prepare the architecture-specific state of a new cell
+ * @cpu_data:	Data structure of the calling CPU
+ * @cell:	Cell to be created
+ *
+ * Only the state private to @cell is set up, the root cell keeps running.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
 int arch_cell_create(struct per_cpu *cpu_data, struct cell *cell);
+
+/**
+ * arch_cell_assign_resources() - Hand resources of the root cell over
+ * @cpu_data:	Data structure of the calling CPU
+ * @cell:	Cell the resources are assigned to
+ *
+ * Must be called with all root cell CPUs except @cpu_data stopped and after
+ * the CPUs of @cell have been moved over. Partial assignments are undone via
+ * arch_cell_release_resources().
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+int arch_cell_assign_resources(struct per_cpu *cpu_data, struct cell *cell);
+
+/**
+ * arch_cell_release_resources() - Return resources of a cell to the root cell
+ * @cpu_data:	Data structure of the calling CPU
+ * @cell:	Cell releasing its resources
+ *
+ * Must be called with all root cell CPUs except @cpu_data stopped.
+ */
+void arch_cell_release_resources(struct per_cpu *cpu_data, struct cell *cell);
+
+/**
+ * arch_cell_reset_devices() - Reset the devices of a cell to be destroyed
+ * @cell:	Cell owning the devices
+ *
+ * Called with the CPUs of @cell suspended while the root cell is still
+ * running, so that lengthy reset delays do not stall the root cell.
+ */
+void arch_cell_reset_devices(struct cell *cell);
+
+/**
+ * arch_cell_reset() - Reset the architecture state of a cell
+ * @cell:	Cell to be (re)started
+ *
+ * Called with all CPUs of @cell stopped, before the first of them is reset.
+ */
+void arch_cell_reset(struct cell *cell);
+
 void arch_cell_destroy(struct per_cpu *cpu_data, struct cell *cell);
 
 void arch_config_commit(struct per_cpu *cpu_data,
@@ -21,6 +21,7 @@
 #define JAILHOUSE_HC_HYPERVISOR_GET_INFO	5
 #define JAILHOUSE_HC_CELL_GET_STATE		6
 #define JAILHOUSE_HC_CPU_GET_INFO		7
+#define JAILHOUSE_HC_CELL_RESTART		8
 
 /* Hypervisor information type */
 #define JAILHOUSE_INFO_MEM_POOL_SIZE		0
@@ -28,6 +29,7 @@
 #define JAILHOUSE_INFO_REMAP_POOL_SIZE		2
 #define JAILHOUSE_INFO_REMAP_POOL_USED		3
 #define JAILHOUSE_INFO_NUM_CELLS		4
+#define JAILHOUSE_INFO_FAULT_LOG		5
 
 /* Hypervisor information type */
 #define JAILHOUSE_CPU_INFO_STATE		0
@@ -62,11 +64,40 @@
 #define JAILHOUSE_CELL_SHUT_DOWN		2 /* terminal state */
 #define JAILHOUSE_CELL_FAILED			3 /* terminal state */
 
+/* number of records in the fault log */
+#define JAILHOUSE_FAULT_LOG_SIZE		64
+
+#define JAILHOUSE_FAULT_NO_CELL			0xffffffff
+
+/* fault record, repeated faults of a source update the same record */
+struct jailhouse_fault_record {
+	__u64 address;
+	__u32 count;
+	__u16 source_id;
+	__u8 reason;
+	__u8 type;
+	__u32 cell_id;
+	__u16 segment;
+	__u16 padding;
+} __attribute__((packed));
+
+/*
+ * Fault log, written by the hypervisor, readable by the root cell. The
+ * sequence counter is odd while the log is updated.
+ */
+struct jailhouse_fault_log {
+	volatile __u32 seq;
+	volatile __u32 next;
+	volatile __u32 dropped;
+	__u32 padding;
+	struct jailhouse_fault_record records[JAILHOUSE_FAULT_LOG_SIZE];
+} __attribute__((packed));
+
 #define COMM_REGION_GENERIC_HEADER		\
 	volatile __u32 msg_to_cell;		\
 	volatile __u32 reply_from_cell;		\
 	volatile __u32 cell_state;		\
-	volatile __u32 padding
+	volatile __u32 heartbeat
 
 #include <asm/jailhouse_hypercall.h>
 
@@ -15,24 +15,123 @@
 #define _JAILHOUSE_PCI_H
 
 #include <asm/cell.h>
+#include <asm/spinlock.h>
 
 #define PCI_BUS(bdf)		((bdf) >> 8)
 #define PCI_DEVFN(bdf)		((bdf) & 0xff)
 #define PCI_BDF_PARAMS(bdf)	(bdf) >> 8, ((bdf) >> 3) & 0x1f, (bdf) & 7
 
+#define PCI_CAP_MSI		0x05
+#define PCI_CAP_EXP		0x10
+#define PCI_CAP_MSIX		0x11
+
+#define PCI_CONFIG_HEADER_SIZE	0x40
+#define PCI_STD_CONFIG_SIZE	0x100
+#define PCI_CONFIG_SPACE_SIZE	0x1000
+
+#define PCI_NUM_BARS		6
+
+/* size of the largest MSI capability (64-bit, maskable), in dwords */
+#define PCI_MSI_REGS		6
+
 enum pci_access { PCI_ACCESS_REJECT, PCI_ACCESS_PERFORM, PCI_ACCESS_DONE };
 
+/* layout of an MSI-X vector table entry as found in hardware */
+struct pci_msix_vector {
+	u64 address;
+	u32 data;
+	u32 ctrl;
+} __attribute__((packed));
+
+/**
+ * struct pci_device - PCI device state
+ * @info:		Static device description from the cell configuration
+ * @cell:		Owning cell, NULL if not (yet) assigned
+ * @header_write_mask:	Writable bits of the config space header, per dword,
+ * 			NULL if the header is read-only
+ * @cap_write_bitmap:	Writable bytes of the config space beyond the header
+ * @header_ro_mask:	Immutable bits of the config space header, per dword,
+ * 			NULL if nothing is shadowed
+ * @cap_hdr_bitmap:	Dwords between header and extended config space that
+ * 			start a capability, bit 0 corresponding to
+ * 			PCI_CONFIG_HEADER_SIZE
+ * @cfg_shadow:		Shadow of the immutable standard config space fields
+ * @cfg_shadow_valid:	True if @cfg_shadow has been filled
+ * @bar_size_mask:	BAR values read back after writing all ones, probed
+ * 			with decoding disabled before the cell starts
+ * @bar_size_valid:	Bitmap of BARs with a valid @bar_size_mask entry
+ * @bar_sizing:		Bitmap of BARs the cell is currently sizing
+ * @bar_saved:		Programmed BAR values while sizing them on the
+ * 			hardware, used if @mmcfg_mapped
+ * @mmcfg_mapped:	True if the MMCONFIG page is mapped read-only into
+ * 			the owning cell
+ * @reset_method:	Reset applied while the device leaves its cell
+ * @reset_cap:		Config space address of the capability used for
+ * 			resetting the device
+ * @saved_header:	Config space header saved across the reset
+ * @msi_cap:		Config space address of MSI capability, 0 if none
+ * @msi_cap_len:	Length of the MSI capability as configured
+ * @msi_regs:		Shadow of the MSI capability registers
+ * @msix_cap:		Config space address of MSI-X capability, 0 if none
+ * @msix_cap_len:	Length of the MSI-X capability as configured
+ * @msix_ctrl:		Shadow of the MSI-X message control register
+ * @msix_num_vectors:	Number of MSI-X vector table entries
+ * @msix_table_phys:	Physical address of the MSI-X vector table
+ * @msix_table_gphys:	Guest-physical address of the trapped vector table,
+ * 			0 if the table is not mapped into the owning cell
+ * @msix_table:		Hypervisor mapping of the MSI-X vector table
+ * @msix_vectors:	Shadow of the MSI-X vector table, filled on first use
+ * @msix_shadow_valid:	True if @msix_vectors reflects the hardware state
+ * @msi_lock:		Serializes updates of the MSI and MSI-X shadow state
+ */
 struct pci_device {
 	const struct jailhouse_pci_device *info;
 	struct cell *cell;
+
+	const u32 *header_write_mask;
+	unsigned long cap_write_bitmap[PCI_CONFIG_SPACE_SIZE /
+				       (sizeof(unsigned long) * 8)];
+
+	const u32 *header_ro_mask;
+	u64 cap_hdr_bitmap;
+	u32 cfg_shadow[PCI_STD_CONFIG_SIZE / 4];
+	bool cfg_shadow_valid;
+
+	u32 bar_size_mask[PCI_NUM_BARS];
+	u8 bar_size_valid;
+	u8 bar_sizing;
+	u32 bar_saved[PCI_NUM_BARS];
+
+	bool mmcfg_mapped;
+
+	u8 reset_method;
+	u16 reset_cap;
+	u32 saved_header[PCI_CONFIG_HEADER_SIZE / 4];
+
+	u16 msi_cap;
+	u16 msi_cap_len;
+	u32 msi_regs[PCI_MSI_REGS];
+
+	u16 msix_cap;
+	u16 msix_cap_len;
+	u16 msix_ctrl;
+	unsigned int msix_num_vectors;
+	u64 msix_table_phys;
+	u64 msix_table_gphys;
+	void *msix_table;
+	struct pci_msix_vector *msix_vectors;
+	bool msix_shadow_valid;
+	spinlock_t msi_lock;
 };
 
 int pci_init(void);
 
-u32 pci_read_config(u16 bdf, u16 address, unsigned int size);
-void pci_write_config(u16 bdf, u16 address, u32 value, unsigned int size);
+u32 pci_read_config(u16 domain, u16 bdf, u16 address, unsigned int size);
+void pci_write_config(u16 domain, u16 bdf, u16 address, u32 value,
+		      unsigned int size);
 
-struct pci_device *pci_get_assigned_device(const struct cell *cell, u16 bdf);
+struct pci_device *pci_get_assigned_device(const struct cell *cell,
+					   u16 domain, u16 bdf);
 
 enum pci_access pci_cfg_read_moderate(struct pci_device *device, u16 address,
 				      unsigned int size, u32 *value);
@@ -43,12 +142,17 @@ int pci_mmio_access_handler(const struct cell *cell, bool is_write, u64 addr,
 			    u32 *value);
 
 int pci_cell_init(struct cell *cell);
+void pci_reset_devices(struct cell *cell);
 void pci_cell_exit(struct cell *cell);
 
+void pci_config_commit(struct cell *cell_added_removed);
+
 u32 arch_pci_read_config(u16 bdf, u16 address, unsigned int size);
 void arch_pci_write_config(u16 bdf, u16 address, u32 value, unsigned int size);
 
 int arch_pci_add_device(struct cell *cell, struct pci_device *device);
 void arch_pci_remove_device(struct pci_device *device);
 
+bool arch_pci_msi_valid(const struct cell *cell, u64 address, u32 data);
+
 #endif /* !_JAILHOUSE_PCI_H */
@@ -13,3 +13,36 @@
 #include <asm/processor.h>
 
 int phys_processor_id(void);
+
+/**
+ * arch_get_time_us() - Read the monotonic hypervisor time
+ *
+ * Return: Time in microseconds since an arbitrary point in the past.
+ */
+u64 arch_get_time_us(void);
+
+/**
+ * arch_monitor_address() - Arm wake-up on writes to a memory location
+ * @addr:	Address to be monitored
+ *
+ * A subsequent arch_wait_for_monitor() returns if @addr, or any location in
+ * the same architecture-defined granule, was written after this call. The
+ * caller has to check its wait condition between both calls.
+ */
+void arch_monitor_address(const volatile void *addr);
+
+/**
+ * arch_wait_for_monitor() - Wait in low-power state for a monitored write
+ *
+ * May also return on unrelated events. Waits are bounded by the
+ * architecture, so callers can implement timeouts by re-checking the time.
+ */
+void arch_wait_for_monitor(void);
+
+static inline void delay_us(unsigned long microsecs)
+{
+	u64 end = arch_get_time_us() + microsecs;
+
+	while (arch_get_time_us() < end)
+		cpu_relax();
+}
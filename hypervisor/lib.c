@@ -22,6 +22,16 @@ void *memset(void *s, int c, unsigned long n)
 	return s;
 }
 
+int memcmp(const void *s1, const void *s2, unsigned long n)
+{
+	const u8 *p1 = s1, *p2 = s2;
+
+	for (; n > 0; n--, p1++, p2++)
+		if (*p1 != *p2)
+			return *p1 - *p2;
+	return 0;
+}
+
 int strcmp(const char *s1, const char *s2)
 {
 	while (*s1 == *s2) {
@@ -16,13 +16,71 @@
 #include <jailhouse/mmio.h>
 #include <jailhouse/pci.h>
 #include <jailhouse/printk.h>
+#include <jailhouse/processor.h>
+#include <jailhouse/string.h>
 #include <jailhouse/utils.h>
 
-#define PCI_CONFIG_HEADER_SIZE		0x40
+#define PCI_CFG_VENDOR_ID		0x00
 
 #define PCI_CFG_COMMAND			0x04
+# define PCI_CMD_IO			(1 << 0)
+# define PCI_CMD_MEM			(1 << 1)
 # define PCI_CMD_INTX_OFF		(1 << 10)
 
+#define PCI_CFG_STATUS			0x06
+# define PCI_STS_CAPS			(1 << 4)
+
+#define PCI_CFG_BAR			0x10
+# define PCI_BAR_MEM_TYPE_MASK		BIT_MASK(2, 1)
+# define PCI_BAR_MEM_TYPE_64		(2 << 1)
+# define PCI_BAR_MEM_ADDR_MASK		(~0xfULL)
+#define PCI_NUM_BRIDGE_BARS		2
+
+#define PCI_CFG_BUS_NUMBERS		0x18
+#define PCI_CFG_CAP_PTR			0x34
+#define PCI_CFG_BRIDGE_CTRL		0x3e
+# define PCI_BRIDGE_CTL_BUS_RESET	(1 << 6)
+
+#define PCI_EXP_DEVCAP			0x04
+# define PCI_EXP_DEVCAP_FLR		(1 << 28)
+#define PCI_EXP_DEVCTL			0x08
+# define PCI_EXP_DEVCTL_BCR_FLR		(1 << 15)
+#define PCI_EXP_DEVSTA			0x0a
+# define PCI_EXP_DEVSTA_TRPND		(1 << 5)
+
+#define PCI_RESET_NONE			0
+#define PCI_RESET_FLR			1
+#define PCI_RESET_BUS			2
+
+/* timings according to PCIe base spec, sections 6.6.1 and 6.6.2 */
+#define PCI_RESET_PENDING_TIMEOUT_US	100000
+#define PCI_RESET_ASSERT_US		2000
+#define PCI_RESET_RECOVERY_US		100000
+#define PCI_RESET_READY_TIMEOUT_US	1000000
+
+/* vendor ID reported while a device answers with Configuration Retry */
+#define PCI_VENDOR_ID_CRS		0x0001
+
+/* immutable part of a standard capability header: ID and next pointer */
+#define PCI_CAP_HDR_MASK		0x0000ffff
+
+#define PCI_MSI_CTRL_ENABLE		(1 << 0)
+#define PCI_MSI_CTRL_MME_MASK		BIT_MASK(6, 4)
+#define PCI_MSI_CTRL_64BIT		(1 << 7)
+#define PCI_MSI_CTRL_MASKABLE		(1 << 8)
+#define PCI_MSI_CTRL_RW_MASK		(PCI_MSI_CTRL_ENABLE | \
+					 PCI_MSI_CTRL_MME_MASK)
+
+#define PCI_MSIX_CTRL_TABLE_SIZE	BIT_MASK(10, 0)
+#define PCI_MSIX_CTRL_FMASK		(1 << 14)
+#define PCI_MSIX_CTRL_ENABLE		(1 << 15)
+#define PCI_MSIX_CTRL_RW_MASK		(PCI_MSIX_CTRL_FMASK | \
+					 PCI_MSIX_CTRL_ENABLE)
+#define PCI_MSIX_TABLE_REG		0x04
+# define PCI_MSIX_BIR_MASK		BIT_MASK(2, 0)
+
+#define PCI_MSIX_VECTOR_MASKED		(1 << 0)
+
 struct acpi_mcfg_alloc {
 	u64 base_addr;
 	u16 segment_num;
@@ -37,56 +95,109 @@ struct acpi_mcfg_table {
 	struct acpi_mcfg_alloc alloc_structs[];
 } __attribute__((packed));
 
+#define PCI_DEVICE_HASH_MULT		0x9e3779b1U
+
 #define for_each_configured_pci_device(dev, cell)			\
 	for ((dev) = (cell)->pci_devices;				\
 	     (dev) - (cell)->pci_devices < (cell)->config->num_pci_devices; \
 	     (dev)++)
 
-/* entry for PCI config space whitelist (granting access) */
-struct pci_cfg_access {
-	u32 reg_num; /** Register number (4-byte aligned) */
-	u32 mask; /** Bit set: access allowed */
+/*
+ * --- Whitelist for writing to PCI config space header registers ---
+ * Indexed by register number / 4, bit set: access allowed
+ */
+/* Type 1: Endpoints */
+static const u32 endpoint_write_mask[PCI_CONFIG_HEADER_SIZE / 4] = {
+	[0x04 / 4] = 0xffffffff, /* Command, Status */
+	[0x0c / 4] = 0xff00ffff, /* BIST, Latency Timer, Cacheline */
+	[0x3c / 4] = 0x000000ff, /* Int Line */
+};
+/* Type 2: Bridges */
+static const u32 bridge_write_mask[PCI_CONFIG_HEADER_SIZE / 4] = {
+	[0x04 / 4] = 0xffffffff, /* Command, Status */
+	[0x0c / 4] = 0xff00ffff, /* BIST, Latency Timer, Cacheline */
+	[0x3c / 4] = 0xffff00ff, /* Int Line, Bridge Control */
 };
 
-/* --- Whilelist for writing to PCI config space registers --- */
+/*
+ * --- Config space header bits that never change and can be shadowed ---
+ * Indexed by register number / 4
+ */
 /* Type 1: Endpoints */
-static const struct pci_cfg_access endpoint_write_access[] = {
-	{ 0x04, 0xffffffff }, /* Command, Status */
-	{ 0x0c, 0xff00ffff }, /* BIST, Latency Timer, Cacheline */
-	{ 0x3c, 0x000000ff }, /* Int Line */
+static const u32 endpoint_ro_mask[PCI_CONFIG_HEADER_SIZE / 4] = {
+	[0x00 / 4] = 0xffffffff, /* Vendor ID, Device ID */
+	[0x08 / 4] = 0xffffffff, /* Revision ID, Class Code */
+	[0x0c / 4] = 0x00ff0000, /* Header Type */
+	[0x2c / 4] = 0xffffffff, /* Subsystem Vendor ID, Subsystem ID */
+	[0x34 / 4] = 0xffffffff, /* Capabilities Pointer */
+	[0x3c / 4] = 0xffffff00, /* Int Pin, Min Gnt, Max Lat */
 };
 /* Type 2: Bridges */
-static const struct pci_cfg_access bridge_write_access[] = {
-	{ 0x04, 0xffffffff }, /* Command, Status */
-	{ 0x0c, 0xff00ffff }, /* BIST, Latency Timer, Cacheline */
-	{ 0x3c, 0xffff00ff }, /* Int Line, Bridge Control */
+static const u32 bridge_ro_mask[PCI_CONFIG_HEADER_SIZE / 4] = {
+	[0x00 / 4] = 0xffffffff, /* Vendor ID, Device ID */
+	[0x08 / 4] = 0xffffffff, /* Revision ID, Class Code */
+	[0x0c / 4] = 0x00ff0000, /* Header Type */
+	[0x34 / 4] = 0xffffffff, /* Capabilities Pointer */
+	[0x3c / 4] = 0x0000ff00, /* Int Pin */
+};
+
+/* maximum number of MCFG allocations, a segment may be split over several */
+#define PCI_MAX_MMCFG_REGIONS		16
+
+struct pci_mmcfg_region {
+	void *space; /** Mapping of the region, biased to bus 0 */
+	u64 base_addr; /** Physical address of bus 0 */
+	u16 segment;
+	u8 start_bus;
+	u8 end_bus;
 };
 
-static void *pci_space;
-static u64 pci_mmcfg_addr;
-static u32 pci_mmcfg_size;
-static u8 end_bus;
+static struct pci_mmcfg_region pci_mmcfg[PCI_MAX_MMCFG_REGIONS];
+static unsigned int pci_mmcfg_regions;
 
-static void *pci_get_device_mmcfg_base(u16 bdf)
+static struct pci_mmcfg_region *pci_mmcfg_find(u16 domain, u8 bus)
 {
-	return pci_space + ((unsigned long)bdf << 12);
+	struct pci_mmcfg_region *mmcfg;
+
+	for (mmcfg = pci_mmcfg; mmcfg < pci_mmcfg + pci_mmcfg_regions; mmcfg++)
+		if (mmcfg->segment == domain && bus >= mmcfg->start_bus &&
+		    bus <= mmcfg->end_bus)
+			return mmcfg;
+
+	return NULL;
+}
+
+static void *pci_get_device_mmcfg_base(u16 domain, u16 bdf)
+{
+	struct pci_mmcfg_region *mmcfg = pci_mmcfg_find(domain, PCI_BUS(bdf));
+
+	if (!mmcfg)
+		return NULL;
+
+	return mmcfg->space + ((unsigned long)bdf << 12);
 }
 
 /**
  * pci_read_config() - Read from PCI config space
+ * @domain:	PCI segment of target
  * @bdf:	16-bit bus/device/function ID of target
  * @address:	Config space access address
  * @size:	Access size (1, 2 or 4 bytes)
  *
  * Return: read value
  */
-u32 pci_read_config(u16 bdf, u16 address, unsigned int size)
+u32 pci_read_config(u16 domain, u16 bdf, u16 address, unsigned int size)
 {
-	void *mmcfg_addr = pci_get_device_mmcfg_base(bdf) + address;
+	void *mmcfg_addr = pci_get_device_mmcfg_base(domain, bdf);
 
-	if (!pci_space || PCI_BUS(bdf) > end_bus)
+	if (!mmcfg_addr) {
+		/* legacy config space access can only reach segment 0 */
+		if (domain != 0)
+			return -1;
 		return arch_pci_read_config(bdf, address, size);
+	}
 
+	mmcfg_addr += address;
 	if (size == 1)
 		return mmio_read8(mmcfg_addr);
 	else if (size == 2)
@@ -97,18 +208,24 @@ u32 pci_read_config(u16 bdf, u16 address, unsigned int size)
 
 /**
  * pci_write_config() - Write to PCI config space
+ * @domain:	PCI segment of target
  * @bdf:	16-bit bus/device/function ID of target
  * @address:	Config space access address
  * @value:	Value to be written
  * @size:	Access size (1, 2 or 4 bytes)
  */
-void pci_write_config(u16 bdf, u16 address, u32 value, unsigned int size)
+void pci_write_config(u16 domain, u16 bdf, u16 address, u32 value,
+		      unsigned int size)
 {
-	void *mmcfg_addr = pci_get_device_mmcfg_base(bdf) + address;
+	void *mmcfg_addr = pci_get_device_mmcfg_base(domain, bdf);
 
-	if (!pci_space || PCI_BUS(bdf) > end_bus)
-		return arch_pci_write_config(bdf, address, value, size);
+	if (!mmcfg_addr) {
+		if (domain == 0)
+			arch_pci_write_config(bdf, address, value, size);
+		return;
+	}
 
+	mmcfg_addr += address;
 	if (size == 1)
 		mmio_write8(mmcfg_addr, value);
 	else if (size == 2)
@@ -117,49 +234,672 @@ void pci_write_config(u16 bdf, u16 address, u32 value, unsigned int size)
 		mmio_write32(mmcfg_addr, value);
 }
 
+static unsigned int pci_device_hash(const struct cell *cell, u16 domain,
+				    u16 bdf)
+{
+	u32 key = ((u32)domain << 16) | bdf;
+
+	return (key * PCI_DEVICE_HASH_MULT) >> (32 - cell->pci_device_hash_bits);
+}
+
+/**
+ * pci_lookup_device() - Look up device configured for a cell
+ * @cell:	Cell to search in
+ * @domain:	PCI segment of the device
+ * @bdf:	16-bit bus/device/function ID
+ *
+ * Return: Pointer to device state, independent of ownership, or NULL.
+ */
+static struct pci_device *pci_lookup_device(const struct cell *cell,
+					    u16 domain, u16 bdf)
+{
+	struct pci_device *device;
+	unsigned int mask, n;
+
+	if (!cell->pci_device_hash)
+		return NULL;
+
+	mask = (1 << cell->pci_device_hash_bits) - 1;
+	for (n = pci_device_hash(cell, domain, bdf);
+	     (device = cell->pci_device_hash[n]) != NULL; n = (n + 1) & mask)
+		if (device->info->bdf == bdf && device->info->domain == domain)
+			return device;
+
+	return NULL;
+}
+
 /**
  * pci_get_assigned_device() - Look up device owned by a cell
  * @cell:	Owning cell
+ * @domain:	PCI segment of the device
  * @bdf:	16-bit bus/device/function ID
  *
  * Return: Pointer to owned PCI device or NULL.
  */
-struct pci_device *pci_get_assigned_device(const struct cell *cell, u16 bdf)
+struct pci_device *pci_get_assigned_device(const struct cell *cell,
+					   u16 domain, u16 bdf)
 {
-	const struct jailhouse_pci_device *dev_info =
-		jailhouse_cell_pci_devices(cell->config);
-	u32 n;
+	struct pci_device *device = pci_lookup_device(cell, domain, bdf);
+
+	return device && device->cell ? device : NULL;
+}
 
-	/* We iterate over the static device information to increase cache
-	 * locality. */
-	for (n = 0; n < cell->config->num_pci_devices; n++)
-		if (dev_info[n].bdf == bdf)
-			return cell->pci_devices[n].cell ?
-				&cell->pci_devices[n] : NULL;
+static unsigned int pci_device_hash_pages(const struct cell *cell)
+{
+	return PAGE_ALIGN(sizeof(struct pci_device *) <<
+			  cell->pci_device_hash_bits) / PAGE_SIZE;
+}
 
-	return NULL;
+/* the hash is kept at most half full so that probing always terminates */
+static int pci_device_hash_init(struct cell *cell)
+{
+	unsigned int bits = 1, mask, n;
+	struct pci_device *device;
+
+	while ((1U << bits) < cell->config->num_pci_devices * 2)
+		bits++;
+	cell->pci_device_hash_bits = bits;
+	mask = (1 << bits) - 1;
+
+	cell->pci_device_hash = page_alloc(&mem_pool,
+					   pci_device_hash_pages(cell));
+	if (!cell->pci_device_hash)
+		return -ENOMEM;
+
+	for_each_configured_pci_device(device, cell) {
+		n = pci_device_hash(cell, device->info->domain,
+				    device->info->bdf);
+		while (cell->pci_device_hash[n])
+			n = (n + 1) & mask;
+		cell->pci_device_hash[n] = device;
+	}
+
+	return 0;
+}
+
+static void pci_device_hash_exit(struct cell *cell)
+{
+	if (!cell->pci_device_hash)
+		return;
+
+	page_free(&mem_pool, cell->pci_device_hash,
+		  pci_device_hash_pages(cell));
+	cell->pci_device_hash = NULL;
 }
 
 /**
- * pci_find_capability() - Look up capability at given config space address
+ * pci_cfg_writable() - Check write permission beyond the config space header
  * @device:	The device to be accessed
  * @address:	Config space access address
+ * @size:	Access size (1, 2 or 4 bytes)
  *
- * Return: Corresponding capability structure or NULL if none found.
+ * Return: True if all accessed bytes belong to writable capabilities.
  */
-static const struct jailhouse_pci_capability *
-pci_find_capability(struct pci_device *device, u16 address)
+static bool pci_cfg_writable(const struct pci_device *device, u16 address,
+			     unsigned int size)
 {
-	const struct jailhouse_pci_capability *cap =
-		jailhouse_cell_pci_caps(device->cell->config) +
-		device->info->caps_start;
-	u32 n;
+	unsigned int n;
 
-	for (n = 0; n < device->info->num_caps; n++, cap++)
-		if (cap->start <= address && cap->start + cap->len > address)
-			return cap;
+	if (address + size > PCI_CONFIG_SPACE_SIZE)
+		return false;
 
-	return NULL;
+	for (n = 0; n < size; n++)
+		if (!test_bit(address + n, device->cap_write_bitmap))
+			return false;
+	return true;
+}
+
+/**
+ * pci_merge_value() - Merge a sub-dword write into a register value
+ * @old:	Current 32-bit register value
+ * @address:	Config space address of the write
+ * @size:	Access size (1, 2 or 4 bytes)
+ * @value:	Value to be written
+ *
+ * Return: Register value after the write.
+ */
+static u32 pci_merge_value(u32 old, u16 address, unsigned int size, u32 value)
+{
+	unsigned int bias_shift = (address & 0x3) * 8;
+	u32 mask = BYTE_MASK(size) << bias_shift;
+
+	return (old & ~mask) | ((value << bias_shift) & mask);
+}
+
+static unsigned int pci_msi_data_reg(u16 ctrl)
+{
+	return (ctrl & PCI_MSI_CTRL_64BIT) ? 3 : 2;
+}
+
+/* number of shadowed MSI registers, pending bits are always read directly */
+static unsigned int pci_msi_num_regs(u16 ctrl)
+{
+	return pci_msi_data_reg(ctrl) + 1 +
+		((ctrl & PCI_MSI_CTRL_MASKABLE) ? 1 : 0);
+}
+
+static u64 pci_msi_address(const u32 *regs, u16 ctrl)
+{
+	u64 address = regs[1];
+
+	if (ctrl & PCI_MSI_CTRL_64BIT)
+		address |= (u64)regs[2] << 32;
+	return address;
+}
+
+static void pci_msi_init(struct pci_device *device)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	unsigned int n, num_regs;
+
+	device->msi_regs[0] = pci_read_config(domain, bdf, device->msi_cap, 4);
+	num_regs = pci_msi_num_regs(device->msi_regs[0] >> 16);
+	for (n = 1; n < num_regs; n++)
+		device->msi_regs[n] = pci_read_config(domain, bdf,
+						      device->msi_cap + n * 4,
+						      4);
+}
+
+/**
+ * pci_msi_read() - Emulate read access to the MSI capability
+ * @device:	The device to be accessed
+ * @address:	Config space address
+ * @size:	Access size (1, 2 or 4 bytes)
+ * @value:	Pointer to buffer to receive the emulated value
+ *
+ * Return: PCI_ACCESS_PERFORM or PCI_ACCESS_DONE.
+ */
+static enum pci_access pci_msi_read(struct pci_device *device, u16 address,
+				    unsigned int size, u32 *value)
+{
+	unsigned int reg = (address - device->msi_cap) / 4;
+
+	if (reg >= pci_msi_num_regs(device->msi_regs[0] >> 16))
+		return PCI_ACCESS_PERFORM;
+
+	*value = (device->msi_regs[reg] >> ((address & 0x3) * 8)) &
+		BYTE_MASK(size);
+	return PCI_ACCESS_DONE;
+}
+
+/**
+ * pci_msi_write() - Emulate write access to the MSI capability
+ * @device:	The device to be accessed
+ * @address:	Config space address
+ * @size:	Access size (1, 2 or 4 bytes)
+ * @value:	Value to be written
+ *
+ * Writes are applied to the shadow registers first. Only if the resulting
+ * message is either disabled or targets the device's cell, it is forwarded to
+ * the hardware. Writes that do not change the shadow state, specifically
+ * repeated masking or unmasking, do not reach the device.
+ *
+ * Return: PCI_ACCESS_REJECT or PCI_ACCESS_DONE.
+ */
+static enum pci_access pci_msi_write(struct pci_device *device, u16 address,
+				     unsigned int size, u32 value)
+{
+	unsigned int reg = (address - device->msi_cap) / 4;
+	enum pci_access access = PCI_ACCESS_DONE;
+	u32 regs[PCI_MSI_REGS];
+	unsigned int data_reg;
+	u16 ctrl;
+
+	spin_lock(&device->msi_lock);
+
+	ctrl = device->msi_regs[0] >> 16;
+	/* pending bits are read-only */
+	if (reg >= pci_msi_num_regs(ctrl))
+		goto out;
+
+	memcpy(regs, device->msi_regs, sizeof(regs));
+	regs[reg] = pci_merge_value(regs[reg], address, size, value);
+	/* only enable and multiple message enable are writable in control */
+	if (reg == 0)
+		regs[0] = (device->msi_regs[0] &
+			   ~(PCI_MSI_CTRL_RW_MASK << 16)) |
+			(regs[0] & (PCI_MSI_CTRL_RW_MASK << 16));
+
+	if (regs[reg] == device->msi_regs[reg])
+		goto out;
+
+	ctrl = regs[0] >> 16;
+	data_reg = pci_msi_data_reg(ctrl);
+	/* mask bit updates cannot redirect the message */
+	if (reg != data_reg + 1 && ctrl & PCI_MSI_CTRL_ENABLE &&
+	    !arch_pci_msi_valid(device->cell, pci_msi_address(regs, ctrl),
+				regs[data_reg])) {
+		access = PCI_ACCESS_REJECT;
+		goto out;
+	}
+
+	device->msi_regs[reg] = regs[reg];
+	pci_write_config(device->info->domain, device->info->bdf,
+			 device->msi_cap + reg * 4, regs[reg], 4);
+
+out:
+	spin_unlock(&device->msi_lock);
+	return access;
+}
+
+static unsigned int pci_msix_table_pages(struct pci_device *device)
+{
+	return PAGE_ALIGN((device->msix_table_phys & ~PAGE_MASK) +
+			  device->msix_num_vectors *
+			  sizeof(struct pci_msix_vector)) / PAGE_SIZE;
+}
+
+static unsigned int pci_msix_shadow_pages(struct pci_device *device)
+{
+	return PAGE_ALIGN(device->msix_num_vectors *
+			  sizeof(struct pci_msix_vector)) / PAGE_SIZE;
+}
+
+static int pci_msix_init(struct pci_device *device)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	unsigned int bar, pages;
+	u32 table_reg;
+	u64 bar_addr;
+	int err;
+
+	device->msix_ctrl = pci_read_config(domain, bdf, device->msix_cap + 2,
+					    2);
+	device->msix_num_vectors =
+		(device->msix_ctrl & PCI_MSIX_CTRL_TABLE_SIZE) + 1;
+
+	table_reg = pci_read_config(domain, bdf,
+				    device->msix_cap + PCI_MSIX_TABLE_REG, 4);
+	bar = table_reg & PCI_MSIX_BIR_MASK;
+	if (bar >= PCI_NUM_BARS)
+		return -EINVAL;
+
+	bar_addr = pci_read_config(domain, bdf, PCI_CFG_BAR + bar * 4, 4);
+	if ((bar_addr & PCI_BAR_MEM_TYPE_MASK) == PCI_BAR_MEM_TYPE_64) {
+		if (bar + 1 >= PCI_NUM_BARS)
+			return -EINVAL;
+		bar_addr |= (u64)pci_read_config(domain, bdf,
+						 PCI_CFG_BAR + bar * 4 + 4,
+						 4) << 32;
+	}
+	device->msix_table_phys = (bar_addr & PCI_BAR_MEM_ADDR_MASK) +
+		(table_reg & ~PCI_MSIX_BIR_MASK);
+
+	device->msix_vectors = page_alloc(&mem_pool,
+					  pci_msix_shadow_pages(device));
+	if (!device->msix_vectors)
+		return -ENOMEM;
+
+	pages = pci_msix_table_pages(device);
+	device->msix_table = page_alloc(&remap_pool, pages);
+	if (!device->msix_table) {
+		err = -ENOMEM;
+		goto error_free_shadow;
+	}
+
+	err = page_map_create(&hv_paging_structs,
+			      device->msix_table_phys & PAGE_MASK,
+			      pages * PAGE_SIZE,
+			      (unsigned long)device->msix_table,
+			      PAGE_DEFAULT_FLAGS | PAGE_FLAG_UNCACHED,
+			      PAGE_MAP_NON_COHERENT);
+	if (err)
+		goto error_free_table;
+
+	device->msix_table += device->msix_table_phys & ~PAGE_MASK;
+	device->msix_table_gphys = 0;
+	device->msix_shadow_valid = false;
+
+	return 0;
+
+error_free_table:
+	page_free(&remap_pool, device->msix_table, pages);
+error_free_shadow:
+	page_free(&mem_pool, device->msix_vectors,
+		  pci_msix_shadow_pages(device));
+	device->msix_vectors = NULL;
+	return err;
+}
+
+static void pci_msix_exit(struct pci_device *device)
+{
+	unsigned int pages = pci_msix_table_pages(device);
+	void *table_page = (void *)((unsigned long)device->msix_table &
+				    PAGE_MASK);
+
+	if (!device->msix_vectors)
+		return;
+
+	page_map_destroy(&hv_paging_structs, (unsigned long)table_page,
+			 pages * PAGE_SIZE, PAGE_MAP_NON_COHERENT);
+	page_free(&remap_pool, table_page, pages);
+	page_free(&mem_pool, device->msix_vectors,
+		  pci_msix_shadow_pages(device));
+	device->msix_vectors = NULL;
+	device->msix_table_gphys = 0;
+}
+
+/* fill the vector table shadow on first use, caller holds msi_lock */
+static void pci_msix_sync_shadow(struct pci_device *device)
+{
+	u32 *shadow = (u32 *)device->msix_vectors;
+	u32 *table = device->msix_table;
+	unsigned int n;
+
+	if (device->msix_shadow_valid)
+		return;
+
+	for (n = 0; n < device->msix_num_vectors *
+	     sizeof(struct pci_msix_vector) / 4; n++)
+		shadow[n] = mmio_read32(&table[n]);
+
+	device->msix_shadow_valid = true;
+}
+
+static bool pci_msix_vector_valid(struct pci_device *device, u16 ctrl,
+				  const struct pci_msix_vector *vector)
+{
+	if (!(ctrl & PCI_MSIX_CTRL_ENABLE) || ctrl & PCI_MSIX_CTRL_FMASK ||
+	    vector->ctrl & PCI_MSIX_VECTOR_MASKED)
+		return true;
+
+	return arch_pci_msi_valid(device->cell, vector->address,
+				  vector->data);
+}
+
+/**
+ * pci_msix_write() - Emulate write access to the MSI-X capability
+ * @device:	The device to be accessed
+ * @address:	Config space address
+ * @size:	Access size (1, 2 or 4 bytes)
+ * @value:	Value to be written
+ *
+ * Return: PCI_ACCESS_REJECT or PCI_ACCESS_DONE.
+ */
+static enum pci_access pci_msix_write(struct pci_device *device, u16 address,
+				      unsigned int size, u32 value)
+{
+	enum pci_access access = PCI_ACCESS_DONE;
+	unsigned int n;
+	u16 ctrl;
+
+	/* table and PBA location registers are read-only */
+	if (address - device->msix_cap >= 4)
+		return PCI_ACCESS_DONE;
+
+	spin_lock(&device->msi_lock);
+
+	ctrl = pci_merge_value((u32)device->msix_ctrl << 16, address, size,
+			       value) >> 16;
+	ctrl = (device->msix_ctrl & ~PCI_MSIX_CTRL_RW_MASK) |
+		(ctrl & PCI_MSIX_CTRL_RW_MASK);
+
+	if (ctrl == device->msix_ctrl)
+		goto out;
+
+	pci_msix_sync_shadow(device);
+	for (n = 0; n < device->msix_num_vectors; n++)
+		if (!pci_msix_vector_valid(device, ctrl,
+					   &device->msix_vectors[n])) {
+			access = PCI_ACCESS_REJECT;
+			goto out;
+		}
+
+	device->msix_ctrl = ctrl;
+	pci_write_config(device->info->domain, device->info->bdf,
+			 device->msix_cap + 2, ctrl, 2);
+
+out:
+	spin_unlock(&device->msi_lock);
+	return access;
+}
+
+/**
+ * pci_msix_table_access() - Emulate access to trapped MSI-X table pages
+ * @device:	Device owning the vector table
+ * @is_write:	True if write access
+ * @addr:	Guest-physical address accessed
+ * @value:	Pointer to value for reading/writing
+ *
+ * Vector entries are served from the shadow table. Writes are validated and
+ * only forwarded to the hardware if they change the entry. Accesses to other
+ * registers sharing the table pages, typically the PBA, are passed through.
+ *
+ * Return: 1 if handled successfully, -1 on access error
+ */
+static int pci_msix_table_access(struct pci_device *device, bool is_write,
+				 u64 addr, u32 *value)
+{
+	long offs = addr - device->msix_table_gphys;
+	struct pci_msix_vector vector;
+	unsigned int index;
+	u32 *shadow;
+
+	if (offs < 0 || (unsigned long)offs >= device->msix_num_vectors *
+	    sizeof(struct pci_msix_vector)) {
+		if (is_write)
+			mmio_write32(device->msix_table + offs, *value);
+		else
+			*value = mmio_read32(device->msix_table + offs);
+		return 1;
+	}
+
+	if (offs & 0x3)
+		goto invalid_access;
+
+	index = offs / sizeof(struct pci_msix_vector);
+
+	spin_lock(&device->msi_lock);
+
+	pci_msix_sync_shadow(device);
+	shadow = (u32 *)device->msix_vectors + offs / 4;
+
+	if (!is_write) {
+		*value = *shadow;
+	} else if (*value != *shadow) {
+		vector = device->msix_vectors[index];
+		((u32 *)&vector)[(offs % sizeof(vector)) / 4] = *value;
+		if (!pci_msix_vector_valid(device, device->msix_ctrl,
+					   &vector)) {
+			spin_unlock(&device->msi_lock);
+			goto invalid_access;
+		}
+
+		*shadow = *value;
+		mmio_write32(device->msix_table + offs, *value);
+		/* flush posted write so that masking is effective on return */
+		mmio_read32(device->msix_table + offs);
+	}
+
+	spin_unlock(&device->msi_lock);
+
+	return 1;
+
+invalid_access:
+	panic_printk("FATAL: Invalid MSI-X table %s, device "
+		     "%04x:%02x:%02x.%x, entry %ld\n",
+		     is_write ? "write" : "read", device->info->domain,
+		     PCI_BDF_PARAMS(device->info->bdf),
+		     offs / (long)sizeof(struct pci_msix_vector));
+	return -1;
+}
+
+/**
+ * pci_msix_access_handler() - Handler for MMIO-accesses to MSI-X tables
+ * @cell:	Request issuing cell
+ * @is_write:	True if write access
+ * @addr:	Address accessed
+ * @value:	Pointer to value for reading/writing
+ *
+ * Return: 1 if handled successfully, 0 if unhandled, -1 on access error
+ */
+static int pci_msix_access_handler(const struct cell *cell, bool is_write,
+				   u64 addr, u32 *value)
+{
+	struct pci_device *device;
+	u64 table_page;
+
+	for_each_configured_pci_device(device, cell) {
+		if (!device->cell || !device->msix_table_gphys)
+			continue;
+
+		table_page = device->msix_table_gphys & PAGE_MASK;
+		if (addr >= table_page &&
+		    addr < table_page + pci_msix_table_pages(device) *
+		    PAGE_SIZE)
+			return pci_msix_table_access(device, is_write, addr,
+						     value);
+	}
+
+	return 0;
+}
+
+static u32 pci_cfg_ro_mask(const struct pci_device *device, u16 reg)
+{
+	if (reg < PCI_CONFIG_HEADER_SIZE)
+		return device->header_ro_mask ?
+			device->header_ro_mask[reg / 4] : 0;
+	if (reg < PCI_STD_CONFIG_SIZE && device->cap_hdr_bitmap &
+	    (1ULL << ((reg - PCI_CONFIG_HEADER_SIZE) / 4)))
+		return PCI_CAP_HDR_MASK;
+	return 0;
+}
+
+static void pci_cfg_fill_shadow(struct pci_device *device)
+{
+	u16 reg;
+
+	for (reg = 0; reg < PCI_STD_CONFIG_SIZE; reg += 4)
+		if (pci_cfg_ro_mask(device, reg))
+			device->cfg_shadow[reg / 4] =
+				pci_read_config(device->info->domain,
+						device->info->bdf, reg, 4);
+
+	/* concurrent fillers store identical values, just publish last */
+	memory_barrier();
+	device->cfg_shadow_valid = true;
+}
+
+/**
+ * pci_cfg_read_shadow() - Serve config space read from the shadow
+ * @device:	The device to be accessed
+ * @address:	Config space address
+ * @size:	Access size (1, 2 or 4 bytes)
+ * @value:	Pointer to buffer to receive the shadowed value
+ *
+ * Return: True if all accessed bytes are immutable and @value was filled.
+ */
+static bool pci_cfg_read_shadow(struct pci_device *device, u16 address,
+				unsigned int size, u32 *value)
+{
+	unsigned int bias_shift = (address & 0x3) * 8;
+	u32 mask = BYTE_MASK(size) << bias_shift;
+
+	if (address >= PCI_STD_CONFIG_SIZE ||
+	    (pci_cfg_ro_mask(device, address & ~0x3) & mask) != mask)
+		return false;
+
+	if (!device->cfg_shadow_valid)
+		pci_cfg_fill_shadow(device);
+
+	*value = (device->cfg_shadow[address / 4] >> bias_shift) &
+		BYTE_MASK(size);
+	return true;
+}
+
+static int pci_bar_index(const struct pci_device *device, u16 address)
+{
+	unsigned int num_bars = 0;
+
+	if (device->info->type == JAILHOUSE_PCI_TYPE_DEVICE)
+		num_bars = PCI_NUM_BARS;
+	else if (device->info->type == JAILHOUSE_PCI_TYPE_BRIDGE)
+		num_bars = PCI_NUM_BRIDGE_BARS;
+
+	if (address < PCI_CFG_BAR || address >= PCI_CFG_BAR + num_bars * 4)
+		return -1;
+	return (address - PCI_CFG_BAR) / 4;
+}
+
+/**
+ * pci_bar_write_direct() - Moderate BAR write of a device with mapped config
+ * @device:	The device to be accessed
+ * @bar:	BAR index
+ * @address:	Config space address
+ * @value:	Value to be written
+ *
+ * Reads from a mapped config space cannot be intercepted, so sizing has to
+ * take place on the hardware. This is only permitted while decoding is
+ * disabled, and the programmed value is the only one accepted afterwards.
+ *
+ * Return: PCI_ACCESS_REJECT, PCI_ACCESS_PERFORM or PCI_ACCESS_DONE.
+ */
+static enum pci_access pci_bar_write_direct(struct pci_device *device,
+					    unsigned int bar, u16 address,
+					    u32 value)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	u32 current = pci_read_config(domain, bdf, address, 4);
+
+	if (device->bar_sizing & (1 << bar)) {
+		if (value == 0xffffffff)
+			return PCI_ACCESS_DONE;
+		if (value != device->bar_saved[bar])
+			return PCI_ACCESS_REJECT;
+		device->bar_sizing &= ~(1 << bar);
+		return PCI_ACCESS_PERFORM;
+	}
+
+	if (value == 0xffffffff) {
+		if (pci_read_config(domain, bdf, PCI_CFG_COMMAND, 2) &
+		    (PCI_CMD_IO | PCI_CMD_MEM))
+			return PCI_ACCESS_REJECT;
+		device->bar_saved[bar] = current;
+		device->bar_sizing |= 1 << bar;
+		return PCI_ACCESS_PERFORM;
+	}
+
+	return value == current ? PCI_ACCESS_DONE : PCI_ACCESS_REJECT;
+}
+
+/**
+ * pci_bar_write() - Emulate write access to a BAR
+ * @device:	The device to be accessed
+ * @bar:	BAR index
+ * @address:	Config space address
+ * @size:	Access size (1, 2 or 4 bytes)
+ * @value:	Value to be written
+ *
+ * Cells may size BARs and restore their programmed value afterwards, but not
+ * relocate them. Sizing requests are answered from the masks probed by
+ * pci_size_bars(), the hardware is not touched.
+ *
+ * Return: PCI_ACCESS_REJECT, PCI_ACCESS_PERFORM or PCI_ACCESS_DONE.
+ */
+static enum pci_access pci_bar_write(struct pci_device *device,
+				     unsigned int bar, u16 address,
+				     unsigned int size, u32 value)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+
+	if (size != 4)
+		return PCI_ACCESS_REJECT;
+
+	if (device->mmcfg_mapped)
+		return pci_bar_write_direct(device, bar, address, value);
+
+	if (value == 0xffffffff) {
+		if (!(device->bar_size_valid & (1 << bar)))
+			return PCI_ACCESS_REJECT;
+		device->bar_sizing |= 1 << bar;
+		return PCI_ACCESS_DONE;
+	}
+
+	device->bar_sizing &= ~(1 << bar);
+	if (value == pci_read_config(domain, bdf, address, 4))
+		return PCI_ACCESS_DONE;
+
+	return PCI_ACCESS_REJECT;
 }
 
 /**
@@ -176,21 +916,31 @@ pci_find_capability(struct pci_device *device, u16 address)
 enum pci_access pci_cfg_read_moderate(struct pci_device *device, u16 address,
 				      unsigned int size, u32 *value)
 {
-	const struct jailhouse_pci_capability *cap;
+	int bar;
 
 	if (!device) {
 		*value = -1;
 		return PCI_ACCESS_DONE;
 	}
 
-	if (address < PCI_CONFIG_HEADER_SIZE)
-		return PCI_ACCESS_PERFORM;
+	if (device->msi_cap && address >= device->msi_cap &&
+	    address < device->msi_cap + device->msi_cap_len)
+		return pci_msi_read(device, address, size, value);
 
-	cap = pci_find_capability(device, address);
-	if (!cap)
-		return PCI_ACCESS_PERFORM;
+	bar = pci_bar_index(device, address);
+	/*
+	 * With a mapped config space, sizing took place on the hardware and
+	 * the cached mask may not even have been probed.
+	 */
+	if (bar >= 0 && !device->mmcfg_mapped &&
+	    device->bar_sizing & (1 << bar)) {
+		*value = (device->bar_size_mask[bar] >>
+			  ((address & 0x3) * 8)) & BYTE_MASK(size);
+		return PCI_ACCESS_DONE;
+	}
 
-	// TODO: Emulate MSI/MSI-X etc.
+	if (pci_cfg_read_shadow(device, address, size, value))
+		return PCI_ACCESS_DONE;
 
 	return PCI_ACCESS_PERFORM;
 }
@@ -207,41 +957,101 @@ enum pci_access pci_cfg_read_moderate(struct pci_device *device, u16 address,
 enum pci_access pci_cfg_write_moderate(struct pci_device *device, u16 address,
 				       unsigned int size, u32 value)
 {
-	const struct jailhouse_pci_capability *cap;
-	/* initialize list to work around wrong compiler warning */
-	const struct pci_cfg_access *list = NULL;
-	unsigned int n, bias_shift, len = 0;
 	u32 mask;
+	int bar;
 
 	if (!device)
 		return PCI_ACCESS_REJECT;
 
+	bar = pci_bar_index(device, address);
+	if (bar >= 0)
+		return pci_bar_write(device, bar, address, size, value);
+
 	if (address < PCI_CONFIG_HEADER_SIZE) {
-		if (device->info->type == JAILHOUSE_PCI_TYPE_DEVICE) {
-			list = endpoint_write_access;
-			len = ARRAY_SIZE(endpoint_write_access);
-		} else if (device->info->type == JAILHOUSE_PCI_TYPE_BRIDGE) {
-			list = bridge_write_access;
-			len = ARRAY_SIZE(bridge_write_access);
-		}
+		mask = BYTE_MASK(size) << ((address & 0x3) * 8);
+		/* keep probed BAR addresses from being decoded */
+		if (device->bar_sizing && device->mmcfg_mapped &&
+		    (address & ~0x3) == PCI_CFG_COMMAND &&
+		    (value << ((address & 0x3) * 8)) & mask &
+		    (PCI_CMD_IO | PCI_CMD_MEM))
+			return PCI_ACCESS_REJECT;
+		if (device->header_write_mask &&
+		    (device->header_write_mask[address / 4] & mask) == mask)
+			return PCI_ACCESS_PERFORM;
+		return PCI_ACCESS_REJECT;
+	}
 
-		bias_shift = (address & 0x003) * 8;
-		mask = BYTE_MASK(size);
+	if (!pci_cfg_writable(device, address, size))
+		return PCI_ACCESS_REJECT;
 
-		for (n = 0; n < len; n++) {
-			if (list[n].reg_num == (address & 0xffc) &&
-			    ((list[n].mask >> bias_shift) & mask) == mask)
-				return PCI_ACCESS_PERFORM;
+	if (device->msi_cap && address >= device->msi_cap &&
+	    address < device->msi_cap + device->msi_cap_len)
+		return pci_msi_write(device, address, size, value);
+	if (device->msix_cap && address >= device->msix_cap &&
+	    address < device->msix_cap + device->msix_cap_len)
+		return pci_msix_write(device, address, size, value);
+
+	return PCI_ACCESS_PERFORM;
+}
+
+/**
+ * pci_mmcfg_init() - Map an MMCONFIG region
+ * @alloc:	MCFG allocation structure describing the region
+ *
+ * A PCI segment may be described by several allocations covering distinct
+ * bus ranges.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+static int pci_mmcfg_init(const struct acpi_mcfg_alloc *alloc)
+{
+	struct pci_mmcfg_region *mmcfg;
+	unsigned long size;
+	unsigned int bus;
+	void *space;
+	int err;
+
+	if (alloc->end_bus < alloc->start_bus)
+		return -EIO;
+
+	for (bus = alloc->start_bus; bus <= alloc->end_bus; bus++)
+		if (pci_mmcfg_find(alloc->segment_num, bus)) {
+			printk("ERROR: Overlapping MMCONFIG regions for PCI "
+			       "bus %04x:%02x\n", alloc->segment_num, bus);
+			return -EIO;
 		}
 
-		return PCI_ACCESS_REJECT;
+	if (pci_mmcfg_regions >= PCI_MAX_MMCFG_REGIONS) {
+		printk("ERROR: Too many MMCONFIG regions\n");
+		return -ERANGE;
 	}
+	mmcfg = &pci_mmcfg[pci_mmcfg_regions];
 
-	cap = pci_find_capability(device, address);
-	if (!cap || !(cap->flags & JAILHOUSE_PCICAPS_WRITE))
-		return PCI_ACCESS_REJECT;
+	size = (alloc->end_bus - alloc->start_bus + 1) * 256 * 4096;
+	space = page_alloc(&remap_pool, size / PAGE_SIZE);
+	if (!space)
+		return -ENOMEM;
 
-	return PCI_ACCESS_PERFORM;
+	err = page_map_create(&hv_paging_structs,
+			      alloc->base_addr +
+			      ((u64)alloc->start_bus << 20),
+			      size, (unsigned long)space,
+			      PAGE_DEFAULT_FLAGS | PAGE_FLAG_UNCACHED,
+			      PAGE_MAP_NON_COHERENT);
+	if (err) {
+		page_free(&remap_pool, space, size / PAGE_SIZE);
+		return err;
+	}
+
+	/* bias the mapping so that config addresses can be used as offset */
+	mmcfg->space = space - ((unsigned long)alloc->start_bus << 20);
+	mmcfg->base_addr = alloc->base_addr;
+	mmcfg->segment = alloc->segment_num;
+	mmcfg->start_bus = alloc->start_bus;
+	mmcfg->end_bus = alloc->end_bus;
+	pci_mmcfg_regions++;
+
+	return 0;
 }
 
 /**
@@ -252,37 +1062,53 @@ enum pci_access pci_cfg_write_moderate(struct pci_device *device, u16 address,
 int pci_init(void)
 {
 	struct acpi_mcfg_table *mcfg;
+	unsigned int n, num_allocs;
 	int err;
 
-	err = pci_cell_init(&root_cell);
-	if (err)
-		return err;
-
+	/* map all config spaces before the root cell devices are set up */
 	mcfg = (struct acpi_mcfg_table *)acpi_find_table("MCFG", NULL);
 	if (!mcfg)
-		return 0;
+		return pci_cell_init(&root_cell);
 
-	if (mcfg->header.length !=
-	    sizeof(struct acpi_mcfg_table) + sizeof(struct acpi_mcfg_alloc))
+	if (mcfg->header.length < sizeof(struct acpi_mcfg_table))
+		return -EIO;
+	num_allocs = (mcfg->header.length - sizeof(struct acpi_mcfg_table)) /
+		sizeof(struct acpi_mcfg_alloc);
+	if (mcfg->header.length != sizeof(struct acpi_mcfg_table) +
+	    num_allocs * sizeof(struct acpi_mcfg_alloc))
 		return -EIO;
 
-	pci_mmcfg_addr = mcfg->alloc_structs[0].base_addr;
-	pci_mmcfg_size = (mcfg->alloc_structs[0].end_bus + 1) * 256 * 4096;
-	pci_space = page_alloc(&remap_pool, pci_mmcfg_size / PAGE_SIZE);
-	if (!pci_space)
-		return -ENOMEM;
+	for (n = 0; n < num_allocs; n++) {
+		err = pci_mmcfg_init(&mcfg->alloc_structs[n]);
+		if (err)
+			return err;
+	}
 
-	end_bus = mcfg->alloc_structs[0].end_bus;
+	return pci_cell_init(&root_cell);
+}
 
-	return page_map_create(&hv_paging_structs,
-			       mcfg->alloc_structs[0].base_addr,
-			       pci_mmcfg_size, (unsigned long)pci_space,
-			       PAGE_DEFAULT_FLAGS | PAGE_FLAG_UNCACHED,
-			       PAGE_MAP_NON_COHERENT);
+/**
+ * pci_mmcfg_lookup() - Find MMCONFIG region covering a physical address
+ * @addr:	Physical address
+ *
+ * Return: Region containing @addr or NULL if none.
+ */
+static struct pci_mmcfg_region *pci_mmcfg_lookup(u64 addr)
+{
+	struct pci_mmcfg_region *mmcfg;
+
+	for (mmcfg = pci_mmcfg; mmcfg < pci_mmcfg + pci_mmcfg_regions; mmcfg++)
+		if (addr >= mmcfg->base_addr + ((u64)mmcfg->start_bus << 20) &&
+		    addr < mmcfg->base_addr +
+			   ((u64)(mmcfg->end_bus + 1) << 20) - 4)
+			return mmcfg;
+
+	return NULL;
 }
 
 /**
  * pci_mmio_access_handler() - Handler for MMIO-accesses to PCI config space
+ * 			       and to trapped MSI-X tables
  * @cell:	Request issuing cell
  * @is_write:	True if write access
  * @addr:	Address accessed
@@ -293,53 +1119,229 @@ int pci_init(void)
 int pci_mmio_access_handler(const struct cell *cell, bool is_write,
 			    u64 addr, u32 *value)
 {
+	struct pci_mmcfg_region *mmcfg = pci_mmcfg_lookup(addr);
 	u32 mmcfg_offset, reg_addr;
 	struct pci_device *device;
 	enum pci_access access;
+	u16 domain;
 
-	if (!pci_space || addr < pci_mmcfg_addr ||
-	    addr >= (pci_mmcfg_addr + pci_mmcfg_size - 4))
-		return 0;
+	if (!mmcfg)
+		return pci_msix_access_handler(cell, is_write, addr, value);
 
-	mmcfg_offset = addr - pci_mmcfg_addr;
+	domain = mmcfg->segment;
+	mmcfg_offset = addr - mmcfg->base_addr;
 	reg_addr = mmcfg_offset & 0xfff;
-	device = pci_get_assigned_device(cell, mmcfg_offset >> 12);
+	device = pci_get_assigned_device(cell, domain, mmcfg_offset >> 12);
 
 	if (is_write) {
 		access = pci_cfg_write_moderate(device, reg_addr, 4, *value);
 		if (access == PCI_ACCESS_REJECT)
 			goto invalid_access;
 		if (access == PCI_ACCESS_PERFORM)
-			mmio_write32(pci_space + mmcfg_offset, *value);
+			mmio_write32(mmcfg->space + mmcfg_offset, *value);
 	} else {
 		access = pci_cfg_read_moderate(device, reg_addr, 4, value);
 		if (access == PCI_ACCESS_PERFORM)
-			*value = mmio_read32(pci_space + mmcfg_offset);
+			*value = mmio_read32(mmcfg->space + mmcfg_offset);
 	}
 
 	return 1;
 
 invalid_access:
-	panic_printk("FATAL: Invalid PCI MMCONFIG write, device %02x:%02x.%x, "
-		     "reg: %\n", PCI_BDF_PARAMS(mmcfg_offset >> 12), reg_addr);
+	panic_printk("FATAL: Invalid PCI MMCONFIG write, device "
+		     "%04x:%02x:%02x.%x, reg: %x\n", domain,
+		     PCI_BDF_PARAMS(mmcfg_offset >> 12), reg_addr);
 	return -1;
 
 }
 
+static bool pci_get_config_page(const struct pci_device *device,
+				struct jailhouse_memory *mem)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	struct pci_mmcfg_region *mmcfg = pci_mmcfg_find(domain, PCI_BUS(bdf));
+
+	if (!(device->info->flags & JAILHOUSE_PCI_MMCONFIG_RO) || !mmcfg)
+		return false;
+
+	mem->phys_start = mmcfg->base_addr + ((u64)bdf << 12);
+	mem->virt_start = mem->phys_start;
+	mem->size = PAGE_SIZE;
+	mem->flags = JAILHOUSE_MEM_READ;
+	return true;
+}
+
+static void pci_map_config_page(struct pci_device *device)
+{
+	struct jailhouse_memory mem;
+
+	if (device->mmcfg_mapped || !pci_get_config_page(device, &mem))
+		return;
+
+	if (arch_map_memory_region(device->cell, &mem) < 0)
+		printk("WARNING: Failed to map config space of PCI device "
+		       "%04x:%02x:%02x.%x\n", device->info->domain,
+		       PCI_BDF_PARAMS(device->info->bdf));
+	else
+		device->mmcfg_mapped = true;
+}
+
+static void pci_unmap_config_page(struct pci_device *device)
+{
+	struct jailhouse_memory mem;
+
+	if (device->mmcfg_mapped && pci_get_config_page(device, &mem))
+		arch_unmap_memory_region(device->cell, &mem);
+	device->mmcfg_mapped = false;
+}
+
+/**
+ * pci_size_bars() - Probe the BAR sizes of a device
+ * @device:	The device to be probed
+ *
+ * Writes all ones to each BAR and reads back the size mask while decoding is
+ * disabled, so that the device can neither claim nor lose accesses during
+ * the probe. This is done once before the device is handed to a cell, later
+ * sizing requests of the cell are served from the cache.
+ */
+static void pci_size_bars(struct pci_device *device)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	unsigned int bar, num_bars = 0;
+	u16 address, cmd;
+	u32 orig;
+
+	if (device->info->type == JAILHOUSE_PCI_TYPE_DEVICE)
+		num_bars = PCI_NUM_BARS;
+	else if (device->info->type == JAILHOUSE_PCI_TYPE_BRIDGE)
+		num_bars = PCI_NUM_BRIDGE_BARS;
+
+	cmd = pci_read_config(domain, bdf, PCI_CFG_COMMAND, 2);
+	if (cmd & (PCI_CMD_IO | PCI_CMD_MEM))
+		pci_write_config(domain, bdf, PCI_CFG_COMMAND,
+				 cmd & ~(PCI_CMD_IO | PCI_CMD_MEM), 2);
+
+	for (bar = 0; bar < num_bars; bar++) {
+		address = PCI_CFG_BAR + bar * 4;
+		orig = pci_read_config(domain, bdf, address, 4);
+		pci_write_config(domain, bdf, address, 0xffffffff, 4);
+		device->bar_size_mask[bar] =
+			pci_read_config(domain, bdf, address, 4);
+		pci_write_config(domain, bdf, address, orig, 4);
+		device->bar_size_valid |= 1 << bar;
+	}
+
+	if (cmd & (PCI_CMD_IO | PCI_CMD_MEM))
+		pci_write_config(domain, bdf, PCI_CFG_COMMAND, cmd, 2);
+}
+
 static int pci_add_device(struct cell *cell, struct pci_device *device)
 {
-	printk("Adding PCI device %02x:%02x.%x to cell \"%s\"\n",
-	       PCI_BDF_PARAMS(device->info->bdf), cell->config->name);
-	return arch_pci_add_device(cell, device);
+	int err;
+
+	printk("Adding PCI device %04x:%02x:%02x.%x to cell \"%s\"\n",
+	       device->info->domain, PCI_BDF_PARAMS(device->info->bdf),
+	       cell->config->name);
+
+	if (!device->bar_size_valid)
+		pci_size_bars(device);
+
+	if (device->msi_cap)
+		pci_msi_init(device);
+
+	if (device->msix_cap) {
+		err = pci_msix_init(device);
+		if (err)
+			return err;
+	}
+
+	err = arch_pci_add_device(cell, device);
+	if (err)
+		pci_msix_exit(device);
+	return err;
 }
 
 static void pci_remove_device(struct pci_device *device)
 {
-	printk("Removing PCI device %02x:%02x.%x from cell \"%s\"\n",
-	       PCI_BDF_PARAMS(device->info->bdf), device->cell->config->name);
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	unsigned int bar;
+
+	printk("Removing PCI device %04x:%02x:%02x.%x from cell \"%s\"\n",
+	       domain, PCI_BDF_PARAMS(bdf), device->cell->config->name);
 	arch_pci_remove_device(device);
-	pci_write_config(device->info->bdf, PCI_CFG_COMMAND,
-			 PCI_CMD_INTX_OFF, 2);
+	pci_write_config(domain, bdf, PCI_CFG_COMMAND, PCI_CMD_INTX_OFF, 2);
+
+	if (device->mmcfg_mapped) {
+		pci_unmap_config_page(device);
+		for (bar = 0; bar < PCI_NUM_BARS; bar++)
+			if (device->bar_sizing & (1 << bar))
+				pci_write_config(domain, bdf,
+						 PCI_CFG_BAR + bar * 4,
+						 device->bar_saved[bar], 4);
+	}
+	device->bar_sizing = 0;
+
+	/* the next owner has to program its own interrupt routes */
+	if (device->msi_cap)
+		pci_write_config(domain, bdf, device->msi_cap + 2,
+				 (device->msi_regs[0] >> 16) &
+				 ~PCI_MSI_CTRL_ENABLE, 2);
+	if (device->msix_cap) {
+		pci_write_config(domain, bdf, device->msix_cap + 2,
+				 device->msix_ctrl & ~PCI_MSIX_CTRL_ENABLE, 2);
+		pci_msix_exit(device);
+	}
+}
+
+/**
+ * pci_prepare_moderation() - Precompute config space access permissions
+ * @cell:	Cell the device is configured for
+ * @device:	Device to be prepared
+ *
+ * Derives the header write mask, the capability write bitmap, the immutable
+ * fields to be shadowed and the locations of emulated capabilities so that
+ * config space accesses can be moderated without searching the configuration.
+ */
+static void pci_prepare_moderation(struct cell *cell,
+				   struct pci_device *device)
+{
+	const struct jailhouse_pci_capability *cap =
+		jailhouse_cell_pci_caps(cell->config) +
+		device->info->caps_start;
+	unsigned int n, pos, end;
+
+	if (device->info->type == JAILHOUSE_PCI_TYPE_DEVICE) {
+		device->header_write_mask = endpoint_write_mask;
+		device->header_ro_mask = endpoint_ro_mask;
+	} else if (device->info->type == JAILHOUSE_PCI_TYPE_BRIDGE) {
+		device->header_write_mask = bridge_write_mask;
+		device->header_ro_mask = bridge_ro_mask;
+	}
+
+	for (n = 0; n < device->info->num_caps; n++, cap++) {
+		if (cap->id == PCI_CAP_MSI) {
+			device->msi_cap = cap->start;
+			device->msi_cap_len = cap->len;
+		} else if (cap->id == PCI_CAP_MSIX) {
+			device->msix_cap = cap->start;
+			device->msix_cap_len = cap->len;
+		}
+
+		if (cap->start >= PCI_CONFIG_HEADER_SIZE &&
+		    cap->start < PCI_STD_CONFIG_SIZE && !(cap->start & 0x3))
+			device->cap_hdr_bitmap |= 1ULL <<
+				((cap->start - PCI_CONFIG_HEADER_SIZE) / 4);
+
+		if (!(cap->flags & JAILHOUSE_PCICAPS_WRITE))
+			continue;
+
+		end = cap->start + cap->len;
+		if (end > PCI_CONFIG_SPACE_SIZE)
+			end = PCI_CONFIG_SPACE_SIZE;
+		for (pos = cap->start; pos < end; pos++)
+			if (pos >= PCI_CONFIG_HEADER_SIZE)
+				set_bit(pos, device->cap_write_bitmap);
+	}
 }
 
 int pci_cell_init(struct cell *cell)
@@ -357,16 +1359,28 @@ int pci_cell_init(struct cell *cell)
 		return -ENOMEM;
 
 	/*
-	 * We order device states in the same way as the static information
-	 * so that we can use the index of the latter to find the former. For
-	 * the other way around and for obtaining the owner cell, we use more
-	 * handy pointers. The cell pointer also encodes active ownership.
+	 * We order device states in the same way as the static information.
+	 * Lookups by BDF go through a hash of the states. For obtaining the
+	 * owner cell, we use a handy pointer which also encodes active
+	 * ownership.
 	 */
 	for (ndev = 0; ndev < cell->config->num_pci_devices; ndev++) {
 		device = &cell->pci_devices[ndev];
 		device->info = &dev_infos[ndev];
+		pci_prepare_moderation(cell, device);
+	}
+
+	err = pci_device_hash_init(cell);
+	if (err) {
+		pci_cell_exit(cell);
+		return err;
+	}
+
+	for (ndev = 0; ndev < cell->config->num_pci_devices; ndev++) {
+		device = &cell->pci_devices[ndev];
 
 		root_device = pci_get_assigned_device(&root_cell,
+						      dev_infos[ndev].domain,
 						      dev_infos[ndev].bdf);
 		if (root_device) {
 			pci_remove_device(root_device);
@@ -387,18 +1401,236 @@ int pci_cell_init(struct cell *cell)
 
 static void pci_return_device_to_root_cell(struct pci_device *device)
 {
-	struct pci_device *root_device;
-
-	for_each_configured_pci_device(root_device, &root_cell)
-		if (root_device->info->domain == device->info->domain &&
-		    root_device->info->bdf == device->info->bdf) {
-			if (pci_add_device(&root_cell, root_device) < 0)
-				printk("WARNING: Failed to re-assign PCI "
-				       "device to root cell\n");
-			else
-				root_device->cell = &root_cell;
-			break;
+	struct pci_device *root_device =
+		pci_lookup_device(&root_cell, device->info->domain,
+				  device->info->bdf);
+
+	if (!root_device)
+		return;
+
+	if (pci_add_device(&root_cell, root_device) < 0)
+		printk("WARNING: Failed to re-assign PCI device to root "
+		       "cell\n");
+	else
+		root_device->cell = &root_cell;
+}
+
+static u16 pci_find_hw_capability(u16 domain, u16 bdf, u8 id)
+{
+	unsigned int ttl = (PCI_STD_CONFIG_SIZE - PCI_CONFIG_HEADER_SIZE) / 4;
+	u16 pos, hdr;
+
+	if (!(pci_read_config(domain, bdf, PCI_CFG_STATUS, 2) & PCI_STS_CAPS))
+		return 0;
+
+	pos = pci_read_config(domain, bdf, PCI_CFG_CAP_PTR, 1) & ~0x3;
+	while (pos >= PCI_CONFIG_HEADER_SIZE && ttl-- > 0) {
+		hdr = pci_read_config(domain, bdf, pos, 2);
+		if ((hdr & 0xff) == id)
+			return pos;
+		pos = (hdr >> 8) & ~0x3;
+	}
+	return 0;
+}
+
+/**
+ * pci_cell_owns_bus_range() - Check if only a cell uses a range of buses
+ * @cell:	Cell to check for
+ * @domain:	PCI segment of the buses
+ * @first:	First bus of the range
+ * @last:	Last bus of the range
+ *
+ * Return: True if no device on the buses is owned by any other cell.
+ */
+static bool pci_cell_owns_bus_range(struct cell *cell, u16 domain, u8 first,
+				    u8 last)
+{
+	struct pci_device *device;
+	struct cell *other;
+	bool owned = true;
+
+	spin_lock(&cell_list_lock);
+	for_each_cell(other) {
+		if (other == cell || !other->pci_devices)
+			continue;
+		for_each_configured_pci_device(device, other)
+			if (device->cell && device->info->domain == domain &&
+			    PCI_BUS(device->info->bdf) >= first &&
+			    PCI_BUS(device->info->bdf) <= last)
+				owned = false;
+	}
+	spin_unlock(&cell_list_lock);
+
+	return owned;
+}
+
+static void pci_prepare_reset(struct cell *cell, struct pci_device *device)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	unsigned int n;
+	u32 buses;
+	u16 cap;
+
+	for (n = 0; n < PCI_CONFIG_HEADER_SIZE / 4; n++)
+		device->saved_header[n] = pci_read_config(domain, bdf, n * 4, 4);
+	/* do not restore the all-ones pattern of BARs in the middle of sizing */
+	if (device->mmcfg_mapped)
+		for (n = 0; n < PCI_NUM_BARS; n++)
+			if (device->bar_sizing & (1 << n))
+				device->saved_header[PCI_CFG_BAR / 4 + n] =
+					device->bar_saved[n];
+
+	/*
+	 * A secondary bus reset hits every device below the bridge, so it is
+	 * only applied if no other cell owns any of them.
+	 */
+	device->reset_method = PCI_RESET_NONE;
+	if (device->info->type == JAILHOUSE_PCI_TYPE_BRIDGE) {
+		buses = device->saved_header[PCI_CFG_BUS_NUMBERS / 4];
+		if (pci_cell_owns_bus_range(cell, domain, (buses >> 8) & 0xff,
+					    (buses >> 16) & 0xff)) {
+			device->reset_method = PCI_RESET_BUS;
+			return;
+		}
+	}
+
+	cap = pci_find_hw_capability(domain, bdf, PCI_CAP_EXP);
+	if (cap && pci_read_config(domain, bdf, cap + PCI_EXP_DEVCAP, 4) &
+	    PCI_EXP_DEVCAP_FLR) {
+		device->reset_method = PCI_RESET_FLR;
+		device->reset_cap = cap;
+	}
+}
+
+static void pci_wait_transactions(struct pci_device *device, u64 deadline)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+
+	while (pci_read_config(domain, bdf, device->reset_cap + PCI_EXP_DEVSTA,
+			       2) & PCI_EXP_DEVSTA_TRPND) {
+		if (arch_get_time_us() >= deadline) {
+			printk("WARNING: PCI device %04x:%02x:%02x.%x has "
+			       "pending transactions, resetting anyway\n",
+			       domain, PCI_BDF_PARAMS(bdf));
+			return;
+		}
+		cpu_relax();
+	}
+}
+
+static bool pci_wait_ready(struct pci_device *device, u64 deadline)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	u16 vendor;
+
+	do {
+		vendor = pci_read_config(domain, bdf, PCI_CFG_VENDOR_ID, 2);
+		if (vendor != 0xffff && vendor != PCI_VENDOR_ID_CRS)
+			return true;
+		cpu_relax();
+	} while (arch_get_time_us() < deadline);
+
+	return false;
+}
+
+static void pci_restore_header(struct pci_device *device)
+{
+	u16 domain = device->info->domain, bdf = device->info->bdf;
+	unsigned int n;
+
+	/* cache line size, latency timer; BIST must not be triggered */
+	pci_write_config(domain, bdf, 0x0c,
+			 device->saved_header[0x0c / 4] & ~0xff000000, 4);
+	for (n = PCI_CFG_BAR / 4; n < PCI_CONFIG_HEADER_SIZE / 4; n++)
+		if (n != PCI_CFG_CAP_PTR / 4)
+			pci_write_config(domain, bdf, n * 4,
+					 device->saved_header[n], 4);
+	/* re-enable decoding only after the BARs are valid again */
+	pci_write_config(domain, bdf, PCI_CFG_COMMAND,
+			 device->saved_header[PCI_CFG_COMMAND / 4] & 0xffff, 2);
+}
+
+/**
+ * pci_reset_devices() - Reset the devices a cell is about to hand back
+ * @cell:	Cell whose assigned devices are reset
+ *
+ * Bridges whose secondary buses are exclusively used by the cell are reset
+ * via a secondary bus reset, other devices via Function Level Reset if they
+ * support it. All devices are reset together so that the mandatory recovery
+ * and ready times are only waited once. The config space header of each
+ * device is restored afterwards.
+ *
+ * This waits for more than 100 ms and must therefore be called while the
+ * root cell is running, with the CPUs of @cell suspended.
+ */
+void pci_reset_devices(struct cell *cell)
+{
+	unsigned int resets = 0, failed = 0;
+	struct pci_device *device;
+	u64 deadline;
+	u16 ctrl;
+
+	for_each_configured_pci_device(device, cell)
+		if (device->cell) {
+			pci_prepare_reset(cell, device);
+			if (device->reset_method != PCI_RESET_NONE)
+				resets++;
+		}
+	if (resets == 0)
+		return;
+
+	deadline = arch_get_time_us() + PCI_RESET_PENDING_TIMEOUT_US;
+	for_each_configured_pci_device(device, cell)
+		if (device->cell && device->reset_method == PCI_RESET_FLR)
+			pci_wait_transactions(device, deadline);
+
+	for_each_configured_pci_device(device, cell) {
+		if (!device->cell)
+			continue;
+		if (device->reset_method == PCI_RESET_FLR) {
+			ctrl = pci_read_config(device->info->domain,
+					       device->info->bdf,
+					       device->reset_cap +
+					       PCI_EXP_DEVCTL, 2);
+			pci_write_config(device->info->domain,
+					 device->info->bdf,
+					 device->reset_cap + PCI_EXP_DEVCTL,
+					 ctrl | PCI_EXP_DEVCTL_BCR_FLR, 2);
+		} else if (device->reset_method == PCI_RESET_BUS) {
+			ctrl = device->saved_header[PCI_CFG_BRIDGE_CTRL / 4]
+				>> 16;
+			pci_write_config(device->info->domain,
+					 device->info->bdf, PCI_CFG_BRIDGE_CTRL,
+					 ctrl | PCI_BRIDGE_CTL_BUS_RESET, 2);
+		}
+	}
+
+	delay_us(PCI_RESET_ASSERT_US);
+	for_each_configured_pci_device(device, cell)
+		if (device->cell && device->reset_method == PCI_RESET_BUS)
+			pci_write_config(device->info->domain,
+					 device->info->bdf, PCI_CFG_BRIDGE_CTRL,
+					 device->saved_header
+					 [PCI_CFG_BRIDGE_CTRL / 4] >> 16, 2);
+
+	delay_us(PCI_RESET_RECOVERY_US);
+
+	deadline = arch_get_time_us() + PCI_RESET_READY_TIMEOUT_US;
+	for_each_configured_pci_device(device, cell) {
+		if (!device->cell)
+			continue;
+		if (!pci_wait_ready(device, deadline)) {
+			printk("WARNING: PCI device %04x:%02x:%02x.%x did not "
+			       "recover from reset\n", device->info->domain,
+			       PCI_BDF_PARAMS(device->info->bdf));
+			failed++;
+			continue;
 		}
+		pci_restore_header(device);
+	}
+
+	printk("Reset %d PCI device(s) of cell \"%s\", %d failed\n", resets,
+	       cell->config->name, failed);
 }
 
 void pci_cell_exit(struct cell *cell)
@@ -411,15 +1643,91 @@ void pci_cell_exit(struct cell *cell)
 	 * Do not destroy the root cell. We will shut down the complete
 	 * hypervisor instead.
 	 */
-	if (cell == &root_cell)
+	if (cell == &root_cell || !cell->pci_devices)
 		return;
 
+	for_each_configured_pci_device(device, cell)
+		if (device->cell)
+			pci_remove_device(device);
+
+	for_each_configured_pci_device(device, cell)
+		if (device->cell)
+			pci_return_device_to_root_cell(device);
+
+	pci_device_hash_exit(cell);
+	page_free(&mem_pool, cell->pci_devices, array_size / PAGE_SIZE);
+	cell->pci_devices = NULL;
+}
+
+/**
+ * pci_msix_trap_table() - Remove MSI-X table pages from the owner's mapping
+ * @device:	Device with MSI-X capability
+ *
+ * Only the pages holding vector entries are unmapped from the owning cell so
+ * that accesses to them can be intercepted. The remaining parts of the BAR
+ * stay directly accessible.
+ *
+ * Return: 0 on success, negative error code otherwise.
+ */
+static int pci_msix_trap_table(struct pci_device *device)
+{
+	const struct jailhouse_memory *mem =
+		jailhouse_cell_mem_regions(device->cell->config);
+	u64 table_phys = device->msix_table_phys;
+	struct jailhouse_memory table;
+	unsigned int n;
+
+	for (n = 0; n < device->cell->config->num_memory_regions;
+	     n++, mem++) {
+		if (table_phys < mem->phys_start ||
+		    table_phys >= mem->phys_start + mem->size)
+			continue;
+
+		table.phys_start = table_phys & PAGE_MASK;
+		table.virt_start = mem->virt_start + table.phys_start -
+			mem->phys_start;
+		table.size = pci_msix_table_pages(device) * PAGE_SIZE;
+		table.flags = mem->flags;
+
+		device->msix_table_gphys =
+			table.virt_start + (table_phys & ~PAGE_MASK);
+
+		return arch_unmap_memory_region(device->cell, &table);
+	}
+
+	/* table not accessible by the cell, nothing to intercept */
+	return 0;
+}
+
+static void pci_cell_commit_devices(struct cell *cell)
+{
+	struct pci_device *device;
+
 	for_each_configured_pci_device(device, cell) {
 		if (!device->cell)
 			continue;
-		pci_remove_device(device);
-		pci_return_device_to_root_cell(device);
+		if (device->msix_vectors && pci_msix_trap_table(device) < 0)
+			printk("WARNING: Failed to trap MSI-X table of PCI "
+			       "device %04x:%02x:%02x.%x\n",
+			       device->info->domain,
+			       PCI_BDF_PARAMS(device->info->bdf));
+		pci_map_config_page(device);
 	}
+}
 
-	page_free(&mem_pool, cell->pci_devices, array_size / PAGE_SIZE);
+/**
+ * pci_config_commit() - Apply PCI-related changes of the cell configuration
+ * @cell_added_removed:	Cell that was added or removed, NULL if none
+ *
+ * Intercepts MSI-X vector tables and maps config spaces that are flagged
+ * JAILHOUSE_PCI_MMCONFIG_RO for the devices owned by the root cell and by
+ * @cell_added_removed. Must be called after the memory regions of the cells
+ * have been (re-)mapped and before the changes are committed to the CPUs.
+ */
+void pci_config_commit(struct cell *cell_added_removed)
+{
+	pci_cell_commit_devices(&root_cell);
+	if (cell_added_removed && cell_added_removed != &root_cell &&
+	    cell_added_removed->pci_devices)
+		pci_cell_commit_devices(cell_added_removed);
 }
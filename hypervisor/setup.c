@@ -107,6 +107,14 @@ static void init_early(unsigned int cpu_id)
 		hv_page.virt_start += PAGE_SIZE;
 	}
 
+	/* Let Linux read the fault log at its original location. */
+	hv_page.phys_start = page_map_hvirt2phys(&fault_log);
+	hv_page.virt_start = hv_page.phys_start;
+	hv_page.size = PAGE_ALIGN(sizeof(fault_log));
+	error = arch_map_memory_region(&root_cell, &hv_page);
+	if (error)
+		return;
+
 	page_map_dump_stats("after early setup");
 	printk("Initializing first processor:\n");
 }
@@ -19,12 +19,16 @@
 #include <errno.h>
 #include <limits.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 
 #include <jailhouse.h>
 
+#define JAILHOUSE_CELLS_DIR	"/sys/devices/jailhouse/cells"
+
 enum shutdown_load_mode {LOAD, SHUTDOWN};
 
 struct extension {
@@ -52,8 +56,10 @@ static void __attribute__((noreturn)) help(char *prog, int exit_status)
 	       "   cell load { ID | [--name] NAME } IMAGE "
 			"[ -a | --address ADDRESS] ...\n"
 	       "   cell start { ID | [--name] NAME }\n"
+	       "   cell restart { ID | [--name] NAME }\n"
 	       "   cell shutdown { ID | [--name] NAME }\n"
-	       "   cell destroy { ID | [--name] NAME }\n",
+	       "   cell destroy { ID | [--name] NAME }\n"
+	       "   cell wait { ID | [--name] NAME }\n",
 	       basename(prog));
 	for (ext = extensions; ext->cmd; ext++)
 		printf("   %s %s %s\n", ext->cmd, ext->subcmd, ext->help);
@@ -308,6 +314,8 @@ static int cell_simple_cmd(int argc, char *argv[], unsigned int command)
 		       "JAILHOUSE_CELL_START" :
 		       command == JAILHOUSE_CELL_DESTROY ?
 		       "JAILHOUSE_CELL_DESTROY" :
+		       command == JAILHOUSE_CELL_RESTART ?
+		       "JAILHOUSE_CELL_RESTART" :
 		       "<unknown command>");
 
 	close(fd);
@@ -315,6 +323,116 @@ static int cell_simple_cmd(int argc, char *argv[], unsigned int command)
 	return err;
 }
 
+static bool read_cell_attr(int fd, char *buffer, size_t size)
+{
+	ssize_t len;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		return false;
+	len = read(fd, buffer, size - 1);
+	if (len < 0)
+		return false;
+	buffer[len] = 0;
+	return true;
+}
+
+static void find_cell_dir(struct jailhouse_cell_id *cell_id, char *path,
+			  size_t size)
+{
+	struct dirent *entry;
+	char id_str[16];
+	DIR *cells_dir;
+	int fd;
+
+	if (cell_id->id == JAILHOUSE_CELL_ID_UNUSED) {
+		snprintf(path, size, "%s/%s", JAILHOUSE_CELLS_DIR,
+			 cell_id->name);
+		return;
+	}
+
+	cells_dir = opendir(JAILHOUSE_CELLS_DIR);
+	if (!cells_dir) {
+		fprintf(stderr, "opening %s: %s\n", JAILHOUSE_CELLS_DIR,
+			strerror(errno));
+		exit(1);
+	}
+
+	while ((entry = readdir(cells_dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		snprintf(path, size, "%s/%s/id", JAILHOUSE_CELLS_DIR,
+			 entry->d_name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		if (read_cell_attr(fd, id_str, sizeof(id_str)) &&
+		    strtol(id_str, NULL, 0) == cell_id->id) {
+			close(fd);
+			closedir(cells_dir);
+			snprintf(path, size, "%s/%s", JAILHOUSE_CELLS_DIR,
+				 entry->d_name);
+			return;
+		}
+		close(fd);
+	}
+
+	closedir(cells_dir);
+	fprintf(stderr, "cell %d not found\n", cell_id->id);
+	exit(1);
+}
+
+/*
+ * Blocks until the state of the cell changes, then prints the new state.
+ * The driver signals changes via sysfs_notify on the state attribute.
+ */
+static int cell_wait(int argc, char *argv[])
+{
+	struct jailhouse_cell_id cell_id;
+	char path[PATH_MAX], initial_state[32], state[32];
+	struct pollfd pollfd;
+	int id_args, fd;
+
+	id_args = parse_cell_id(&cell_id, argc - 3, &argv[3]);
+	if (id_args == 0 || 3 + id_args != argc)
+		help(argv[0], 1);
+
+	find_cell_dir(&cell_id, path, sizeof(path));
+	strncat(path, "/state", sizeof(path) - strlen(path) - 1);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "opening %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	/* sysfs only reports changes after the attribute was read */
+	if (!read_cell_attr(fd, initial_state, sizeof(initial_state))) {
+		perror("reading cell state");
+		exit(1);
+	}
+
+	do {
+		pollfd.fd = fd;
+		pollfd.events = POLLPRI | POLLERR;
+		if (poll(&pollfd, 1, -1) < 0) {
+			perror("poll");
+			exit(1);
+		}
+		if (!read_cell_attr(fd, state, sizeof(state))) {
+			/* the attribute is gone along with the cell */
+			printf("destroyed\n");
+			close(fd);
+			return 0;
+		}
+	} while (strcmp(state, initial_state) == 0);
+
+	printf("%s", state);
+	close(fd);
+
+	return 0;
+}
+
 static int cell_management(int argc, char *argv[])
 {
 	int err;
@@ -328,10 +446,14 @@ static int cell_management(int argc, char *argv[])
 		err = cell_shutdown_load(argc, argv, LOAD);
 	} else if (strcmp(argv[2], "start") == 0) {
 		err = cell_simple_cmd(argc, argv, JAILHOUSE_CELL_START);
+	} else if (strcmp(argv[2], "restart") == 0) {
+		err = cell_simple_cmd(argc, argv, JAILHOUSE_CELL_RESTART);
 	} else if (strcmp(argv[2], "shutdown") == 0) {
 		err = cell_shutdown_load(argc, argv, SHUTDOWN);
 	} else if (strcmp(argv[2], "destroy") == 0) {
 		err = cell_simple_cmd(argc, argv, JAILHOUSE_CELL_DESTROY);
+	} else if (strcmp(argv[2], "wait") == 0) {
+		err = cell_wait(argc, argv);
 	} else {
 		call_extension_script("cell", argc, argv);
 		help(argv[0], 1);